@@ -0,0 +1,563 @@
+#include "AttributeCoder.h"
+#include "RangeCoder.h"
+#include "Encoder.h"
+#include "OctahedralQuantizer.h"
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+using namespace CPC;
+
+// the statistics restart every block, large enough for them to settle and small enough to spread over the threads
+const size_t GROUPS_PER_BLOCK = 1 << 14;
+const size_t NUM_OF_LENGTH_BITS = 7; // bit length of a 64 bits residual, 0 to 64
+const size_t NUM_OF_POSITION_CONTEXTS = 2; // first leaf of its group, predicted from the previous group, or the next ones
+
+// Adaptive probabilities of a residual, its bit length then the bits below the leading one
+struct ResidualModel
+{
+    ResidualModel()
+    {
+        std::fill(&lengths[0][0], &lengths[0][0] + sizeof(lengths) / sizeof(unsigned short), INITIAL_PROBABILITY);
+        std::fill(&mantissas[0][0], &mantissas[0][0] + sizeof(mantissas) / sizeof(unsigned short), INITIAL_PROBABILITY);
+    }
+
+    unsigned short lengths[NUM_OF_POSITION_CONTEXTS][1 << NUM_OF_LENGTH_BITS];
+    unsigned short mantissas[65][64];
+};
+
+// Adaptive probabilities of one block of scalars and colors
+struct AttributeModel
+{
+    AttributeModel()
+    {
+        std::fill(&colors[0][0][0], &colors[0][0][0] + sizeof(colors) / sizeof(unsigned short), INITIAL_PROBABILITY);
+    }
+
+    ResidualModel scalars;
+    // the color residuals are one byte per channel
+    unsigned short colors[NUM_OF_POSITION_CONTEXTS][3][256];
+};
+
+// Adaptive probabilities of one block of normals, one model per octahedral coordinate
+struct NormalModel
+{
+    ResidualModel coordinates[2];
+};
+
+// Prediction of the N components of the leaves of a group, the average of the siblings already coded or the average of the previous group
+template <int N>
+class GroupPredictor
+{
+    public:
+        GroupPredictor() : count(0)
+        {
+            for (int c = 0; c < N; ++c)
+            {
+                sums[c] = 0;
+                previous[c] = 0;
+            }
+        }
+
+        unsigned int getContext() const { return count ? 1 : 0; }
+
+        long long predict(int component) const
+        {
+            return count ? std::llround((double)sums[component] / count) : previous[component];
+        }
+
+        void add(const long long* values)
+        {
+            ++count;
+            for (int c = 0; c < N; ++c)
+            {
+                sums[c] += values[c];
+            }
+        }
+
+        void endGroup()
+        {
+            for (int c = 0; c < N; ++c)
+            {
+                previous[c] = predict(c);
+                sums[c] = 0;
+            }
+            count = 0;
+        }
+
+    protected:
+        unsigned int count;
+        long long sums[N];
+        long long previous[N];
+};
+
+// the scalar then the 3 color channels
+typedef GroupPredictor<4> AttributePredictor;
+typedef GroupPredictor<2> NormalPredictor;
+
+static void encodeResidual(RangeEncoder& encoder, ResidualModel& model, unsigned int context, unsigned long long value)
+{
+    unsigned int length = 0;
+    for (unsigned long long v = value; v; v >>= 1)
+    {
+        ++length;
+    }
+
+    unsigned int node = 1;
+    for (int b = NUM_OF_LENGTH_BITS - 1; b >= 0; --b)
+    {
+        unsigned int bit = (length >> b) & 1;
+        encoder.encodeBit(model.lengths[context][node], bit);
+        node = (node << 1) | bit;
+    }
+    // the leading one is implied by the length
+    for (int b = (int)length - 2; b >= 0; --b)
+    {
+        encoder.encodeBit(model.mantissas[length][b], (unsigned int)(value >> b) & 1);
+    }
+}
+
+static unsigned long long decodeResidual(RangeDecoder& decoder, ResidualModel& model, unsigned int context)
+{
+    unsigned int node = 1;
+    for (size_t b = 0; b < NUM_OF_LENGTH_BITS; ++b)
+    {
+        node = (node << 1) | decoder.decodeBit(model.lengths[context][node]);
+    }
+    unsigned int length = std::min(node - (1 << NUM_OF_LENGTH_BITS), 64u);
+
+    if (length == 0)
+        return 0;
+    unsigned long long value = 1;
+    for (int b = (int)length - 2; b >= 0; --b)
+    {
+        value = (value << 1) | decoder.decodeBit(model.mantissas[length][b]);
+    }
+    return value;
+}
+
+// the color residual wrap around, and is zigzagged so the small ones of both signs are the low bytes
+static unsigned char zigzagByte(unsigned char value, unsigned char prediction)
+{
+    signed char delta = (signed char)(value - prediction);
+    return (unsigned char)((delta << 1) ^ (delta >> 7));
+}
+
+static unsigned char unzigzagByte(unsigned char residual, unsigned char prediction)
+{
+    unsigned char delta = (unsigned char)((residual >> 1) ^ -(residual & 1));
+    return (unsigned char)(prediction + delta);
+}
+
+// first group and first leaf of every block
+static void computeBlocks(const std::vector<unsigned char>& groupSizes, std::vector<size_t>& firstGroups, std::vector<size_t>& firstLeaves)
+{
+    firstGroups.clear();
+    firstLeaves.clear();
+    size_t leaf = 0;
+    for (size_t group = 0; group < groupSizes.size(); ++group)
+    {
+        if (group % GROUPS_PER_BLOCK == 0)
+        {
+            firstGroups.push_back(group);
+            firstLeaves.push_back(leaf);
+        }
+        leaf += groupSizes[group];
+    }
+    firstGroups.push_back(groupSizes.size());
+    firstLeaves.push_back(leaf);
+}
+
+// the size of every block, then the blocks
+static void writeBlocks(const std::vector<std::vector<unsigned char>>& blocks, std::vector<unsigned char>& output)
+{
+    for (auto& block : blocks)
+    {
+        unsigned int blockSize = (unsigned int)block.size();
+        output.insert(output.end(), (const unsigned char*)&blockSize, (const unsigned char*)&blockSize + sizeof(blockSize));
+    }
+    for (auto& block : blocks)
+    {
+        output.insert(output.end(), block.begin(), block.end());
+    }
+}
+
+// start of every block written at pos by writeBlocks, false if they don't fit in the input
+static bool readBlocks(const unsigned char* input, size_t size, size_t pos, size_t numOfBlocks, std::vector<size_t>& blockOffsets)
+{
+    if (pos > size || size - pos < numOfBlocks * sizeof(unsigned int))
+        return false;
+    blockOffsets.resize(numOfBlocks + 1);
+    blockOffsets[0] = pos + numOfBlocks * sizeof(unsigned int);
+    for (size_t block = 0; block < numOfBlocks; ++block)
+    {
+        unsigned int blockSize;
+        memcpy(&blockSize, input + pos, sizeof(blockSize));
+        pos += sizeof(blockSize);
+        blockOffsets[block + 1] = blockOffsets[block] + blockSize;
+    }
+    return blockOffsets[numOfBlocks] <= size;
+}
+
+void AttributeCoder::computeGroupSizes(const std::vector<MortonLevel>& levels, std::vector<unsigned char>& groupSizes)
+{
+    groupSizes.clear();
+    if (levels.empty())
+        return;
+
+    for (auto children : levels.back().children)
+    {
+        if (children)
+            groupSizes.push_back(childCount(children));
+    }
+    for (auto& level : levels)
+    {
+        for (auto children : level.children)
+        {
+            if (children == 0)
+                groupSizes.push_back(1);
+        }
+    }
+}
+
+void AttributeCoder::computeLeafAttributes(Octree& octree, const PointCloud& pointCloud, PointCloud& leaves)
+{
+    auto& levels = octree.getMortonLevels();
+    const unsigned int maxDepth = octree.getMaxDepth();
+    if (levels.empty())
+        return;
+
+    // the full depth leaves then the truncated ones level by level, like Octree::generatePointCloud
+    MortonLevel leafLevel;
+    levels.back().expandChildren(leafLevel);
+    std::vector<std::vector<unsigned long long>> truncatedCodes(maxDepth);
+    std::vector<size_t> truncatedOffsets(maxDepth);
+    size_t numOfLeaves = leafLevel.size();
+    for (unsigned int level = 0; level < maxDepth; ++level)
+    {
+        truncatedOffsets[level] = numOfLeaves;
+        for (size_t i = 0; i < levels[level].size(); ++i)
+        {
+            if (levels[level].children[i] == 0)
+                truncatedCodes[level].push_back(levels[level].codes[i]);
+        }
+        numOfLeaves += truncatedCodes[level].size();
+    }
+
+    // position of the leaf of every point, the searches are the costly part
+    const size_t NO_LEAF = (size_t)-1;
+    std::vector<size_t> leafIndices(pointCloud.positions.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, leafIndices.size(), 1 << 12), [&](const tbb::blocked_range<size_t>& range)
+    {
+        std::vector<unsigned long long> codes(range.size());
+        octree.computeLeafAddresses(&pointCloud.positions[range.begin()], range.size(), nullptr, codes.data());
+        for (size_t i = 0; i < range.size(); ++i)
+        {
+            unsigned long long code = codes[i];
+            size_t& leafIndex = leafIndices[range.begin() + i];
+            leafIndex = NO_LEAF;
+
+            auto leaf = std::lower_bound(leafLevel.codes.begin(), leafLevel.codes.end(), code);
+            if (leaf != leafLevel.codes.end() && *leaf == code)
+            {
+                leafIndex = leaf - leafLevel.codes.begin();
+                continue;
+            }
+            for (int level = (int)maxDepth - 1; level >= 0; --level)
+            {
+                auto& nodeCodes = truncatedCodes[level];
+                unsigned long long nodeCode = code >> (3 * (maxDepth - level));
+                auto node = std::lower_bound(nodeCodes.begin(), nodeCodes.end(), nodeCode);
+                if (node != nodeCodes.end() && *node == nodeCode)
+                {
+                    leafIndex = truncatedOffsets[level] + (node - nodeCodes.begin());
+                    break;
+                }
+            }
+        }
+    });
+
+    std::vector<unsigned int> counts(numOfLeaves, 0);
+    std::vector<double> scalarSums(leaves.hasScalar ? numOfLeaves : 0, 0.0);
+    std::vector<unsigned int> colorSums(leaves.hasColor ? numOfLeaves * 3 : 0, 0);
+    std::vector<Eigen::Vector3f> normalSums(leaves.hasNormal ? numOfLeaves : 0, Eigen::Vector3f::Zero());
+    for (size_t i = 0; i < leafIndices.size(); ++i)
+    {
+        size_t leaf = leafIndices[i];
+        if (leaf == NO_LEAF)
+            continue;
+        ++counts[leaf];
+        if (leaves.hasScalar)
+            scalarSums[leaf] += pointCloud.scalars[i];
+        if (leaves.hasColor)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                colorSums[leaf * 3 + c] += pointCloud.colors[i][c];
+            }
+        }
+        if (leaves.hasNormal)
+            normalSums[leaf] += pointCloud.normals[i];
+    }
+
+    if (leaves.hasScalar)
+        leaves.scalars.assign(numOfLeaves, 0.f);
+    if (leaves.hasColor)
+        leaves.colors.assign(numOfLeaves, Vector3u::Zero());
+    // the sum of the normals is already the direction of their average
+    if (leaves.hasNormal)
+    {
+        leaves.normals.swap(normalSums);
+        for (auto& normal : leaves.normals)
+        {
+            float length = normal.norm();
+            if (length > 0.f)
+                normal /= length;
+        }
+    }
+    for (size_t leaf = 0; leaf < numOfLeaves; ++leaf)
+    {
+        unsigned int count = counts[leaf];
+        if (!count)
+            continue;
+        if (leaves.hasScalar)
+            leaves.scalars[leaf] = (float)(scalarSums[leaf] / count);
+        if (leaves.hasColor)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                leaves.colors[leaf][c] = (unsigned char)((colorSums[leaf * 3 + c] + count / 2) / count);
+            }
+        }
+    }
+}
+
+void AttributeCoder::encode(const std::vector<MortonLevel>& levels, const PointCloud& leaves, float scalarTolerance, std::vector<unsigned char>& output)
+{
+    const bool hasScalar = leaves.hasScalar && scalarTolerance > 0.f;
+    const bool hasColor = leaves.hasColor;
+    output.clear();
+
+    std::vector<unsigned char> groupSizes;
+    computeGroupSizes(levels, groupSizes);
+    std::vector<size_t> firstGroups, firstLeaves;
+    computeBlocks(groupSizes, firstGroups, firstLeaves);
+    const size_t numOfBlocks = firstGroups.size() - 1;
+
+    // the quantization step, the values are rounded to the nearest multiple so the error stay within the tolerance
+    const float step = 2.f * scalarTolerance;
+    if (hasScalar)
+        output.insert(output.end(), (const unsigned char*)&step, (const unsigned char*)&step + sizeof(step));
+
+    std::vector<std::vector<unsigned char>> blocks(numOfBlocks);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfBlocks, 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t block = range.begin(); block != range.end(); ++block)
+        {
+            RangeEncoder encoder(blocks[block]);
+            std::unique_ptr<AttributeModel> model(new AttributeModel());
+            AttributePredictor predictor;
+            size_t leaf = firstLeaves[block];
+            for (size_t group = firstGroups[block]; group < firstGroups[block + 1]; ++group)
+            {
+                for (unsigned char i = 0; i < groupSizes[group]; ++i, ++leaf)
+                {
+                    unsigned int context = predictor.getContext();
+                    long long values[4] = {};
+                    if (hasScalar)
+                    {
+                        float value = leaves.scalars[leaf];
+                        values[0] = std::isfinite(value) ? std::llround(value / step) : 0;
+                        encodeResidual(encoder, model->scalars, context, EncodedData::zigzagEncode(values[0] - predictor.predict(0)));
+                    }
+                    if (hasColor)
+                    {
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            values[1 + c] = leaves.colors[leaf][c];
+                            encoder.encodeByte(model->colors[context][c], zigzagByte((unsigned char)values[1 + c], (unsigned char)predictor.predict(1 + c)));
+                        }
+                    }
+                    predictor.add(values);
+                }
+                predictor.endGroup();
+            }
+            encoder.flush();
+        }
+    });
+
+    writeBlocks(blocks, output);
+}
+
+bool AttributeCoder::decode(const std::vector<MortonLevel>& levels, const unsigned char* input, size_t size, PointCloud& leaves)
+{
+    std::vector<unsigned char> groupSizes;
+    computeGroupSizes(levels, groupSizes);
+    std::vector<size_t> firstGroups, firstLeaves;
+    computeBlocks(groupSizes, firstGroups, firstLeaves);
+    const size_t numOfBlocks = firstGroups.size() - 1;
+    const size_t numOfLeaves = firstLeaves.back();
+
+    size_t pos = 0;
+    float step = 0.f;
+    if (leaves.hasScalar)
+    {
+        if (size < sizeof(step))
+            return false;
+        memcpy(&step, input, sizeof(step));
+        pos += sizeof(step);
+    }
+
+    std::vector<size_t> blockOffsets;
+    if (!readBlocks(input, size, pos, numOfBlocks, blockOffsets))
+        return false;
+
+    if (leaves.hasScalar)
+        leaves.scalars.resize(numOfLeaves);
+    if (leaves.hasColor)
+        leaves.colors.resize(numOfLeaves);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfBlocks, 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t block = range.begin(); block != range.end(); ++block)
+        {
+            RangeDecoder decoder(input + blockOffsets[block], blockOffsets[block + 1] - blockOffsets[block]);
+            std::unique_ptr<AttributeModel> model(new AttributeModel());
+            AttributePredictor predictor;
+            size_t leaf = firstLeaves[block];
+            for (size_t group = firstGroups[block]; group < firstGroups[block + 1]; ++group)
+            {
+                for (unsigned char i = 0; i < groupSizes[group]; ++i, ++leaf)
+                {
+                    unsigned int context = predictor.getContext();
+                    long long values[4] = {};
+                    if (leaves.hasScalar)
+                    {
+                        values[0] = predictor.predict(0) + EncodedData::zigzagDecode(decodeResidual(decoder, model->scalars, context));
+                        leaves.scalars[leaf] = (float)(values[0] * (double)step);
+                    }
+                    if (leaves.hasColor)
+                    {
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            values[1 + c] = unzigzagByte(decoder.decodeByte(model->colors[context][c]), (unsigned char)predictor.predict(1 + c));
+                            leaves.colors[leaf][c] = (unsigned char)values[1 + c];
+                        }
+                    }
+                    predictor.add(values);
+                }
+                predictor.endGroup();
+            }
+        }
+    });
+    return true;
+}
+
+void AttributeCoder::encodeNormals(const std::vector<MortonLevel>& levels, const PointCloud& leaves, unsigned int normalBits, std::vector<unsigned char>& output)
+{
+    output.clear();
+
+    std::vector<unsigned char> groupSizes;
+    computeGroupSizes(levels, groupSizes);
+    std::vector<size_t> firstGroups, firstLeaves;
+    computeBlocks(groupSizes, firstGroups, firstLeaves);
+    const size_t numOfBlocks = firstGroups.size() - 1;
+
+    const OctahedralQuantizer quantizer(normalBits);
+    const unsigned int bits = quantizer.getBits();
+    const unsigned int mask = (1u << bits) - 1;
+    output.push_back((unsigned char)bits);
+
+    std::vector<unsigned int> codes(leaves.normals.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, codes.size(), 1 << 14), [&](const tbb::blocked_range<size_t>& range)
+    {
+        quantizer.encode(&leaves.normals[range.begin()], range.size(), &codes[range.begin()]);
+    });
+
+    // the two octahedral coordinates are predicted like the other attributes
+    std::vector<std::vector<unsigned char>> blocks(numOfBlocks);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfBlocks, 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t block = range.begin(); block != range.end(); ++block)
+        {
+            RangeEncoder encoder(blocks[block]);
+            std::unique_ptr<NormalModel> model(new NormalModel());
+            NormalPredictor predictor;
+            size_t leaf = firstLeaves[block];
+            for (size_t group = firstGroups[block]; group < firstGroups[block + 1]; ++group)
+            {
+                for (unsigned char i = 0; i < groupSizes[group]; ++i, ++leaf)
+                {
+                    unsigned int context = predictor.getContext();
+                    long long values[2] = { codes[leaf] >> bits, codes[leaf] & mask };
+                    for (int c = 0; c < 2; ++c)
+                    {
+                        encodeResidual(encoder, model->coordinates[c], context, EncodedData::zigzagEncode(values[c] - predictor.predict(c)));
+                    }
+                    predictor.add(values);
+                }
+                predictor.endGroup();
+            }
+            encoder.flush();
+        }
+    });
+
+    writeBlocks(blocks, output);
+}
+
+bool AttributeCoder::decodeNormals(const std::vector<MortonLevel>& levels, const unsigned char* input, size_t size, PointCloud& leaves)
+{
+    std::vector<unsigned char> groupSizes;
+    computeGroupSizes(levels, groupSizes);
+    std::vector<size_t> firstGroups, firstLeaves;
+    computeBlocks(groupSizes, firstGroups, firstLeaves);
+    const size_t numOfBlocks = firstGroups.size() - 1;
+    const size_t numOfLeaves = firstLeaves.back();
+
+    if (size < 1)
+        return false;
+    const OctahedralQuantizer quantizer(input[0]);
+    const unsigned int bits = quantizer.getBits();
+    const unsigned int mask = (1u << bits) - 1;
+
+    std::vector<size_t> blockOffsets;
+    if (!readBlocks(input, size, 1, numOfBlocks, blockOffsets))
+        return false;
+
+    std::vector<unsigned int> codes(numOfLeaves);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfBlocks, 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t block = range.begin(); block != range.end(); ++block)
+        {
+            RangeDecoder decoder(input + blockOffsets[block], blockOffsets[block + 1] - blockOffsets[block]);
+            std::unique_ptr<NormalModel> model(new NormalModel());
+            NormalPredictor predictor;
+            size_t leaf = firstLeaves[block];
+            for (size_t group = firstGroups[block]; group < firstGroups[block + 1]; ++group)
+            {
+                for (unsigned char i = 0; i < groupSizes[group]; ++i, ++leaf)
+                {
+                    unsigned int context = predictor.getContext();
+                    long long values[2];
+                    for (int c = 0; c < 2; ++c)
+                    {
+                        values[c] = predictor.predict(c) + EncodedData::zigzagDecode(decodeResidual(decoder, model->coordinates[c], context));
+                    }
+                    codes[leaf] = (((unsigned int)values[0] & mask) << bits) | ((unsigned int)values[1] & mask);
+                    predictor.add(values);
+                }
+                predictor.endGroup();
+            }
+        }
+    });
+
+    leaves.normals.resize(numOfLeaves);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfLeaves, 1 << 14), [&](const tbb::blocked_range<size_t>& range)
+    {
+        quantizer.decode(&codes[range.begin()], range.size(), &leaves.normals[range.begin()]);
+    });
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "Octree.h"
+
+namespace CPC
+{
+    // Entropy code the scalars, colors and normals of the leaves, one value per leaf in the order of Octree::generatePointCloud.
+    // The leaves of a parent are predicted from the average of their siblings already coded, the first one from the average
+    // of the previous parent, and the residuals are range coded. The scalars are quantized with a step of twice the tolerance,
+    // the colors are lossless and the normals are quantized on the octahedron. The leaves are cut into blocks with their own statistics, so the blocks are coded in parallel.
+    class AttributeCoder
+    {
+        public:
+            // average the attributes of the points falling into each leaf, only the attribute channels of leaves are filled
+            static void computeLeafAttributes(Octree& octree, const PointCloud& pointCloud, PointCloud& leaves);
+            // code the channels set on leaves, the scalars only when scalarTolerance is positive
+            static void encode(const std::vector<MortonLevel>& levels, const PointCloud& leaves, float scalarTolerance, std::vector<unsigned char>& output);
+            // fill the channels set on leaves, return false if the stream doesn't match the levels
+            static bool decode(const std::vector<MortonLevel>& levels, const unsigned char* input, size_t size, PointCloud& leaves);
+            // code the normals of leaves on the octahedron with normalBits per side, in a stream of their own with the same prediction
+            static void encodeNormals(const std::vector<MortonLevel>& levels, const PointCloud& leaves, unsigned int normalBits, std::vector<unsigned char>& output);
+            static bool decodeNormals(const std::vector<MortonLevel>& levels, const unsigned char* input, size_t size, PointCloud& leaves);
+
+        protected:
+            // number of leaves sharing a parent, in the leaf order. The truncated leaves are alone in their group.
+            static void computeGroupSizes(const std::vector<MortonLevel>& levels, std::vector<unsigned char>& groupSizes);
+    };
+}
@@ -1,5 +1,11 @@
 #include "BoundingBox.h"
+#include "CpuFeatures.h"
 #include <numeric>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#ifdef CPC_X86
+#include <immintrin.h>
+#endif
 
 using namespace CPC;
 
@@ -22,10 +28,133 @@ void BoundingBox::expand(const Eigen::Vector3f & point)
     max.z() = max.z() > point.z() ? max.z() : point.z();
 }
 
-bool BoundingBox::isInside(const Eigen::Vector3f& point)
+bool BoundingBox::isInside(const Eigen::Vector3f& point) const
 {
     return (point.x() >= min.x() && point.x() <= max.x() &&
             point.y() >= min.y() && point.y() <= max.y() &&
             point.z() >= min.z() && point.z() <= max.z() );
 }
 
+void BoundingBox::expand(const BoundingBox& box)
+{
+    min = min.cwiseMin(box.min);
+    max = max.cwiseMax(box.max);
+}
+
+bool BoundingBox::isValid() const
+{
+    return min.x() <= max.x() && min.y() <= max.y() && min.z() <= max.z();
+}
+
+typedef void(*ExpandKernel)(const float* data, size_t numOfPoints, BoundingBox& box);
+
+static void expandScalar(const float* data, size_t numOfPoints, BoundingBox& box)
+{
+    for (size_t i = 0; i < numOfPoints; ++i)
+    {
+        box.expand(Eigen::Vector3f(data[3 * i], data[3 * i + 1], data[3 * i + 2]));
+    }
+}
+
+#ifdef CPC_X86
+// Points are packed xyz floats, a group of 4 points (12 floats) fill 3 SSE registers,
+// the float at flat position j in the group always belong to the axis j % 3, so the lanes can be min/max-ed blindly
+// and only need to be folded back into their axis at the end.
+static void foldLanes(const float* lanesMin, const float* lanesMax, size_t numOfLanes, BoundingBox& box)
+{
+    for (size_t j = 0; j < numOfLanes; ++j)
+    {
+        box.min[j % 3] = std::min(box.min[j % 3], lanesMin[j]);
+        box.max[j % 3] = std::max(box.max[j % 3], lanesMax[j]);
+    }
+}
+
+static void expandSSE(const float* data, size_t numOfPoints, BoundingBox& box)
+{
+    __m128 min0 = _mm_set1_ps(std::numeric_limits<float>::max()), min1 = min0, min2 = min0;
+    __m128 max0 = _mm_set1_ps(std::numeric_limits<float>::lowest()), max1 = max0, max2 = max0;
+
+    size_t i = 0;
+    for (; i + 4 <= numOfPoints; i += 4)
+    {
+        const float* group = data + 3 * i;
+        __m128 a = _mm_loadu_ps(group);
+        __m128 b = _mm_loadu_ps(group + 4);
+        __m128 c = _mm_loadu_ps(group + 8);
+        min0 = _mm_min_ps(min0, a); max0 = _mm_max_ps(max0, a);
+        min1 = _mm_min_ps(min1, b); max1 = _mm_max_ps(max1, b);
+        min2 = _mm_min_ps(min2, c); max2 = _mm_max_ps(max2, c);
+    }
+
+    float lanesMin[12], lanesMax[12];
+    _mm_storeu_ps(lanesMin, min0); _mm_storeu_ps(lanesMin + 4, min1); _mm_storeu_ps(lanesMin + 8, min2);
+    _mm_storeu_ps(lanesMax, max0); _mm_storeu_ps(lanesMax + 4, max1); _mm_storeu_ps(lanesMax + 8, max2);
+    foldLanes(lanesMin, lanesMax, 12, box);
+
+    expandScalar(data + 3 * i, numOfPoints - i, box);
+}
+
+// Same as the SSE kernel with 8 points (24 floats) per group
+CPC_TARGET_AVX2 static void expandAVX2(const float* data, size_t numOfPoints, BoundingBox& box)
+{
+    __m256 min0 = _mm256_set1_ps(std::numeric_limits<float>::max()), min1 = min0, min2 = min0;
+    __m256 max0 = _mm256_set1_ps(std::numeric_limits<float>::lowest()), max1 = max0, max2 = max0;
+
+    size_t i = 0;
+    for (; i + 8 <= numOfPoints; i += 8)
+    {
+        const float* group = data + 3 * i;
+        __m256 a = _mm256_loadu_ps(group);
+        __m256 b = _mm256_loadu_ps(group + 8);
+        __m256 c = _mm256_loadu_ps(group + 16);
+        min0 = _mm256_min_ps(min0, a); max0 = _mm256_max_ps(max0, a);
+        min1 = _mm256_min_ps(min1, b); max1 = _mm256_max_ps(max1, b);
+        min2 = _mm256_min_ps(min2, c); max2 = _mm256_max_ps(max2, c);
+    }
+
+    float lanesMin[24], lanesMax[24];
+    _mm256_storeu_ps(lanesMin, min0); _mm256_storeu_ps(lanesMin + 8, min1); _mm256_storeu_ps(lanesMin + 16, min2);
+    _mm256_storeu_ps(lanesMax, max0); _mm256_storeu_ps(lanesMax + 8, max1); _mm256_storeu_ps(lanesMax + 16, max2);
+    foldLanes(lanesMin, lanesMax, 24, box);
+
+    expandScalar(data + 3 * i, numOfPoints - i, box);
+}
+#endif
+
+static ExpandKernel selectExpandKernel()
+{
+#ifdef CPC_X86
+    if (CpuFeatures::hasAVX2())
+        return expandAVX2;
+    if (CpuFeatures::hasSSE2())
+        return expandSSE;
+#endif
+    return expandScalar;
+}
+
+BoundingBox BoundingBox::computeSerial(const Eigen::Vector3f* points, size_t numOfPoints)
+{
+    static const ExpandKernel kernel = selectExpandKernel();
+
+    // Eigen::Vector3f is 3 packed floats, so the points can be read as a flat float array
+    static_assert(sizeof(Eigen::Vector3f) == 3 * sizeof(float), "Vector3f need to be packed");
+    BoundingBox box;
+    if (numOfPoints > 0)
+        kernel(reinterpret_cast<const float*>(points), numOfPoints, box);
+    return box;
+}
+
+BoundingBox BoundingBox::compute(const Eigen::Vector3f* points, size_t numOfPoints)
+{
+    return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, numOfPoints, 1 << 16), BoundingBox(),
+        [&](const tbb::blocked_range<size_t>& range, BoundingBox box)
+        {
+            box.expand(computeSerial(points + range.begin(), range.size()));
+            return box;
+        },
+        [](BoundingBox a, const BoundingBox& b)
+        {
+            a.expand(b);
+            return a;
+        });
+}
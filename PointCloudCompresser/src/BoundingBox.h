@@ -7,7 +7,14 @@ namespace CPC
     {
         BoundingBox();
         void expand(const Eigen::Vector3f& point);
-        bool isInside(const Eigen::Vector3f& point);
+        void expand(const BoundingBox& box);
+        bool isInside(const Eigen::Vector3f& point) const;
+        bool isValid() const;
+
+        // Parallel reduction of the bounding box of the points, using the widest SIMD min/max kernel the cpu support
+        static BoundingBox compute(const Eigen::Vector3f* points, size_t numOfPoints);
+        // Serial version of compute, used by each task of the parallel reduction
+        static BoundingBox computeSerial(const Eigen::Vector3f* points, size_t numOfPoints);
 
         Eigen::Vector3f min, max;
     };
@@ -0,0 +1,102 @@
+#include "CpuFeatures.h"
+
+#ifdef CPC_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using namespace CPC;
+
+#ifdef CPC_X86
+static void cpuid(int leaf, int subLeaf, int registers[4])
+{
+#ifdef _MSC_VER
+    __cpuidex(registers, leaf, subLeaf);
+#else
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid_count(leaf, subLeaf, eax, ebx, ecx, edx);
+    registers[0] = eax;
+    registers[1] = ebx;
+    registers[2] = ecx;
+    registers[3] = edx;
+#endif
+}
+
+// the OS need to save the AVX registers on context switch, otherwise AVX can't be used even if the cpu support it
+static bool osSupportAVX()
+{
+    int registers[4];
+    cpuid(1, 0, registers);
+    bool osxsave = (registers[2] & (1 << 27)) != 0;
+    bool avx = (registers[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    unsigned long long xcr0 = ((unsigned long long)edx << 32) | eax;
+#endif
+    return (xcr0 & 6) == 6; // XMM and YMM state
+}
+
+static int getMaxLeaf()
+{
+    int registers[4];
+    cpuid(0, 0, registers);
+    return registers[0];
+}
+#endif
+
+bool CpuFeatures::hasSSE2()
+{
+#ifdef CPC_X86
+    static const bool sse2 = []()
+    {
+        int registers[4];
+        cpuid(1, 0, registers);
+        return (registers[3] & (1 << 26)) != 0;
+    }();
+    return sse2;
+#else
+    return false;
+#endif
+}
+
+bool CpuFeatures::hasAVX2()
+{
+#ifdef CPC_X86
+    static const bool avx2 = []()
+    {
+        if (getMaxLeaf() < 7 || !osSupportAVX())
+            return false;
+        int registers[4];
+        cpuid(7, 0, registers);
+        return (registers[1] & (1 << 5)) != 0;
+    }();
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+bool CpuFeatures::hasBMI2()
+{
+#ifdef CPC_X86
+    static const bool bmi2 = []()
+    {
+        if (getMaxLeaf() < 7)
+            return false;
+        int registers[4];
+        cpuid(7, 0, registers);
+        return (registers[1] & (1 << 8)) != 0;
+    }();
+    return bmi2;
+#else
+    return false;
+#endif
+}
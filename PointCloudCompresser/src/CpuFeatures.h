@@ -0,0 +1,26 @@
+#pragma once
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define CPC_X86
+#endif
+
+// MSVC allow any intrinsic in any function, gcc and clang need the function to be marked with the target ISA
+#if defined(CPC_X86) && !defined(_MSC_VER)
+#define CPC_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPC_TARGET_AVX2_BMI2 __attribute__((target("avx2,bmi2")))
+#else
+#define CPC_TARGET_AVX2
+#define CPC_TARGET_AVX2_BMI2
+#endif
+
+namespace CPC
+{
+    // Runtime detection of the instruction sets, used to pick the SIMD kernels
+    class CpuFeatures
+    {
+        public:
+            static bool hasSSE2();
+            static bool hasAVX2();
+            static bool hasBMI2();
+    };
+}
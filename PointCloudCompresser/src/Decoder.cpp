@@ -1,11 +1,141 @@
 #include "Decoder.h"
-#include <stack>
 #include <iostream>
 #include <map>
 #include "MortonCode.h"
+#include "OccupancyCoder.h"
+#include "AttributeCoder.h"
+#include "RadixSort.h"
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <climits>
+
+// the sub-roots are decoded in at most this many chunks, enough for the work stealing to balance uneven sub-octrees
+const size_t MAX_DECODE_CHUNKS = 1024;
 
 using namespace CPC;
 
+// number of points handed to the PointSink at once
+const size_t RANGE_CHUNK_SIZE = 4096;
+
+// Cells and leaf points of a range query, shared by both layouts. The points are the same as Octree::generatePointCloud.
+class RangeCollector
+{
+    public:
+        RangeCollector(BoundingBox bbox, unsigned char maxDepth_, const QueryVolume& volume_, const PointSink& sink_) :
+            octree(maxDepth_, bbox), maxDepth(maxDepth_), volume(volume_), sink(sink_), numOfPoints(0)
+        {
+            leafCellSize = octree.getLeafCellSize();
+            for (unsigned char childId = 0; childId < 8; ++childId)
+            {
+                childPositions[childId] = Octree::getChildOffset(childId).cast<float>().cwiseProduct(leafCellSize);
+            }
+            points.reserve(RANGE_CHUNK_SIZE + 8);
+        }
+
+        // a cell inside or outside make all its children the same, only the intersecting ones are tested
+        CellOverlap classify(unsigned int level, unsigned long long code, CellOverlap parentOverlap) const
+        {
+            if (parentOverlap != CELL_INTERSECTING)
+                return parentOverlap;
+            // padded by half a leaf cell, so the rounding of the leaf positions can't put them out of their cell
+            Eigen::Vector3f cellSize = leafCellSize * (float)(1ull << (maxDepth - level));
+            Eigen::Vector3f min = octree.getBoundingBox().min + MortonCode::decode64(code).cast<float>().cwiseProduct(cellSize);
+            return volume.classify(min - leafCellSize * 0.5f, min + cellSize + leafCellSize * 0.5f);
+        }
+
+        // the leaves of a node above maxDepth, or the node itself when it is a truncated leaf
+        void addNode(unsigned int level, unsigned long long code, unsigned char children, CellOverlap overlap)
+        {
+            Index index = MortonCode::decode64(code);
+            if (children == 0)
+            {
+                addPoint(octree.computeNodePosition(level, index), overlap);
+                return;
+            }
+
+            const auto& bboxMin = octree.getBoundingBox().min;
+            Eigen::Vector3f nodePos(bboxMin.x() + leafCellSize.x() * 2 * index.x(), bboxMin.y() + leafCellSize.y() * 2 * index.y(), bboxMin.z() + leafCellSize.z() * 2 * index.z());
+            for (unsigned char childId = 0; childId < 8; ++childId)
+            {
+                if (children & (1 << childId))
+                    addPoint(nodePos + childPositions[childId], overlap);
+            }
+        }
+
+        size_t finish()
+        {
+            flush();
+            return numOfPoints;
+        }
+
+    protected:
+        void addPoint(const Eigen::Vector3f& point, CellOverlap overlap)
+        {
+            if (overlap == CELL_INSIDE || volume.contains(point))
+                points.push_back(point);
+            if (points.size() >= RANGE_CHUNK_SIZE)
+                flush();
+        }
+
+        void flush()
+        {
+            if (points.empty())
+                return;
+            sink(points.data(), points.size());
+            numOfPoints += points.size();
+            points.clear();
+        }
+
+        Octree octree; // empty, only for the cell sizes and the node positions
+        unsigned char maxDepth;
+        const QueryVolume& volume;
+        const PointSink& sink;
+        Eigen::Vector3f leafCellSize;
+        Eigen::Vector3f childPositions[8];
+        std::vector<Eigen::Vector3f> points;
+        size_t numOfPoints;
+};
+
+struct RangeTransversalData
+{
+    RangeTransversalData() : level(0), overlap(CELL_OUTSIDE), code(0) {}
+    RangeTransversalData(unsigned char level_, CellOverlap overlap_, unsigned long long code_) : level(level_), overlap(overlap_), code(code_) {}
+
+    unsigned char level;
+    CellOverlap overlap;
+    unsigned long long code;
+};
+
+// Same transversal as decodeSubOctree, the nodes outside the volume still have to be read to find where the next ones start
+static void queryRangeSubOctree(const unsigned char* payload, size_t payloadSize, size_t pos, unsigned char subOctreeLevel, unsigned char maxDepth, unsigned long long rootCode, CellOverlap rootOverlap, RangeCollector& collector)
+{
+    FixedStack<RangeTransversalData, 7 * MAX_ENCODED_DEPTH + 1> stack;
+    stack.push(RangeTransversalData(subOctreeLevel, rootOverlap, rootCode));
+    while (!stack.empty() && pos < payloadSize)
+    {
+        RangeTransversalData trans = stack.top();
+        stack.pop();
+
+        unsigned char children = payload[pos++];
+        if (trans.overlap != CELL_OUTSIDE && (children == 0 || trans.level + 1 == maxDepth))
+        {
+            collector.addNode(trans.level, trans.code, children, trans.overlap);
+            continue;
+        }
+        if (trans.level + 1 >= maxDepth)
+            continue;
+        for (unsigned char childId = 0; childId < 8; ++childId)
+        {
+            if (!(children & (1 << childId)))
+                continue;
+            unsigned long long childCode = (trans.code << 3) | childId;
+            stack.push(RangeTransversalData(trans.level + 1, collector.classify(trans.level + 1, childCode, trans.overlap), childCode));
+        }
+    }
+}
+
 Decoder::Decoder()
 {
 }
@@ -14,23 +144,225 @@ Decoder::~Decoder()
 {
 }
 
+size_t Decoder::queryRange(EncodedData& data, const QueryVolume& volume, const PointSink& sink)
+{
+    RangeCollector collector(data.sceneBoundingBox, data.maxDepth, volume, sink);
+    const unsigned char subOctreeLevel = data.subOctreeDepth;
+    if (!data.isValid() || data.maxDepth == 0)
+        return 0;
+
+    // the breadth first levels only come as a whole, the nodes outside are then simply not followed
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        std::vector<MortonLevel> levels;
+        decodeLevels(data, levels);
+        std::vector<std::pair<size_t, CellOverlap>> nodes, childNodes;
+        auto& roots = levels[subOctreeLevel];
+        for (size_t i = 0; i < roots.size(); ++i)
+        {
+            CellOverlap overlap = collector.classify(subOctreeLevel, roots.codes[i], CELL_INTERSECTING);
+            if (overlap != CELL_OUTSIDE)
+                nodes.push_back(std::make_pair(i, overlap));
+        }
+
+        std::vector<size_t> childOffsets;
+        for (unsigned int level = subOctreeLevel; level < data.maxDepth && !nodes.empty(); ++level)
+        {
+            auto& currentLevel = levels[level];
+            currentLevel.computeChildOffsets(childOffsets);
+            childNodes.clear();
+            for (auto& node : nodes)
+            {
+                unsigned long long code = currentLevel.codes[node.first];
+                unsigned char children = currentLevel.children[node.first];
+                if (children == 0 || level + 1 == data.maxDepth)
+                {
+                    collector.addNode(level, code, children, node.second);
+                    continue;
+                }
+                size_t childPosition = childOffsets[node.first];
+                for (unsigned char childId = 0; childId < 8; ++childId)
+                {
+                    if (!(children & (1 << childId)))
+                        continue;
+                    CellOverlap overlap = collector.classify(level + 1, (code << 3) | childId, node.second);
+                    if (overlap != CELL_OUTSIDE)
+                        childNodes.push_back(std::make_pair(childPosition, overlap));
+                    ++childPosition;
+                }
+            }
+            nodes.swap(childNodes);
+        }
+        return collector.finish();
+    }
+
+    // the sub-roots from the index, or from a pass over the headers
+    auto queryRoot = [&](unsigned long long code, size_t pos)
+    {
+        CellOverlap overlap = collector.classify(subOctreeLevel, code, CELL_INTERSECTING);
+        if (overlap != CELL_OUTSIDE)
+            queryRangeSubOctree(data.encodedData.data(), data.currentSize, pos, subOctreeLevel, data.maxDepth, code, overlap, collector);
+    };
+    if (data.hasFlag(SUB_ROOT_INDEX))
+    {
+        for (auto& entry : data.subRootIndex)
+        {
+            queryRoot(entry.code, (size_t)entry.position);
+        }
+    }
+    else
+    {
+        for (auto& subNode : decodeNodeHeaders(data))
+        {
+            queryRoot(MortonCode::encode64(subNode.first), subNode.second);
+        }
+    }
+    return collector.finish();
+}
+
+size_t Decoder::queryRange(const MappedEncodedData& data, const QueryVolume& volume, const PointSink& sink)
+{
+    RangeCollector collector(data.sceneBoundingBox, data.maxDepth, volume, sink);
+    if (!data.isValid() || data.maxDepth == 0)
+        return 0;
+
+    auto& index = data.subRootIndex;
+    for (size_t entry = 0; entry < index.size(); ++entry)
+    {
+        unsigned long long code = index.getCode(entry);
+        CellOverlap overlap = collector.classify(data.subOctreeDepth, code, CELL_INTERSECTING);
+        if (overlap != CELL_OUTSIDE)
+            queryRangeSubOctree(data.payload, data.payloadSize, (size_t)index.getPosition(entry), data.subOctreeDepth, data.maxDepth, code, overlap, collector);
+    }
+    return collector.finish();
+}
+
 Octree Decoder::decode(EncodedData& data)
 {
     Octree octree(data.maxDepth, data.sceneBoundingBox);
 
-    DepthFirstTransversal(data, octree);
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+        BreadthFirstTransversal(data, octree);
+    else
+        DepthFirstTransversal(data, octree);
     
     return octree;
 }
 
+PointCloud Decoder::decodePointCloud(EncodedData& data)
+{
+    auto octree = decode(data);
+    auto& levels = octree.getMortonLevels();
+
+    // the positions and the attributes only read the flat levels, so they are generated side by side
+    PointCloud pointCloud;
+    PointCloud leaves(data.hasFlag(NORMAL_ATTRIBUTE), data.hasFlag(COLOR_ATTRIBUTE), data.hasFlag(SCALAR_ATTRIBUTE));
+    bool attributesValid = true, normalsValid = true;
+    tbb::parallel_invoke(
+        [&] { pointCloud = octree.generatePointCloud(); },
+        [&]
+        {
+            if (leaves.hasColor || leaves.hasScalar)
+                attributesValid = AttributeCoder::decode(levels, data.attributeData.data(), data.attributeData.size(), leaves);
+        },
+        [&]
+        {
+            if (leaves.hasNormal)
+                normalsValid = AttributeCoder::decodeNormals(levels, data.normalData.data(), data.normalData.size(), leaves);
+        });
+
+    if (!attributesValid || !normalsValid)
+    {
+        std::cerr << "The attribute streams don't match the octree, only the positions are decoded." << std::endl;
+        return pointCloud;
+    }
+    pointCloud.hasScalar = leaves.hasScalar;
+    pointCloud.hasColor = leaves.hasColor;
+    pointCloud.hasNormal = leaves.hasNormal;
+    pointCloud.scalars.swap(leaves.scalars);
+    pointCloud.colors.swap(leaves.colors);
+    pointCloud.normals.swap(leaves.normals);
+    return pointCloud;
+}
+
 void Decoder::DepthFirstTransversal(EncodedData & data, Octree & octree)
 {
-    auto subNodePos = decodeNodeHeaders(data);
+    // the sub-roots in Morton order, so the levels of consecutive sub-octrees can simply be concatenated
+    std::vector<std::pair<unsigned long long, size_t>> roots;
+    if (data.hasFlag(SUB_ROOT_INDEX))
+    {
+        // already sorted, no need to go through the headers
+        roots.reserve(data.subRootIndex.size());
+        for (auto& entry : data.subRootIndex)
+        {
+            roots.push_back(std::make_pair(entry.code, (size_t)entry.position));
+            decodedNodes.insert(MortonCode::decode64(entry.code));
+        }
+    }
+    else
+    {
+        auto subNodePos = decodeNodeHeaders(data);
+        roots.reserve(subNodePos.size());
+        for (auto& subNode : subNodePos)
+        {
+            roots.push_back(std::make_pair(MortonCode::encode64(subNode.first), subNode.second));
+            decodedNodes.insert(subNode.first);
+        }
+        std::sort(roots.begin(), roots.end());
+    }
+
+    // Every sub-octree is its own byte range, the chunks of sub-roots are decoded concurrently into their own levels
+    const unsigned char subOctreeLevel = data.subOctreeDepth;
+    const size_t rootsPerChunk = std::max((size_t)1, (roots.size() + MAX_DECODE_CHUNKS - 1) / MAX_DECODE_CHUNKS);
+    const size_t numOfChunks = (roots.size() + rootsPerChunk - 1) / rootsPerChunk;
+    std::vector<std::vector<MortonLevel>> chunks(numOfChunks, std::vector<MortonLevel>(data.maxDepth));
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfChunks, 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t chunk = range.begin(); chunk != range.end(); ++chunk)
+        {
+            size_t lastRoot = std::min(roots.size(), (chunk + 1) * rootsPerChunk);
+            for (size_t root = chunk * rootsPerChunk; root < lastRoot; ++root)
+            {
+                decodeSubOctree(data, roots[root].second, roots[root].first, chunks[chunk]);
+            }
+        }
+    });
+
+    // then concatenated level by level, each chunk copying into its own slice
+    std::vector<MortonLevel> levels(data.maxDepth);
+    std::vector<size_t> offsets(numOfChunks + 1);
+    for (unsigned int level = subOctreeLevel; level < data.maxDepth; ++level)
+    {
+        offsets[0] = 0;
+        for (size_t chunk = 0; chunk < numOfChunks; ++chunk)
+        {
+            offsets[chunk + 1] = offsets[chunk] + chunks[chunk][level].size();
+        }
+        levels[level].resize(offsets[numOfChunks]);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfChunks, 1), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t chunk = range.begin(); chunk != range.end(); ++chunk)
+            {
+                auto& chunkLevel = chunks[chunk][level];
+                std::copy(chunkLevel.codes.begin(), chunkLevel.codes.end(), levels[level].codes.begin() + offsets[chunk]);
+                std::copy(chunkLevel.children.begin(), chunkLevel.children.end(), levels[level].children.begin() + offsets[chunk]);
+                chunkLevel.clear();
+            }
+        });
+    }
+    octree.assignMortonLevels(levels, subOctreeLevel);
+}
+
+void Decoder::BreadthFirstTransversal(EncodedData& data, Octree& octree)
+{
+    std::vector<MortonLevel> levels;
+    decodeLevels(data, levels);
+    octree.assignMortonLevels(levels, data.subOctreeDepth);
 
-    // Iterate through subNodePos to decode the subnode
-    for (auto& subNode : subNodePos)
+    // the whole octree is decoded at once
+    for (auto code : octree.getMortonLevels()[data.subOctreeDepth].codes)
     {
-        decodeNode(subNode.second, subNode.first, data, octree);
+        decodedNodes.insert(MortonCode::decode64(code));
     }
 }
 
@@ -40,6 +372,28 @@ std::map<Index, size_t> CPC::Decoder::decodeNodeHeaders(EncodedData& data)
 
     std::map<Index, size_t> subNodePos;
 
+    // the sub-roots of the breadth first layout have no payload of their own
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        size_t pos = 0;
+        size_t numOfRoots = data.isValid() ? data.readSize(pos) : 0;
+        for (size_t i = 0; i < numOfRoots; ++i)
+        {
+            decodeNodeAddress(pos, currentIndex, data);
+            subNodePos.insert(std::make_pair(currentIndex, (size_t)0));
+        }
+        return subNodePos;
+    }
+
+    if (data.hasFlag(SUB_ROOT_INDEX))
+    {
+        for (auto& entry : data.subRootIndex)
+        {
+            subNodePos.insert(subNodePos.end(), std::make_pair(MortonCode::decode64(entry.code), (size_t)entry.position));
+        }
+        return subNodePos;
+    }
+
     // Decode all the subnode header and store their position in the subNodePos
     for (size_t i = 0; i < data.encodedData.size(); )
     {
@@ -58,11 +412,28 @@ std::map<Index, size_t> CPC::Decoder::decodeNodeHeaders(EncodedData& data)
 
 void CPC::Decoder::decodeNodeHeader(size_t& pos, Index& index, EncodedData& data, size_t& nodeSize)
 {
+    decodeNodeAddress(pos, index, data);
+    // Read the total node size
+    nodeSize = data.readSize(pos);
+}
+
+void CPC::Decoder::decodeNodeAddress(size_t& pos, Index& index, EncodedData& data)
+{
+    // the compact address is the Morton code delta to the previous sub-root
+    if (data.hasFlag(COMPACT_HEADERS))
+    {
+        long long delta = EncodedData::zigzagDecode(data.readVarint(pos));
+        index = MortonCode::decode64(MortonCode::encode64(index) + delta);
+        return;
+    }
+
     // Decode the node index address
     if (data.checkFullAddressFlag(pos))
     {
         FullAddress mortonCode;
         data.read(pos, mortonCode);
+        if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+            mortonCode = (mortonCode << 32) | (mortonCode >> 32);
         index = decodedFullAddress(mortonCode);
 #ifdef DEBUG_ENCODING
         unsigned char* chars = (unsigned char*)&mortonCode;
@@ -87,8 +458,44 @@ void CPC::Decoder::decodeNodeHeader(size_t& pos, Index& index, EncodedData& data
         std::cout << "Sub root Offset: " << (int)chars[0] << " , " << (int)chars[1] << " , " << (int)chars[2] << " , " << (int)chars[3] << std::endl;
 #endif
     }
-    // Read the total node size
-    data.read(pos, nodeSize);
+}
+
+void CPC::Decoder::decodeLevels(EncodedData& data, std::vector<MortonLevel>& levels)
+{
+    levels.resize(data.maxDepth);
+    if (data.encodedData.empty())
+        return;
+
+    // read the sub-roots
+    size_t pos = 0;
+    size_t numOfRoots = data.readSize(pos);
+    auto& subOctreeLevel = levels[data.subOctreeDepth];
+    subOctreeLevel.resize(numOfRoots);
+    Index currentIndex(0, 0, 0);
+    for (size_t i = 0; i < numOfRoots; ++i)
+    {
+        decodeNodeAddress(pos, currentIndex, data);
+        subOctreeLevel.codes[i] = MortonCode::encode64(currentIndex);
+    }
+
+    if (data.hasFlag(RANGE_CODED_OCCUPANCY))
+    {
+        OccupancyCoder::decode(data.encodedData.data() + pos, data.encodedData.size() - pos, levels, data.subOctreeDepth);
+        return;
+    }
+
+    // Each level stream hold one byte per node of the level, in Morton order.
+    // Expanding the children bits give the codes of the next level, which tell how long its stream is.
+    for (size_t level = data.subOctreeDepth; level < data.maxDepth; ++level)
+    {
+        auto& currentLevel = levels[level];
+        if (currentLevel.size())
+            memcpy(currentLevel.children.data(), &data.encodedData[pos], currentLevel.size());
+        pos += currentLevel.size();
+
+        if (level + 1 < data.maxDepth)
+            currentLevel.expandChildren(levels[level + 1]);
+    }
 }
 
 void CPC::Decoder::decodeNode(size_t& pos, const Index& index, EncodedData& data, Octree& octree)
@@ -102,15 +509,40 @@ void CPC::Decoder::decodeNode(size_t& pos, const Index& index, EncodedData& data
     }
     decodedNodes.insert(index);
 
-    // Each sub-root node need to be process
-    unsigned char currentLevel = data.subOctreeDepth;
+    resetSubOctreeLevels(data.maxDepth);
+    pos = decodeSubOctree(data, pos, MortonCode::encode64(index), subOctreeLevels);
+    addSubOctree(index, data.subOctreeDepth, data.maxDepth, subOctreeLevels, octree);
+}
+
+void CPC::Decoder::resetSubOctreeLevels(unsigned char maxDepth)
+{
+    subOctreeLevels.resize(maxDepth);
+    for (auto& level : subOctreeLevels)
+    {
+        level.clear();
+    }
+}
 
-    unsigned char rootChild = data.readNext(pos);
+void CPC::Decoder::addSubOctree(const Index& index, unsigned char currentLevel, unsigned char maxDepth, const std::vector<MortonLevel>& levels, Octree& octree)
+{
+    if (levels[currentLevel].size() == 0)
+        return;
+    unsigned char rootChild = levels[currentLevel].children[0];
 #ifdef DEBUG_ENCODING
     std::cout << "Current Sub root: " << (int)index.x() << " , " << (int)index.y() << " , " << (int)index.z() << std::endl;
     std::cout << (int)rootChild << std::endl;
 #endif
 
+    // a sub-root without children is a truncated leaf, only link it to its parent
+    if (rootChild == 0)
+    {
+        size_t dummy;
+        if (currentLevel > 0)
+            octree.addNodeRecursive(currentLevel - 1, octree.computeParentAddress(index), MortonCode::encode64(index) & 7, dummy);
+        octree.addNode(currentLevel, index, 0);
+        return;
+    }
+
     // Need to recursively add the sub-root back to the main root
     for (unsigned char childId = 0; childId < 8; ++childId)
     {
@@ -123,78 +555,65 @@ void CPC::Decoder::decodeNode(size_t& pos, const Index& index, EncodedData& data
         }
     }
 
-    auto& root = octree.getLevels()[currentLevel][index];
-    DecoderTransversalData trans(currentLevel, index, root);
-    std::stack<DecoderTransversalData> states;
-    states.push(trans);
-
-    // keep processing next byte until no more child/parent is un processed.
-    // Then move to the next sub-root's octree
-    while (!states.empty())
+    // then the nodes below it
+    for (unsigned int level = currentLevel + 1; level < maxDepth; ++level)
     {
-        // get the parent state
-        auto& parent = states.top();
-
-        if (parent.node.children == 0) // assertion
+        auto& subOctreeLevel = levels[level];
+        for (size_t i = 0; i < subOctreeLevel.size(); ++i)
         {
-            states.pop();
-            //std::cout << "Shouldn't be here 1" << std::endl;
-            return;
-        }
-        // process the child
-        // Find the next child to process
-        // Go backward since they are encode backward due to the depth-first transversal
-        unsigned char childId = 7;
-        Index childIndex(parent.index * 2);
-        for (; childId >= 0; --childId)
-        {
-            // for each child id, check if they exist
-            unsigned char childBit = 1 << childId;
-            unsigned char exist = parent.node.children & childBit;
-            if (exist)
-            {
-                childIndex += octree.getChildOffset(childId);
-                break;
-            }
+            octree.addNode(level, MortonCode::decode64(subOctreeLevel.codes[i]), subOctreeLevel.children[i]);
         }
+    }
+}
 
-        // Mark child as processed
-        parent.node.removeChild(childId);
-        // if no more child, pop the parent
-        if (parent.node.children == 0)
-            states.pop();
+size_t CPC::Decoder::decodeSubOctree(const EncodedData& data, size_t pos, unsigned long long rootCode, std::vector<MortonLevel>& levels) const
+{
+    return decodeSubOctree(data.encodedData.data(), data.currentSize, data.subOctreeDepth, data.maxDepth, pos, rootCode, levels);
+}
 
-        // Create the node
-        if (parent.level + 1 < data.maxDepth)
-        {
-            Node& node = octree.addNode(parent.level + 1, childIndex, data.readNext(pos));
-#ifdef DEBUG_ENCODING
-            std::cout << (int)node.children << std::endl;
-#endif
+size_t CPC::Decoder::decodeSubOctree(const unsigned char* payload, size_t payloadSize, unsigned char subOctreeLevel, unsigned char maxDepth, size_t pos, unsigned long long rootCode, std::vector<MortonLevel>& levels)
+{
+    std::vector<size_t> firstNodes(maxDepth);
+    for (unsigned int level = subOctreeLevel; level < maxDepth; ++level)
+    {
+        firstNodes[level] = levels[level].size();
+    }
+
+    // Same transversal as the encoder, each node is a byte and its children are pushed in increasing child id,
+    // so the last child come first. A node without children is a leaf, either at maxDepth or truncated.
+    DecoderTransversalStack stack;
+    stack.push(DecoderTransversalData(subOctreeLevel, rootCode));
+    while (!stack.empty() && pos < payloadSize)
+    {
+        DecoderTransversalData trans = stack.top();
+        stack.pop();
+
+        unsigned char children = payload[pos++];
+        levels[trans.level].codes.push_back(trans.code);
+        levels[trans.level].children.push_back(children);
 
-            // if there is still more level to transverse, push the parent state
-            if (parent.level + 2 < data.maxDepth)
+        if (trans.level + 1 < maxDepth)
+        {
+            for (unsigned char childId = 0; childId < 8; ++childId)
             {
-                DecoderTransversalData trans(parent.level + 1, childIndex, node);
-                // add parent state
-                states.push(trans);
+                if (children & (1 << childId))
+                    stack.push(DecoderTransversalData(trans.level + 1, (trans.code << 3) | childId));
             }
         }
-        else if (!states.empty()) // assertion
-        {
-            //std::cout << "Shouldn't be here 2" << std::endl;
-            //return;
-        }
     }
 
-#ifdef DEBUG_ENCODING
-  //  std::cout << "Node Size: " << nodeSize << std::endl;
-#endif    
+    // the last child first make every level come out in descending order
+    for (unsigned int level = subOctreeLevel; level < maxDepth; ++level)
+    {
+        std::reverse(levels[level].codes.begin() + firstNodes[level], levels[level].codes.end());
+        std::reverse(levels[level].children.begin() + firstNodes[level], levels[level].children.end());
+    }
+    return pos;
 }
 
 Index CPC::Decoder::decodedFullAddress(const FullAddress & code)
 {
-    return MortonCode::decode64(code);
+    return MortonCode::decode64(code & 0x7fffffffffffffff); // remove the full address flag, it would otherwise end up in the x axis
 }
 
 Eigen::Vector3i CPC::Decoder::decodedOffsetAddress(const OffsetAddress & code)
@@ -216,18 +635,15 @@ Eigen::Vector3i CPC::Decoder::decodedOffsetAddress(const OffsetAddress & code)
     return result;
 }
 
-void CPC::DecoderTransversalData::processChild(unsigned char child)
-{
-    node.removeChild(child);
-}
-
 bool CPC::Decoder::intersect(const Eigen::Vector3f& point, EncodedData& data, Octree& octree, std::map<Index, size_t>& subNodePos, intersectionState& state)
 {
     // Compute the leaf node address
     auto leafAddress = octree.computeLeafAddress(point);
     leafAddress = octree.computeParentAddress(leafAddress);
+    const bool truncatedLeaves = data.hasFlag(TRUNCATED_LEAVES);
+
     // We already decoded this leaf node before
-    if (octree.nodeExist(octree.getMaxDepth()-1, leafAddress))
+    if (isLeafDecoded(leafAddress, truncatedLeaves, octree))
     {
         state = ALREADY_EXIST;
         return true;
@@ -243,11 +659,19 @@ bool CPC::Decoder::intersect(const Eigen::Vector3f& point, EncodedData& data, Oc
         return false;
     }
         
-    // Decode the subnode
-    decodeNode(subNodeItr->second, subNodeItr->first, data, octree);
+    // Decode the subnode, the breadth first layout can only be decoded as a whole
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        if (decodedNodes.empty())
+            BreadthFirstTransversal(data, octree);
+    }
+    else
+    {
+        decodeNode(subNodeItr->second, subNodeItr->first, data, octree);
+    }
 
     // Check again if this leaf node get decoded just now.
-    if (octree.nodeExist(octree.getMaxDepth()-1, leafAddress))
+    if (isLeafDecoded(leafAddress, truncatedLeaves, octree))
     {
         state = DECODE_FOUND;
         return true;
@@ -257,4 +681,246 @@ bool CPC::Decoder::intersect(const Eigen::Vector3f& point, EncodedData& data, Oc
         state = DECODE_NOT_FOUND;
         return false;
     }
+}
+
+bool CPC::Decoder::intersect(const Eigen::Vector3f& point, const MappedEncodedData& data, Octree& octree, intersectionState& state)
+{
+    auto leafAddress = octree.computeParentAddress(octree.computeLeafAddress(point));
+    const bool truncatedLeaves = data.hasFlag(TRUNCATED_LEAVES);
+    if (isLeafDecoded(leafAddress, truncatedLeaves, octree))
+    {
+        state = ALREADY_EXIST;
+        return true;
+    }
+
+    // a binary search in the mapped index instead of the header map
+    auto subNodeAddress = octree.computeParentAddress(octree.getMaxDepth() - 1, data.subOctreeDepth, leafAddress);
+    if (decodedNodes.find(subNodeAddress) == decodedNodes.end())
+    {
+        const unsigned long long subNodeCode = MortonCode::encode64(subNodeAddress);
+        size_t pos = data.subRootIndex.find(subNodeCode);
+        if (pos == NOT_INDEXED)
+        {
+            state = SUBNODE_NOT_FOUND;
+            return false;
+        }
+        decodedNodes.insert(subNodeAddress);
+        resetSubOctreeLevels(data.maxDepth);
+        decodeSubOctree(data.payload, data.payloadSize, data.subOctreeDepth, data.maxDepth, pos, subNodeCode, subOctreeLevels);
+        addSubOctree(subNodeAddress, data.subOctreeDepth, data.maxDepth, subOctreeLevels, octree);
+    }
+
+    if (isLeafDecoded(leafAddress, truncatedLeaves, octree))
+    {
+        state = DECODE_FOUND;
+        return true;
+    }
+    state = DECODE_NOT_FOUND;
+    return false;
+}
+
+bool CPC::Decoder::intersect(const Eigen::Vector3f& point, EncodedData& data, std::map<Index, size_t>& subNodePos, SubOctreeCache& cache, intersectionState& state)
+{
+    unsigned long long leafCode;
+    cache.getQuantizer().computeLeafAddresses(&point, 1, nullptr, &leafCode);
+    leafCode >>= 3;
+    const bool truncatedLeaves = data.hasFlag(TRUNCATED_LEAVES);
+    const unsigned long long subNodeCode = leafCode >> (3 * (data.maxDepth - 1 - data.subOctreeDepth));
+
+    auto levels = cache.find(subNodeCode);
+    if (levels)
+    {
+        state = isLeafDecoded(leafCode, data.subOctreeDepth, truncatedLeaves, *levels) ? ALREADY_EXIST : DECODE_NOT_FOUND;
+        return state == ALREADY_EXIST;
+    }
+
+    auto subNodeItr = subNodePos.find(MortonCode::decode64(subNodeCode));
+    if (subNodeItr == subNodePos.end())
+    {
+        state = SUBNODE_NOT_FOUND;
+        return false;
+    }
+
+    // the breadth first layout has no payload per sub-root, its sub-octrees are cut from the whole levels decoded once
+    resetSubOctreeLevels(data.maxDepth);
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        auto wholeLevels = cache.findWholeLevels();
+        if (!wholeLevels)
+        {
+            std::vector<MortonLevel> levels;
+            decodeLevels(data, levels);
+            wholeLevels = &cache.insertWholeLevels(std::move(levels));
+        }
+        auto& allLevels = *wholeLevels;
+        unsigned long long first = subNodeCode, last = subNodeCode + 1;
+        for (unsigned int level = data.subOctreeDepth; level < data.maxDepth; ++level, first <<= 3, last <<= 3)
+        {
+            auto& codes = allLevels[level].codes;
+            size_t begin = std::lower_bound(codes.begin(), codes.end(), first) - codes.begin();
+            size_t end = std::lower_bound(codes.begin(), codes.end(), last) - codes.begin();
+            subOctreeLevels[level].codes.assign(codes.begin() + begin, codes.begin() + end);
+            subOctreeLevels[level].children.assign(allLevels[level].children.begin() + begin, allLevels[level].children.begin() + end);
+        }
+    }
+    else
+    {
+        decodeSubOctree(data, subNodeItr->second, subNodeCode, subOctreeLevels);
+    }
+
+    auto& decodedLevels = cache.insert(subNodeCode, subOctreeLevels);
+    state = isLeafDecoded(leafCode, data.subOctreeDepth, truncatedLeaves, decodedLevels) ? DECODE_FOUND : DECODE_NOT_FOUND;
+    return state == DECODE_FOUND;
+}
+
+size_t CPC::Decoder::intersectBatch(const Eigen::Vector3f* points, size_t numOfPoints, EncodedData& data, Octree& octree, std::map<Index, size_t>& subNodePos, std::vector<intersectionState>& states)
+{
+    states.resize(numOfPoints);
+    if (numOfPoints == 0)
+        return 0;
+
+    // the parents of the leaves like intersect, sorted with the position of their point
+    const unsigned int leafLevel = octree.getMaxDepth() - 1;
+    std::vector<unsigned long long> codes(numOfPoints);
+    std::vector<unsigned int> order(numOfPoints);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfPoints), [&](const tbb::blocked_range<size_t>& range)
+    {
+        octree.computeLeafAddresses(points + range.begin(), range.size(), nullptr, &codes[range.begin()]);
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            codes[i] >>= 3;
+            order[i] = (unsigned int)i;
+        }
+    });
+    RadixSort::sort(codes, order, 3 * leafLevel);
+
+    const bool truncatedLeaves = data.hasFlag(TRUNCATED_LEAVES);
+    std::vector<unsigned char> existBefore(numOfPoints);
+    octree.nodesExist(leafLevel, codes.data(), numOfPoints, truncatedLeaves, existBefore.data());
+
+    // The points of a sub-root are contiguous. Going in order, a sub-root is decoded by its first point not already there,
+    // which is the only one that can be DECODE_FOUND.
+    struct SubRootGroup
+    {
+        size_t first;
+        size_t last;
+        std::map<Index, size_t>::iterator subNode;
+        unsigned int trigger; // point decoding the sub-root, UINT_MAX if it isn't decoded by this batch
+    };
+    std::vector<SubRootGroup> groups;
+    const unsigned int shift = 3 * (leafLevel - data.subOctreeDepth);
+    for (size_t first = 0; first < numOfPoints; )
+    {
+        const unsigned long long subNodeCode = codes[first] >> shift;
+        SubRootGroup group = { first, first, subNodePos.find(MortonCode::decode64(subNodeCode)), UINT_MAX };
+        for (; group.last < numOfPoints && (codes[group.last] >> shift) == subNodeCode; ++group.last)
+        {
+            if (!existBefore[group.last])
+                group.trigger = std::min(group.trigger, order[group.last]);
+        }
+        if (group.subNode == subNodePos.end())
+            group.trigger = UINT_MAX;
+        groups.push_back(group);
+        first = group.last;
+    }
+
+    std::vector<size_t> decodedGroups;
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        // the whole octree is decoded by the first point reaching a sub-root
+        auto triggerGroup = std::min_element(groups.begin(), groups.end(), [](const SubRootGroup& left, const SubRootGroup& right) { return left.trigger < right.trigger; });
+        const unsigned int trigger = decodedNodes.empty() ? triggerGroup->trigger : UINT_MAX;
+        for (auto& group : groups)
+        {
+            group.trigger = &group == &*triggerGroup ? trigger : UINT_MAX;
+        }
+        if (trigger != UINT_MAX)
+        {
+            BreadthFirstTransversal(data, octree);
+            decodedGroups.push_back(triggerGroup - groups.begin());
+        }
+    }
+    else
+    {
+        for (size_t g = 0; g < groups.size(); ++g)
+        {
+            auto& group = groups[g];
+            if (group.trigger != UINT_MAX && decodedNodes.find(group.subNode->first) != decodedNodes.end())
+                group.trigger = UINT_MAX;
+            if (group.trigger != UINT_MAX)
+                decodedGroups.push_back(g);
+        }
+
+        // the sub-octrees only read the data, they are decoded concurrently then linked to the octree one by one
+        std::vector<std::vector<MortonLevel>> decodedLevels(decodedGroups.size(), std::vector<MortonLevel>(data.maxDepth));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, decodedGroups.size(), 1), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+            {
+                auto& subNode = groups[decodedGroups[i]].subNode;
+                decodeSubOctree(data, subNode->second, MortonCode::encode64(subNode->first), decodedLevels[i]);
+            }
+        });
+        for (size_t i = 0; i < decodedGroups.size(); ++i)
+        {
+            auto& subNode = groups[decodedGroups[i]].subNode;
+            decodedNodes.insert(subNode->first);
+            addSubOctree(subNode->first, data.subOctreeDepth, data.maxDepth, decodedLevels[i], octree);
+        }
+    }
+
+    // only the decoded sub-octrees can add leaves
+    std::vector<unsigned char> existAfter;
+    if (!decodedGroups.empty())
+    {
+        existAfter.resize(numOfPoints);
+        octree.nodesExist(leafLevel, codes.data(), numOfPoints, truncatedLeaves, existAfter.data());
+    }
+    else
+    {
+        existAfter.swap(existBefore);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, groups.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t g = range.begin(); g != range.end(); ++g)
+        {
+            auto& group = groups[g];
+            for (size_t i = group.first; i < group.last; ++i)
+            {
+                auto& state = states[order[i]];
+                if (!existBefore.empty() && existBefore[i])
+                    state = ALREADY_EXIST;
+                else if (group.subNode == subNodePos.end())
+                    state = SUBNODE_NOT_FOUND;
+                else if (existAfter[i])
+                    state = order[i] == group.trigger ? DECODE_FOUND : ALREADY_EXIST;
+                else
+                    state = DECODE_NOT_FOUND;
+            }
+        }
+    });
+    return std::count_if(states.begin(), states.end(), [](intersectionState state) { return state == ALREADY_EXIST || state == DECODE_FOUND; });
+}
+
+bool CPC::Decoder::isLeafDecoded(unsigned long long leafCode, unsigned char subOctreeLevel, bool truncatedLeaves, const std::vector<MortonLevel>& levels)
+{
+    // the first existing node from the leaf up tell, a node without children being a truncated leaf
+    unsigned long long code = leafCode;
+    for (int level = (int)levels.size() - 1; level >= (int)subOctreeLevel; --level, code >>= 3)
+    {
+        auto& codes = levels[level].codes;
+        auto itr = std::lower_bound(codes.begin(), codes.end(), code);
+        if (itr != codes.end() && *itr == code)
+            return level == (int)levels.size() - 1 || levels[level].children[itr - codes.begin()] == 0;
+        if (!truncatedLeaves)
+            return false;
+    }
+    return false;
+}
+
+bool CPC::Decoder::isLeafDecoded(const Index& leafAddress, bool truncatedLeaves, Octree& octree)
+{
+    // the adaptive depth leaves cover the point from a level above
+    return octree.nodeExist(octree.getMaxDepth() - 1, leafAddress) || (truncatedLeaves && octree.isInsideTruncatedLeaf(octree.getMaxDepth() - 1, leafAddress));
 }
\ No newline at end of file
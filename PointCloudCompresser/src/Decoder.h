@@ -1,15 +1,25 @@
 #pragma once
 #include "Encoder.h"
+#include "MappedEncodedData.h"
+#include "SubOctreeCache.h"
+#include "QueryVolume.h"
+#include <functional>
 #include <set>
 
 namespace CPC
 {
-    struct DecoderTransversalData : TransversalData
+    struct DecoderTransversalData
     {
-        DecoderTransversalData(unsigned char level_, Index index_, Node node_) : TransversalData(level_, index_, node_) {}
-        void processChild(unsigned char child);
+        DecoderTransversalData() : level(0), code(0) {}
+        DecoderTransversalData(unsigned char level_, unsigned long long code_) : level(level_), code(code_) {}
+
+        unsigned char level;
+        unsigned long long code; // Morton code of the node on its level
     };
 
+    // same bound as the encoder transversal
+    typedef FixedStack<DecoderTransversalData, 7 * MAX_ENCODED_DEPTH + 1> DecoderTransversalStack;
+
     enum intersectionState
     {
         ALREADY_EXIST = 0,
@@ -18,6 +28,9 @@ namespace CPC
         DECODE_FOUND
     };
 
+    // receive the points of a range query, a chunk at a time
+    typedef std::function<void(const Eigen::Vector3f* points, size_t numOfPoints)> PointSink;
+
     class Decoder
     {
         public:
@@ -25,18 +38,54 @@ namespace CPC
             virtual ~Decoder();
 
             bool intersect(const Eigen::Vector3f& point, EncodedData& data, Octree& octree, std::map<Index, size_t>& subNodePos, intersectionState& state);
+            // same on a mapped .cpc, the sub-root is found in the index and only its own payload is read
+            bool intersect(const Eigen::Vector3f& point, const MappedEncodedData& data, Octree& octree, intersectionState& state);
+            // Same as intersect without merging into an octree, the sub-octree of the point is decoded into the cache, which only keep
+            // the most recently used ones within its budget. A point of a cached sub-octree is ALREADY_EXIST or DECODE_NOT_FOUND.
+            // Breadth first data is decoded whole into the cache on the first miss, its sub-octrees are cut from there.
+            bool intersect(const Eigen::Vector3f& point, EncodedData& data, std::map<Index, size_t>& subNodePos, SubOctreeCache& cache, intersectionState& state);
+            // Intersect many points at once, states[i] is the state of points[i] and the number of hits is returned, the same as
+            // calling intersect on each point in order. The points are sorted by Morton code and grouped by sub-root, every sub-root
+            // needed is decoded once with the groups in parallel, then all the points are answered in one parallel pass.
+            size_t intersectBatch(const Eigen::Vector3f* points, size_t numOfPoints, EncodedData& data, Octree& octree, std::map<Index, size_t>& subNodePos, std::vector<intersectionState>& states);
+
+            // Stream the leaf points inside the volume to sink, the points generatePointCloud would give but without building an
+            // octree. The sub-roots whose cell miss the volume are skipped, and inside a sub-octree the nodes missing it are only
+            // read past. Return the number of points.
+            size_t queryRange(EncodedData& data, const QueryVolume& volume, const PointSink& sink);
+            // same on a mapped .cpc, the sub-octrees skipped are never read
+            size_t queryRange(const MappedEncodedData& data, const QueryVolume& volume, const PointSink& sink);
 
             Octree decode(EncodedData& data);
+            // decode the octree into points, with the scalars, colors and normals of the attribute streams
+            PointCloud decodePointCloud(EncodedData& data);
+            // position of the payload of every sub-root, from the index when the data has one instead of a pass over the headers
             std::map<Index, size_t> decodeNodeHeaders(EncodedData& data);
             void decodeNodeHeader(size_t& pos, Index& index, EncodedData& data, size_t& nodeSize);
+            void decodeNodeAddress(size_t& pos, Index& index, EncodedData& data);
+            // decode the level streams of the BREADTH_FIRST_LAYOUT, from the sub-octree level down to maxDepth
+            void decodeLevels(EncodedData& data, std::vector<MortonLevel>& levels);
             void decodeNode(size_t& pos, const Index& index, EncodedData& data, Octree& octree);
+            // Decode the depth first payload of the sub-root at pos, the nodes of each level are appended to levels in ascending
+            // Morton order. Only read data, so different sub-octrees can be decoded concurrently. Return the position after the payload.
+            size_t decodeSubOctree(const EncodedData& data, size_t pos, unsigned long long rootCode, std::vector<MortonLevel>& levels) const;
+            static size_t decodeSubOctree(const unsigned char* payload, size_t payloadSize, unsigned char subOctreeLevel, unsigned char maxDepth, size_t pos, unsigned long long rootCode, std::vector<MortonLevel>& levels);
 
         protected:
             void DepthFirstTransversal(EncodedData& data, Octree& octree);
+            void BreadthFirstTransversal(EncodedData& data, Octree& octree);
+            // link the sub-octree decoded in levels to the octree
+            void addSubOctree(const Index& index, unsigned char subOctreeLevel, unsigned char maxDepth, const std::vector<MortonLevel>& levels, Octree& octree);
+            // clear the scratch levels before decoding a single sub-octree into them
+            void resetSubOctreeLevels(unsigned char maxDepth);
+            bool isLeafDecoded(const Index& leafAddress, bool truncatedLeaves, Octree& octree);
+            // same on the levels of a single decoded sub-octree, leafCode is on the level above maxDepth
+            static bool isLeafDecoded(unsigned long long leafCode, unsigned char subOctreeLevel, bool truncatedLeaves, const std::vector<MortonLevel>& levels);
             Index decodedFullAddress(const FullAddress& index);
             Eigen::Vector3i decodedOffsetAddress(const OffsetAddress& index);
             
             std::set<Index> decodedNodes;
+            std::vector<MortonLevel> subOctreeLevels; // scratch levels of decodeNode and the mapped intersect
     };
 
 }
\ No newline at end of file
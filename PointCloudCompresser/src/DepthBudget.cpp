@@ -0,0 +1,27 @@
+#include "DepthBudget.h"
+
+using namespace CPC;
+
+DepthBudget::DepthBudget(float maxError_, unsigned int minLevel_) : maxError(maxError_), minLevel(minLevel_)
+{
+}
+
+void DepthBudget::addRegion(const BoundingBox& region, float maxError_)
+{
+    regions.push_back(std::make_pair(region, maxError_));
+}
+
+float DepthBudget::getMaxError(const Eigen::Vector3f& point) const
+{
+    for (auto itr = regions.rbegin(); itr != regions.rend(); ++itr)
+    {
+        if (itr->first.isInside(point))
+            return itr->second;
+    }
+    return maxError;
+}
+
+unsigned int DepthBudget::getMinLevel() const
+{
+    return minLevel;
+}
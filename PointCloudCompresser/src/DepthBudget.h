@@ -0,0 +1,26 @@
+#pragma once
+#include "BoundingBox.h"
+#include <vector>
+
+namespace CPC
+{
+    // Error budget of the adaptive depth, given to Octree::truncate.
+    // A node stop being subdivided once every leaf below it is within the budget of the point that replace it,
+    // regions of the scene can get their own budget, e.g. a tight one on the facades and a loose one on the sky.
+    class DepthBudget
+    {
+        public:
+            // minLevel keep the levels above complete, nodes are only truncated from that level down
+            DepthBudget(float maxError = 0.f, unsigned int minLevel = 0);
+
+            // the last added region containing the node center give its budget
+            void addRegion(const BoundingBox& region, float maxError);
+            float getMaxError(const Eigen::Vector3f& point) const;
+            unsigned int getMinLevel() const;
+
+        protected:
+            float maxError;
+            unsigned int minLevel;
+            std::vector<std::pair<BoundingBox, float>> regions;
+    };
+}
@@ -1,8 +1,14 @@
 #include "Encoder.h"
 #include <stack>
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
 #include <iostream>
 #include "MortonCode.h"
+#include "Decoder.h"
+#include "OccupancyCoder.h"
+#include "AttributeCoder.h"
+#include <tbb/parallel_invoke.h>
 
 using namespace CPC;
 
@@ -19,200 +25,639 @@ Encoder::~Encoder()
 {
 }
 
-EncodedData Encoder::encode(Octree & octree, unsigned char forceSubOctreeLevel)
+EncodedData Encoder::encode(Octree & octree, unsigned char forceSubOctreeLevel, unsigned int flags)
 {
     EncodedData data;
+    encode(octree, forceSubOctreeLevel, flags, data);
+    return data;
+}
+
+void Encoder::encode(Octree& octree, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data)
+{
     data.sceneBoundingBox = octree.getBoundingBox();
     data.maxDepth = octree.getMaxDepth();
+    // the occupancy contexts come from the parent level, which only the breadth first layout keep together
+    data.flags = ((flags & RANGE_CODED_OCCUPANCY) ? (flags | BREADTH_FIRST_LAYOUT) : flags) | COMPACT_HEADERS;
+    // the attributes are only added by the point cloud encode
+    data.flags &= ~(SCALAR_ATTRIBUTE | COLOR_ATTRIBUTE | NORMAL_ATTRIBUTE);
+    data.attributeData.clear();
+    data.normalData.clear();
+    // only the depth first sub-octrees have a payload of their own to index
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+        data.flags &= ~SUB_ROOT_INDEX;
+    data.subRootIndex.clear();
+
+    // the leaf parents are the deepest sub-roots there are
+    if (forceSubOctreeLevel != (unsigned char)-1 && data.maxDepth && forceSubOctreeLevel >= data.maxDepth)
+        forceSubOctreeLevel = (unsigned char)(data.maxDepth - 1);
+
+    // a truncated leaf above the sub-octree level would be cut off with the levels above, so the level is kept above it
+    unsigned int firstTruncatedLevel = octree.getFirstTruncatedLevel();
+    if (firstTruncatedLevel < data.maxDepth)
+    {
+        data.flags |= TRUNCATED_LEAVES;
+        if (forceSubOctreeLevel != (unsigned char)-1 && forceSubOctreeLevel > firstTruncatedLevel)
+            forceSubOctreeLevel = (unsigned char)firstTruncatedLevel;
+    }
 
     BestStats best;
     // Compute the optimal sub octree depth if no force depth is specified.
-    best = (forceSubOctreeLevel != (unsigned char)-1) ? BestStats(computeSubOctreeSize(octree, forceSubOctreeLevel), forceSubOctreeLevel) : computeBestSubOctreeLevel(octree);
+    best = (forceSubOctreeLevel != (unsigned char)-1) ? BestStats(computeSubOctreeSize(octree, forceSubOctreeLevel, data.flags), forceSubOctreeLevel) : computeBestSubOctreeLevel(octree, data.flags);
     //std::cout << ((forceSubOctreeLevel != (unsigned char)-1) ? "Forced " : "") << "Using Level: " << (int)best.level << " TotalSize: " << best.size << std::endl;
 
     data.subOctreeDepth = best.level;
-    DepthFirstTransversal(octree, best, data);
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+        BreadthFirstTransversal(octree, best, data);
+    else
+        DepthFirstTransversal(octree, best, data);
+}
 
+EncodedData Encoder::encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags)
+{
+    EncodedData data;
+    encode(octree, pointCloud, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
     return data;
 }
 
+void Encoder::encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data)
+{
+    PointCloud leaves(pointCloud.hasNormal && normalBits > 0, pointCloud.hasColor, pointCloud.hasScalar && scalarTolerance > 0.f);
+    encodeAttributes(octree, leaves, [&] { AttributeCoder::computeLeafAttributes(octree, pointCloud, leaves); }, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
+}
+
+EncodedData Encoder::encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags)
+{
+    EncodedData data;
+    encodeLeaves(octree, leaves, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
+    return data;
+}
+
+void Encoder::encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data)
+{
+    encodeAttributes(octree, leaves, [] {}, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
+}
+
+void Encoder::encodeAttributes(Octree& octree, const PointCloud& leaves, const std::function<void()>& computeLeaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data)
+{
+    const bool hasScalar = leaves.hasScalar && scalarTolerance > 0.f;
+    const bool hasAttributes = leaves.hasColor || hasScalar;
+    const bool hasNormal = leaves.hasNormal && normalBits > 0;
+
+    // both sides only read the flat levels, they are synced before the tasks start
+    auto& levels = octree.getMortonLevels();
+    tbb::parallel_invoke(
+        [&] { encode(octree, forceSubOctreeLevel, flags, data); },
+        [&]
+        {
+            if (!hasAttributes && !hasNormal)
+                return;
+            computeLeaves();
+            tbb::parallel_invoke(
+                [&] { if (hasAttributes) AttributeCoder::encode(levels, leaves, scalarTolerance, codedAttributes); },
+                [&] { if (hasNormal) AttributeCoder::encodeNormals(levels, leaves, normalBits, codedNormals); });
+        });
+
+    // the previous streams of data are kept as the next scratch buffers
+    if (hasAttributes)
+    {
+        data.attributeData.swap(codedAttributes);
+        data.flags |= (hasScalar ? SCALAR_ATTRIBUTE : 0) | (leaves.hasColor ? COLOR_ATTRIBUTE : 0);
+    }
+    if (hasNormal)
+    {
+        data.normalData.swap(codedNormals);
+        data.flags |= NORMAL_ATTRIBUTE;
+    }
+}
+
 void Encoder::DepthFirstTransversal(Octree & octree, BestStats& bestStats, EncodedData & data)
 {
+    auto& levels = octree.getMortonLevels();
+    auto& subOctreeLevel = levels[bestStats.level];
+    const size_t numOfRoots = subOctreeLevel.size();
+
+    computeChildOffsets(levels, bestStats.level);
+    computeNodeSizes(levels, bestStats.level, data.maxDepth, nodeSizes);
+
+    // Each sub-octree start at the exclusive scan of the header and payload sizes before it
+    rootOffsets.resize(numOfRoots + 1);
+    rootOffsets[0] = 0;
+    Index previousIndex(0, 0, 0); // the first sub-root is relative to (0,0,0)
+    for (size_t root = 0; root < numOfRoots; ++root)
+    {
+        Index rootIndex = MortonCode::decode64(subOctreeLevel.codes[root]);
+        rootOffsets[root + 1] = rootOffsets[root] + getNodeHeaderSize(previousIndex, rootIndex, data.flags, nodeSizes[root]) + nodeSizes[root];
+        previousIndex = rootIndex;
+    }
+
     // since we know exactly how many node there is to write, we just allocate them
-    data.encodedData.resize(bestStats.size);
-    auto& levels = octree.getLevels();
+    data.encodedData.resize(rootOffsets[numOfRoots]);
+    data.currentSize = rootOffsets[numOfRoots];
+    const bool indexed = data.hasFlag(SUB_ROOT_INDEX);
+    data.subRootIndex.resize(indexed ? numOfRoots : 0);
 
-    std::stack<TransversalData> stack;
-    Index currentIndex(0, 0, 0); // set the current Index to a large offset, hack to make it fail the first test
-    
-    // Encode from the subOctreeLevel and truncate the upper levels
-    // For each node in the subOctreeLevel encode the index, then transverse the full sub-octree
-    for (auto& itr : levels[bestStats.level])
+    // every sub-octree write into its own byte range, so they are encoded concurrently
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfRoots), [&](const tbb::blocked_range<size_t>& range)
     {
-        Eigen::Vector3i offset((itr.first.cast<int>() - currentIndex.cast<int>()));
-#ifdef DEBUG_ENCODING
-        std::cout << "offset: " << offset.x() << " , " << offset.y() << " , " << offset.z() << std::endl;
-#endif
-        // if the new offset is beyond the MAX_OFFSET distance, use full address instead of offset
-        if (offset.x() < -MAX_OFFSET || offset.x() > MAX_OFFSET || offset.y() < -MAX_OFFSET || offset.y() > MAX_OFFSET || offset.z() < -MAX_OFFSET || offset.z() > MAX_OFFSET)
+        for (size_t root = range.begin(); root != range.end(); ++root)
         {
-            // compute the Morton Code of sub-octree offset
-            FullAddress mortonCode = getEncodedFullAddress(itr.first); // set the left most bit, to signal full address
-            // Write the offset index address at the start of this sub-octree node.
-            data.add(mortonCode);
+            Index previousIndex = root ? MortonCode::decode64(subOctreeLevel.codes[root - 1]) : Index(0, 0, 0);
+            Index rootIndex = MortonCode::decode64(subOctreeLevel.codes[root]);
+
+            // add the address and the node size to the encoded data
+            size_t pos = rootOffsets[root];
+            addNodeHeader(data, pos, previousIndex, rootIndex, nodeSizes[root]);
+            if (indexed)
+                data.subRootIndex[root] = { subOctreeLevel.codes[root], pos };
 #ifdef DEBUG_ENCODING
-            unsigned char* chars = (unsigned char*)&mortonCode;
-            std::cout << "Full address root: " << (int)chars[0] << " , " << (int)chars[1] << " , " << (int)chars[2] << " , " << (int)chars[3] << " , "
-                                      << (int)chars[4] << " , " << (int)chars[5] << " , " << (int)chars[6] << " , " << (int)chars[7] << std::endl;
+            std::cout << "Current Sub root: " << (int)rootIndex.x() << " , " << (int)rootIndex.y() << " , " << (int)rootIndex.z() << std::endl;
 #endif
+            encodePayload(levels, bestStats.level, root, data, pos);
         }
-        else
+    });
+}
+
+std::vector<EncodedData> Encoder::encode(Octree& octree, const std::vector<unsigned char>& subOctreeLevels, unsigned int flags)
+{
+    std::vector<EncodedData> encodedLevels(subOctreeLevels.size());
+    if (subOctreeLevels.empty())
+        return encodedLevels;
+
+    // the breadth first layouts have no transversal to share, each level stream is already a copy
+    if ((flags & (BREADTH_FIRST_LAYOUT | RANGE_CODED_OCCUPANCY)) || octree.getMaxDepth() == 0)
+    {
+        for (size_t i = 0; i < subOctreeLevels.size(); ++i)
         {
-            Index unsignedOffset((unsigned int)offset.x(), (unsigned int)offset.y(), (unsigned int)offset.z());
-            OffsetAddress mortonCode = getEncodedOffsetAddress(unsignedOffset);
-            data.add(mortonCode);
-#ifdef DEBUG_ENCODING
-            unsigned char* chars = (unsigned char*)&mortonCode;
-            std::cout << "Sub root Offset: " << (int)chars[0] << " , " << (int)chars[1] << " , " << (int)chars[2] << " , " << (int)chars[3] << std::endl;
-#endif
+            encode(octree, subOctreeLevels[i], flags, encodedLevels[i]);
         }
-        // add a node size entry to the encoded data, we will update this value as we encode
-        auto nodeSizePtr = data.addNodeSize();
+        return encodedLevels;
+    }
 
-        // update the currentIndex
-        currentIndex = itr.first;
-#ifdef DEBUG_ENCODING
-        std::cout << "Current Sub root: " << (int)currentIndex.x() << " , " << (int)currentIndex.y() << " , " << (int)currentIndex.z() << std::endl;
-#endif
-        
-        TransversalData root(bestStats.level, itr.first, itr.second);
-        stack.push(root);
+    auto& levels = octree.getMortonLevels();
+    const unsigned char maxDepth = (unsigned char)octree.getMaxDepth();
+    // same flags and clamping as the single encode, the attributes are only added by the point cloud encode
+    flags &= ~(SCALAR_ATTRIBUTE | COLOR_ATTRIBUTE | NORMAL_ATTRIBUTE);
+    std::vector<unsigned char> clampedLevels(subOctreeLevels);
+    for (auto& level : clampedLevels)
+    {
+        level = std::min(level, (unsigned char)(maxDepth - 1));
+    }
+    const unsigned int firstTruncatedLevel = octree.getFirstTruncatedLevel();
+    if (firstTruncatedLevel < maxDepth)
+    {
+        flags |= TRUNCATED_LEAVES;
+        for (auto& level : clampedLevels)
+        {
+            level = (unsigned char)std::min((unsigned int)level, firstTruncatedLevel);
+        }
+    }
+    const unsigned char firstLevel = *std::min_element(clampedLevels.begin(), clampedLevels.end());
+    computeChildOffsets(levels, firstLevel);
+
+    // The payload of a node is contiguous in the depth first order of any sub-octree containing it.
+    // So the occupancy bytes are written once from the highest sub-octree level, recording where every node of the
+    // requested levels start, and each encoding is then its headers interleaved with slices of those bytes.
+    std::vector<std::vector<size_t>> nodeStarts(maxDepth);
+    std::vector<std::vector<size_t>> levelNodeSizes(maxDepth);
+    for (auto level : clampedLevels)
+    {
+        nodeStarts[level].resize(levels[level].size());
+        computeNodeSizes(levels, level, maxDepth, levelNodeSizes[level]);
+    }
 
-        while (!stack.empty())
+    auto& firstNodeSizes = levelNodeSizes[firstLevel];
+    rootOffsets.resize(firstNodeSizes.size() + 1);
+    rootOffsets[0] = 0;
+    for (size_t root = 0; root < firstNodeSizes.size(); ++root)
+    {
+        rootOffsets[root + 1] = rootOffsets[root] + firstNodeSizes[root];
+    }
+
+    EncodedData occupancy;
+    occupancy.maxDepth = maxDepth;
+    occupancy.resize(rootOffsets.back());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, firstNodeSizes.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t root = range.begin(); root != range.end(); ++root)
         {
-            TransversalData trans = stack.top();
-            stack.pop();
-
-            // Write into the data when evaluating a new node.
-            unsigned char child = trans.node.children;
-            data.add(child);
-            // track the node size, whenever we add a new child
-            (*nodeSizePtr)++;
-#ifdef DEBUG_ENCODING
-            std::cout << (int)child << std::endl;
-#endif
-            // iterate over the child and push them into the stack
-            for (unsigned char childId = 0; childId < 8; ++childId)
+            size_t pos = rootOffsets[root];
+            encodePayload(levels, firstLevel, root, occupancy, pos, &nodeStarts);
+        }
+    });
+
+    for (size_t i = 0; i < clampedLevels.size(); ++i)
+    {
+        const unsigned char level = clampedLevels[i];
+        auto& subOctreeLevel = levels[level];
+        auto& sizes = levelNodeSizes[level];
+        auto& starts = nodeStarts[level];
+
+        EncodedData& data = encodedLevels[i];
+        data.sceneBoundingBox = octree.getBoundingBox();
+        data.maxDepth = maxDepth;
+        data.subOctreeDepth = level;
+        data.flags = flags | COMPACT_HEADERS;
+
+        std::vector<size_t> offsets(subOctreeLevel.size() + 1, 0);
+        Index previousIndex(0, 0, 0);
+        for (size_t root = 0; root < subOctreeLevel.size(); ++root)
+        {
+            Index rootIndex = MortonCode::decode64(subOctreeLevel.codes[root]);
+            offsets[root + 1] = offsets[root] + getNodeHeaderSize(previousIndex, rootIndex, data.flags, sizes[root]) + sizes[root];
+            previousIndex = rootIndex;
+        }
+        data.resize(offsets.back());
+        data.currentSize = offsets.back();
+        const bool indexed = data.hasFlag(SUB_ROOT_INDEX);
+        data.subRootIndex.resize(indexed ? subOctreeLevel.size() : 0);
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, subOctreeLevel.size()), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t root = range.begin(); root != range.end(); ++root)
+            {
+                Index previousIndex = root ? MortonCode::decode64(subOctreeLevel.codes[root - 1]) : Index(0, 0, 0);
+                size_t pos = offsets[root];
+                addNodeHeader(data, pos, previousIndex, MortonCode::decode64(subOctreeLevel.codes[root]), sizes[root]);
+                if (indexed)
+                    data.subRootIndex[root] = { subOctreeLevel.codes[root], pos };
+                memcpy(&data.encodedData[pos], &occupancy.encodedData[starts[root]], sizes[root]);
+            }
+        });
+    }
+    return encodedLevels;
+}
+
+void Encoder::computeChildOffsets(const std::vector<MortonLevel>& levels, unsigned char firstLevel)
+{
+    // the children of each node are contiguous in the next level, find where they start
+    if (childOffsets.size() < levels.size())
+        childOffsets.resize(levels.size());
+    for (size_t level = firstLevel; level + 1 < levels.size(); ++level)
+    {
+        levels[level].computeChildOffsets(childOffsets[level]);
+    }
+}
+
+void Encoder::computeNodeSizes(const std::vector<MortonLevel>& levels, unsigned char subOctreeLevel, unsigned char maxDepth, std::vector<size_t>& sizes)
+{
+    // first child of node i, or the end of the next level past the last node
+    auto childOffset = [&](size_t level, size_t i) { return i < levels[level].size() ? childOffsets[level][i] : levels[level + 1].size(); };
+
+    // the nodes of a sub-octree are a contiguous range on every level, so its payload size is the sum of the range sizes
+    sizes.resize(levels[subOctreeLevel].size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, sizes.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t root = range.begin(); root != range.end(); ++root)
+        {
+            size_t begin = root, end = root + 1;
+            size_t nodeSize = 0;
+            for (size_t level = subOctreeLevel; level < maxDepth; ++level)
             {
-                // for each child id, check if they exist
-                unsigned char childBit = 1 << childId;
-                unsigned char exist = child & childBit;
-                if (exist)
+                nodeSize += end - begin;
+                if (level + 1 < maxDepth)
                 {
-                    Index childIndex(trans.index * 2);
-                    // apply the child offset to 2 x Parent index
-                    childIndex += octree.getChildOffset(childId);
-
-                    // only push node if there is actual child node
-                    if (trans.level + 1 < data.maxDepth)
-                    {
-                        TransversalData transChild(trans.level + 1, childIndex, levels[trans.level + 1][childIndex]);
-                        stack.push(transChild);
-                    }
+                    begin = childOffset(level, begin);
+                    end = childOffset(level, end);
                 }
             }
+            sizes[root] = nodeSize;
         }
+    });
+}
+
+void Encoder::encodePayload(const std::vector<MortonLevel>& levels, unsigned char level, size_t position, EncodedData& data, size_t& pos, std::vector<std::vector<size_t>>* nodeStarts)
+{
+    EncoderTransversalStack stack;
+    stack.push(EncoderTransversalData(level, position));
+    while (!stack.empty())
+    {
+        EncoderTransversalData trans = stack.top();
+        stack.pop();
+
+        if (nodeStarts && !(*nodeStarts)[trans.level].empty())
+            (*nodeStarts)[trans.level][trans.position] = pos;
+
+        // Write into the data when evaluating a new node.
+        unsigned char child = levels[trans.level].children[trans.position];
+        data.add(pos, child);
 #ifdef DEBUG_ENCODING
-        std::cout << "Node Size: " << *nodeSizePtr << std::endl;
+        std::cout << (int)child << std::endl;
 #endif
+        // only push node if there is actual child node
+        if (trans.level + 1 < data.maxDepth)
+        {
+            // push the children in increasing child id, so the last child is encoded first
+            size_t childPosition = childOffsets[trans.level][trans.position];
+            for (unsigned char i = 0; i < childCount(child); ++i)
+            {
+                stack.push(EncoderTransversalData(trans.level + 1, childPosition + i));
+            }
+        }
     }
 }
 
-BestStats CPC::Encoder::computeBestSubOctreeLevel(Octree & octree)
-{ 
-    BestStats best;
+void Encoder::BreadthFirstTransversal(Octree& octree, BestStats& bestStats, EncodedData& data)
+{
+    auto& levels = octree.getMortonLevels();
+    auto& subOctreeLevel = levels[bestStats.level];
 
-    auto& levels = octree.getLevels();
-    unsigned char maxDepth = (unsigned char)levels.size();
-    //tbb::parallel_for((unsigned char)0, maxDepth, [&](unsigned char level)
-    for(unsigned char level = 0; level < maxDepth; ++level)
-    {
-        size_t totalSize = computeSubOctreeSize(octree, level);
-        //std::cout << "Level: " << (int)level << " TotalSize: " << totalSize << std::endl;
-        std::cout << totalSize << std::endl;
-        best.checkAndUpdate(totalSize, level);
-    }//);
-    return best;
+    data.resize(computeSubOctreeSize(octree, bestStats.level, data.flags));
+    data.currentSize = 0;
+
+    // the number of sub-roots and their addresses, each level size is then the children count of the level above
+    data.addSize(data.currentSize, subOctreeLevel.size());
+    Index previousIndex(0, 0, 0);
+    for (auto code : subOctreeLevel.codes)
+    {
+        Index rootIndex = MortonCode::decode64(code);
+        addNodeAddress(data, data.currentSize, previousIndex, rootIndex);
+        previousIndex = rootIndex;
+    }
+
+    if (data.hasFlag(RANGE_CODED_OCCUPANCY))
+    {
+        codedOccupancy.clear();
+        OccupancyCoder::encode(levels, bestStats.level, codedOccupancy, occupancyProbabilities);
+        data.resize(data.currentSize + codedOccupancy.size());
+        memcpy(&data.encodedData[data.currentSize], codedOccupancy.data(), codedOccupancy.size());
+        data.currentSize += codedOccupancy.size();
+        return;
+    }
+
+    // the levels are already in Morton order, so each level stream is a copy of its children bits
+    for (size_t level = bestStats.level; level < data.maxDepth; ++level)
+    {
+        auto& children = levels[level].children;
+        if (!children.empty())
+            memcpy(&data.encodedData[data.currentSize], children.data(), children.size());
+        data.currentSize += children.size();
+    }
 }
 
-size_t CPC::Encoder::computeSubOctreeSize(Octree& octree, unsigned char level)
+bool Encoder::encodeDirty(Octree& octree, EncodedData& data)
 {
-    auto& levels = octree.getLevels();
+    // The level streams of the breadth first layout can't be spliced. The attribute streams follow the leaves of the whole
+    // octree and would need the point cloud to be coded again, such data has to be encoded again with its attributes.
+    if (!data.isValid() || data.maxDepth != octree.getMaxDepth() || data.subOctreeDepth >= data.maxDepth || data.hasFlag(BREADTH_FIRST_LAYOUT) ||
+        data.hasFlag(SCALAR_ATTRIBUTE) || data.hasFlag(COLOR_ATTRIBUTE) || data.hasFlag(NORMAL_ATTRIBUTE))
+        return false;
 
-    long long maxOffset = MAX_OFFSET;
-    size_t jumpAddressSize = sizeof(OffsetAddress);
-    size_t fullAddressSize = sizeof(FullAddress);
-    //size_t fullAddressSize = getOptimalCodeLength(level, jumpAddressSize, maxOffset);
+    auto dirtyRoots = octree.getDirtyNodes(data.subOctreeDepth);
+    if (dirtyRoots.empty())
+        return true;
 
-    size_t totalSize = 0;
-    // compute the dynamic size of the variable length morton code
-    Index currentIndex(0, 0, 0); // assume always start at (0,0,0)
-    int numOfFullAddress = 0;
-    int numOfOffsetAddress = 0;
-    for (auto& itr : levels[level])
+    // Each sub-octree of the new data, either a copy of its old payload or a sub-octree to re-encode
+    struct SubOctree
     {
-        Eigen::Vector3i offset((itr.first.cast<int>() - currentIndex.cast<int>()));
-        if (offset.x() < -maxOffset || offset.x() > maxOffset || offset.y() < -maxOffset || offset.y() > maxOffset || offset.z() < -maxOffset || offset.z() > maxOffset)
-        {
-            totalSize += fullAddressSize;
-            ++numOfFullAddress;
-        }
-        else
+        unsigned long long code;
+        Index index;
+        size_t position;
+        size_t size;
+        bool dirty;
+    };
+    std::vector<SubOctree> subOctrees;
+
+    // keep the clean sub-octrees from the old data
+    Decoder decoder;
+    Index currentIndex(0, 0, 0);
+    for (size_t pos = 0; pos < data.currentSize; )
+    {
+        size_t nodeSize;
+        decoder.decodeNodeHeader(pos, currentIndex, data, nodeSize);
+        if (dirtyRoots.find(currentIndex) == dirtyRoots.end())
+            subOctrees.push_back({ MortonCode::encode64(currentIndex), currentIndex, pos, nodeSize, false });
+        pos += nodeSize;
+    }
+
+    // the dirty sub-octrees that still exist, the others were emptied by a removal
+    auto& subOctreeLevel = octree.getLevels()[data.subOctreeDepth];
+    for (auto& root : dirtyRoots)
+    {
+        if (subOctreeLevel.find(root) != subOctreeLevel.end())
+            subOctrees.push_back({ MortonCode::encode64(root), root, 0, 0, true });
+    }
+
+    std::sort(subOctrees.begin(), subOctrees.end(), [](const SubOctree& left, const SubOctree& right) { return left.code < right.code; });
+
+    // The sub-root addresses are relative to the previous one, so all the headers are written again
+    EncodedData newData;
+    newData.sceneBoundingBox = data.sceneBoundingBox;
+    newData.maxDepth = data.maxDepth;
+    newData.subOctreeDepth = data.subOctreeDepth;
+    newData.flags = data.flags;
+    newData.resize(data.currentSize);
+
+    // the compact headers need the node size up front, so the dirty sub-octrees are encoded aside first
+    EncodedData subOctreeData;
+    subOctreeData.maxDepth = data.maxDepth;
+
+    currentIndex = Index(0, 0, 0);
+    for (auto& subOctree : subOctrees)
+    {
+        const unsigned char* payload = subOctree.dirty ? nullptr : &data.encodedData[subOctree.position];
+        size_t nodeSize = subOctree.size;
+        if (subOctree.dirty)
         {
-            totalSize += jumpAddressSize;
-            ++numOfOffsetAddress;
+            subOctreeData.currentSize = 0;
+            nodeSize = encodeSubOctree(octree, data.subOctreeDepth, subOctree.index, subOctreeData);
+            payload = subOctreeData.encodedData.data();
         }
-        // add the node size
-        totalSize += sizeof(size_t);
-        currentIndex = itr.first;
+
+        newData.reserve(getNodeHeaderSize(currentIndex, subOctree.index, newData.flags, nodeSize) + nodeSize);
+        addNodeHeader(newData, newData.currentSize, currentIndex, subOctree.index, nodeSize);
+        currentIndex = subOctree.index;
+        if (newData.hasFlag(SUB_ROOT_INDEX))
+            newData.subRootIndex.push_back({ subOctree.code, newData.currentSize });
+
+        memcpy(&newData.encodedData[newData.currentSize], payload, nodeSize);
+        newData.currentSize += nodeSize;
     }
-    //std::cout << "Level: " << (int)level << " Full Address: " << numOfFullAddress << "," << numOfFullAddress*fullAddressSize << " Offset Address: " << numOfOffsetAddress << "," << numOfOffsetAddress*jumpAddressSize << std::endl;
+    newData.shrink();
 
-    // Each sub octree root node need a address index (8 byte)
-    // Now compute the size of each of the children node using this sub octree level.
-    for (unsigned char i = level; i < (unsigned char)octree.getMaxDepth(); ++i)
+    data = std::move(newData);
+    return true;
+}
+
+size_t Encoder::encodeSubOctree(Octree& octree, unsigned char level, const Index& root, EncodedData& data)
+{
+    auto& levels = octree.getLevels();
+    size_t nodeSize = 0;
+
+    std::stack<TransversalData> stack;
+    stack.push(TransversalData(level, root, levels[level].find(root)->second));
+    while (!stack.empty())
     {
-        totalSize += levels[i].size() * sizeof(unsigned char);
+        TransversalData trans = stack.top();
+        stack.pop();
+
+        unsigned char child = trans.node.children;
+        data.reserve(sizeof(child));
+        data.add(child);
+        ++nodeSize;
+
+        if (trans.level + 1 < data.maxDepth)
+        {
+            // same order as DepthFirstTransversal, push the children in increasing child id
+            auto& childLevel = levels[trans.level + 1];
+            for (unsigned char i = 0; i < 8; ++i)
+            {
+                if (!(child & (1 << i)))
+                    continue;
+                Index childIndex(trans.index * 2);
+                childIndex += Octree::getChildOffset(i);
+                stack.push(TransversalData(trans.level + 1, childIndex, childLevel.find(childIndex)->second));
+            }
+        }
     }
-    return totalSize;
+    return nodeSize;
+}
+
+bool CPC::Encoder::isOffsetAddressable(const Index& previous, const Index& current)
+{
+    Eigen::Vector3i offset((current.cast<int>() - previous.cast<int>()));
+    // -MAX_OFFSET wrap around to MAX_OFFSET when decoded, so it need a full address too
+    return !(offset.x() <= -MAX_OFFSET || offset.x() > MAX_OFFSET || offset.y() <= -MAX_OFFSET || offset.y() > MAX_OFFSET || offset.z() <= -MAX_OFFSET || offset.z() > MAX_OFFSET);
 }
 
-int CPC::Encoder::getOptimalCodeLength(unsigned char level, size_t& offsetLength, long long & maxOffset)
+size_t CPC::Encoder::getNodeAddressSize(const Index& previous, const Index& current, unsigned int flags)
 {
-    if (level <= 6)
+    if (flags & COMPACT_HEADERS)
+        return EncodedData::getVarintSize(EncodedData::zigzagEncode(MortonCode::encode64(current) - MortonCode::encode64(previous)));
+    return isOffsetAddressable(previous, current) ? sizeof(OffsetAddress) : sizeof(FullAddress);
+}
+
+size_t CPC::Encoder::getNodeHeaderSize(const Index& previous, const Index& current, unsigned int flags, size_t nodeSize)
+{
+    return getNodeAddressSize(previous, current, flags) + EncodedData::getSizeLength(nodeSize, flags);
+}
+
+size_t CPC::Encoder::addNodeHeader(EncodedData& data, const Index& previous, const Index& current)
+{
+    addNodeAddress(data, data.currentSize, previous, current);
+
+    size_t nodeSizePos = data.currentSize;
+    size_t nodeSize = 0;
+    data.add(nodeSize);
+    return nodeSizePos;
+}
+
+void CPC::Encoder::addNodeHeader(EncodedData& data, size_t& pos, const Index& previous, const Index& current, size_t nodeSize)
+{
+    addNodeAddress(data, pos, previous, current);
+    data.addSize(pos, nodeSize);
+}
+
+void CPC::Encoder::addNodeAddress(EncodedData& data, size_t& pos, const Index& previous, const Index& current)
+{
+    // the Morton code delta to the previous sub-root, either sign since the out-of-core encoder write them descending
+    if (data.hasFlag(COMPACT_HEADERS))
     {
-        offsetLength = 1;
-        maxOffset = 2;
-        return 2;
+        data.addVarint(pos, EncodedData::zigzagEncode(MortonCode::encode64(current) - MortonCode::encode64(previous)));
+        return;
     }
-    else if (level <= 11)
+
+    Eigen::Vector3i offset((current.cast<int>() - previous.cast<int>()));
+#ifdef DEBUG_ENCODING
+    std::cout << "offset: " << offset.x() << " , " << offset.y() << " , " << offset.z() << std::endl;
+#endif
+    // if the new offset is beyond the MAX_OFFSET distance, use full address instead of offset
+    if (!isOffsetAddressable(previous, current))
     {
-        offsetLength = 2;
-        maxOffset = 16;
-        return 4;
+        // compute the Morton Code of sub-octree offset
+        FullAddress mortonCode = getEncodedFullAddress(current); // set the left most bit, to signal full address
+        // without node size after it, the flag need to be in the first word for the decoder to tell it from an offset
+        if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+            mortonCode = (mortonCode << 32) | (mortonCode >> 32);
+        // Write the offset index address at the start of this sub-octree node.
+        data.add(pos, mortonCode);
+#ifdef DEBUG_ENCODING
+        unsigned char* chars = (unsigned char*)&mortonCode;
+        std::cout << "Full address root: " << (int)chars[0] << " , " << (int)chars[1] << " , " << (int)chars[2] << " , " << (int)chars[3] << " , "
+                                  << (int)chars[4] << " , " << (int)chars[5] << " , " << (int)chars[6] << " , " << (int)chars[7] << std::endl;
+#endif
     }
-    else if (level <= 16)
+    else
     {
-        offsetLength = 4;
-        maxOffset = 512;
-        return 6;
+        Index unsignedOffset((unsigned int)offset.x(), (unsigned int)offset.y(), (unsigned int)offset.z());
+        OffsetAddress mortonCode = getEncodedOffsetAddress(unsignedOffset);
+        data.add(pos, mortonCode);
+#ifdef DEBUG_ENCODING
+        unsigned char* chars = (unsigned char*)&mortonCode;
+        std::cout << "Sub root Offset: " << (int)chars[0] << " , " << (int)chars[1] << " , " << (int)chars[2] << " , " << (int)chars[3] << std::endl;
+#endif
     }
-    else
+}
+
+BestStats CPC::Encoder::computeBestSubOctreeLevel(Octree & octree, unsigned int flags)
+{ 
+    auto& levels = octree.getMortonLevels();
+    unsigned char maxDepth = (unsigned char)octree.getMaxDepth();
+
+    // the occupancy bytes of a level are every node from that level down to maxDepth
+    occupancySizes.resize(maxDepth);
+    size_t occupancySize = 0;
+    for (int level = (int)maxDepth - 1; level >= 0; --level)
+    {
+        occupancySize += levels[level].size() * sizeof(unsigned char);
+        occupancySizes[level] = occupancySize;
+    }
+
+    // the address header cost of every candidate level, each level is scanned once
+    totalSizes.resize(maxDepth);
+    tbb::parallel_for((unsigned char)0, maxDepth, [&](unsigned char level)
+    {
+        totalSizes[level] = computeHeadersSize(levels[level], flags, occupancySizes[level]) + occupancySizes[level];
+    });
+
+    // the levels below a truncated leaf would cut it off
+    const unsigned int lastLevel = std::min((unsigned int)maxDepth - 1, octree.getFirstTruncatedLevel());
+    BestStats best;
+    for (unsigned char level = 0; level <= lastLevel && level < maxDepth; ++level)
+    {
+        best.checkAndUpdate(totalSizes[level], level);
+    }
+    return best;
+}
+
+size_t CPC::Encoder::computeSubOctreeSize(Octree& octree, unsigned char level, unsigned int flags)
+{
+    auto& levels = octree.getMortonLevels();
+
+    // Compute the size of each of the children node using this sub octree level.
+    size_t occupancySize = 0;
+    for (unsigned char i = level; i < (unsigned char)octree.getMaxDepth(); ++i)
     {
-        offsetLength = 6;
-        maxOffset = 32768 / 2;
-        return 8;
+        occupancySize += levels[i].size() * sizeof(unsigned char);
     }
+
+    // Each sub octree root node need a address index
+    return computeHeadersSize(levels[level], flags, occupancySize) + occupancySize;
+}
+
+size_t CPC::Encoder::computeHeadersSize(const MortonLevel& level, unsigned int flags, size_t payloadSize)
+{
+    // the breadth first layout only store the sub-root addresses after their count, without node size
+    const bool breadthFirst = (flags & BREADTH_FIRST_LAYOUT) != 0;
+    const bool compact = (flags & COMPACT_HEADERS) != 0;
+    size_t countSize = breadthFirst ? EncodedData::getSizeLength(level.size(), flags) : 0;
+    size_t nodeSizeLength = breadthFirst ? 0 : EncodedData::getSizeLength(level.size() ? payloadSize / level.size() : 0, flags);
+
+    // each header depend on the previous sub-root, the first one is relative to (0,0,0)
+    return countSize + tbb::parallel_reduce(tbb::blocked_range<size_t>(0, level.size()), (size_t)0, [&](const tbb::blocked_range<size_t>& range, size_t totalSize)
+    {
+        unsigned long long previousCode = range.begin() ? level.codes[range.begin() - 1] : 0;
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            unsigned long long code = level.codes[i];
+            if (compact)
+                totalSize += EncodedData::getVarintSize(EncodedData::zigzagEncode(code - previousCode));
+            else
+                totalSize += getNodeAddressSize(MortonCode::decode64(previousCode), MortonCode::decode64(code));
+            totalSize += nodeSizeLength;
+            previousCode = code;
+        }
+        return totalSize;
+    }, [](size_t left, size_t right) { return left + right; });
 }
 
 FullAddress CPC::Encoder::getEncodedFullAddress(const Index & index)
@@ -222,5 +667,8 @@ FullAddress CPC::Encoder::getEncodedFullAddress(const Index & index)
 
 OffsetAddress CPC::Encoder::getEncodedOffsetAddress(const Index & index)
 {
-    return (OffsetAddress)MortonCode::encode32(index) & 0x7fffffff; // compute morton code then unset the full address flag (left-most bit).
-}
+    // keep only the two's complement bits that fit in the offset, negative offset would otherwise spill into the other axis bits
+    const unsigned int offsetMask = 2 * MAX_OFFSET - 1;
+    Index maskedIndex(index.x() & offsetMask, index.y() & offsetMask, index.z() & offsetMask);
+    return (OffsetAddress)MortonCode::encode32(maskedIndex) & 0x7fffffff; // compute morton code then unset the full address flag (left-most bit).
+}
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 #include "Octree.h"
+#include "SubRootIndex.h"
 #include <fstream>
 #include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
 
 //#define DEBUG_ENCODING
 #define AddressLength64
@@ -24,11 +28,27 @@ namespace CPC
     const OffsetAddress MAX_OFFSET = 2;
 #endif
 
+
+    // Optional features of the encoded data, any flag set is saved in the extended .cpc header
+    enum EncodedDataFlag
+    {
+        BREADTH_FIRST_LAYOUT = 1 << 0, // the sub-root addresses then the occupancy bytes level by level, instead of depth first per sub-octree
+        RANGE_CODED_OCCUPANCY = 1 << 1, // the level streams are coded by OccupancyCoder, implies BREADTH_FIRST_LAYOUT
+        COMPACT_HEADERS = 1 << 2, // varint zigzag Morton delta sub-root addresses and varint sizes, instead of fixed width ones
+        TRUNCATED_LEAVES = 1 << 3, // some nodes above maxDepth have no children bits, they are leaves from an adaptive depth
+        SCALAR_ATTRIBUTE = 1 << 4, // attributeData hold the quantized scalar of every leaf
+        COLOR_ATTRIBUTE = 1 << 5, // attributeData hold the RGB color of every leaf
+        NORMAL_ATTRIBUTE = 1 << 6, // normalData hold the octahedral normal of every leaf
+        SUB_ROOT_INDEX = 1 << 7 // subRootIndex hold the payload position of every sub-root, only with the depth first layout
+    };
+
     // Data the help store and write the encoded data
     struct EncodedData
     {
-        EncodedData() : maxDepth(0), currentSize(0) {};
+        EncodedData() : maxDepth(0), subOctreeDepth(0), flags(0), currentSize(0) {};
         bool isValid();
+        bool hasFlag(EncodedDataFlag flag) const { return (flags & flag) != 0; }
+        SubRootIndex getSubRootIndex() const { return SubRootIndex(subRootIndex); }
 
         template <class T>
         void add(size_t& pos, T& val)
@@ -43,13 +63,77 @@ namespace CPC
             add(currentSize, val);
         }
 
-        // return the pointer to the encoded data and advance the size
-        size_t* addNodeSize()
+        // update the node size written at pos, once the whole sub-octree is encoded. Only for the fixed width headers.
+        void setNodeSize(size_t pos, size_t nodeSize)
+        {
+            add(pos, nodeSize);
+        }
+
+        // 7 bits per byte, low bits first, the high bit is set when more bytes follow
+        void addVarint(size_t& pos, unsigned long long value)
         {
-            size_t* nodeSizePtr = (size_t*)&(encodedData[currentSize]);
-            *nodeSizePtr = 0;
-            currentSize += sizeof(size_t);
-            return nodeSizePtr;
+            while (value >= 0x80)
+            {
+                encodedData[pos++] = (unsigned char)(value | 0x80);
+                value >>= 7;
+            }
+            encodedData[pos++] = (unsigned char)value;
+        }
+
+        unsigned long long readVarint(size_t& pos)
+        {
+            unsigned long long value = 0;
+            for (unsigned int shift = 0; ; shift += 7)
+            {
+                unsigned char byte = encodedData[pos++];
+                value |= (unsigned long long)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+        }
+
+        static size_t getVarintSize(unsigned long long value)
+        {
+            size_t size = 1;
+            for (; value >= 0x80; value >>= 7)
+            {
+                ++size;
+            }
+            return size;
+        }
+
+        // interleave the signed values, 0 -1 1 -2 2 become 0 1 2 3 4, so small negative deltas stay short
+        static unsigned long long zigzagEncode(long long value)
+        {
+            return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+        }
+
+        static long long zigzagDecode(unsigned long long value)
+        {
+            return (long long)(value >> 1) ^ -(long long)(value & 1);
+        }
+
+        // node sizes and sub-root count, a varint with COMPACT_HEADERS or a size_t otherwise
+        void addSize(size_t& pos, size_t size)
+        {
+            if (hasFlag(COMPACT_HEADERS))
+                addVarint(pos, size);
+            else
+                add(pos, size);
+        }
+
+        size_t readSize(size_t& pos)
+        {
+            if (hasFlag(COMPACT_HEADERS))
+                return (size_t)readVarint(pos);
+            size_t size;
+            read(pos, size);
+            return size;
+        }
+
+        static size_t getSizeLength(size_t size, unsigned int flags)
+        {
+            return (flags & COMPACT_HEADERS) ? getVarintSize(size) : sizeof(size_t);
         }
 
         template <class T>
@@ -70,6 +154,9 @@ namespace CPC
         {
             // Only peek at the data, don't advance it
             OffsetAddress offsetAddress = *((OffsetAddress*)&(encodedData[pos]));
+            // the breadth first layout write the full address high word first, so its flag is always in the first word
+            if (hasFlag(BREADTH_FIRST_LAYOUT))
+                return (offsetAddress & 0x80000000) != 0;
             FullAddress fullAddress = *((FullAddress*)&(encodedData[pos]));
             return (offsetAddress & 0x80000000) || (fullAddress & 0x8000000000000000);
         }
@@ -79,6 +166,13 @@ namespace CPC
             encodedData.resize(size);
         }
 
+        // make room for numOfBytes more, doubling the buffer when it is full
+        void reserve(size_t numOfBytes)
+        {
+            if (currentSize + numOfBytes > encodedData.size())
+                encodedData.resize(std::max(encodedData.size() * 2, currentSize + numOfBytes));
+        }
+
         void shrink()
         {
             if (encodedData.size() != currentSize)
@@ -91,8 +185,12 @@ namespace CPC
         BoundingBox sceneBoundingBox;
         unsigned char maxDepth;
         unsigned char subOctreeDepth;
+        unsigned int flags; // EncodedDataFlag bits
         std::vector<unsigned char> encodedData;
         size_t currentSize;
+        std::vector<unsigned char> attributeData; // AttributeCoder streams, only with SCALAR_ATTRIBUTE or COLOR_ATTRIBUTE
+        std::vector<unsigned char> normalData; // AttributeCoder normal stream, only with NORMAL_ATTRIBUTE
+        std::vector<SubRootEntry> subRootIndex; // sorted by Morton code, only with SUB_ROOT_INDEX
     };
 
     struct TransversalData
@@ -104,6 +202,40 @@ namespace CPC
         Node node;
     };
 
+    struct EncoderTransversalData
+    {
+        EncoderTransversalData() : level(0), position(0) {}
+        EncoderTransversalData(unsigned char level_, size_t position_) : level(level_), position(position_) {}
+
+        unsigned char level;
+        size_t position; // position of the node in its MortonLevel
+    };
+
+    // Stack in a fixed array, without any allocation
+    template <class T, size_t Capacity>
+    class FixedStack
+    {
+        public:
+            FixedStack() : count(0) {}
+
+            void push(const T& value)
+            {
+                if (count == Capacity)
+                    throw std::overflow_error("FixedStack is full");
+                items[count++] = value;
+            }
+            T& top() { return items[count - 1]; }
+            void pop() { --count; }
+            bool empty() const { return count == 0; }
+
+        protected:
+            T items[Capacity];
+            size_t count;
+    };
+
+    // a depth first transversal pop one node and push at most 8 children, so it hold at most 7 nodes per level plus one
+    typedef FixedStack<EncoderTransversalData, 7 * MAX_ENCODED_DEPTH + 1> EncoderTransversalStack;
+
     struct BestStats
     {
         BestStats() : size(ULLONG_MAX), level(0) {}
@@ -137,14 +269,68 @@ namespace CPC
             Encoder();
             virtual ~Encoder();
 
-            EncodedData encode(Octree& octree, unsigned char forceSubOctreeLevel = (unsigned char)-1);
+            // flags select the optional EncodedDataFlag features, a forced level below the leaf parents is clamped to them
+            EncodedData encode(Octree& octree, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
+            // Re-encode only the sub-octrees changed since the last octree.clearDirtyNodes and splice them into data,
+            // the other sub-octrees are copied as is. Return false, leaving data untouched, if data wasn't encoded from this
+            // octree, uses the breadth first layout or has attribute streams, which can only be encoded again whole.
+            bool encodeDirty(Octree& octree, EncodedData& data);
+            // Encode the octree once per sub-octree level from a single depth first pass, the occupancy bytes are shared and
+            // only the headers differ. Same result as one encode per forced level, in the order of subOctreeLevels, so the levels
+            // below the leaf parents are clamped to them.
+            std::vector<EncodedData> encode(Octree& octree, const std::vector<unsigned char>& subOctreeLevels, unsigned int flags = 0);
+            // Encode the octree and the per leaf scalars, colors and normals of the point cloud it was built from, the attributes
+            // are coded in parallel with the geometry. The scalars are kept within scalarTolerance and the normals get normalBits
+            // per octahedral coordinate, either is left out if it is 0.
+            EncodedData encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits = 10, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
+            // Same with the leaves already averaged by AttributeCoder::computeLeafAttributes, so an octree encoded at many levels
+            // only average its points once. The octree must not change in between.
+            EncodedData encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits = 10, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
 
         protected:
+            // encode into data, reusing its buffer
+            void encode(Octree& octree, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data);
+            void encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data);
+            void encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data);
+            // code the channels of leaves in parallel with the geometry, the leaves are filled by computeLeaves first
+            void encodeAttributes(Octree& octree, const PointCloud& leaves, const std::function<void()>& computeLeaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags, EncodedData& data);
             void DepthFirstTransversal(Octree& octree, BestStats& bestStats, EncodedData& encodeData);
-            BestStats computeBestSubOctreeLevel(Octree& octree);
-            size_t computeSubOctreeSize(Octree & octree, unsigned char level);
-            int getOptimalCodeLength(unsigned char level, size_t & offsetLength, long long & maxOffset);
+            void BreadthFirstTransversal(Octree& octree, BestStats& bestStats, EncodedData& encodeData);
+            // fill childOffsets for the levels from firstLevel
+            void computeChildOffsets(const std::vector<MortonLevel>& levels, unsigned char firstLevel);
+            // payload size of every sub-octree rooted on subOctreeLevel, need childOffsets
+            void computeNodeSizes(const std::vector<MortonLevel>& levels, unsigned char subOctreeLevel, unsigned char maxDepth, std::vector<size_t>& sizes);
+            // Write the depth first occupancy bytes of the node at pos, need childOffsets.
+            // When nodeStarts is given, the start of the nodes on the levels with a non empty entry are recorded.
+            void encodePayload(const std::vector<MortonLevel>& levels, unsigned char level, size_t position, EncodedData& data, size_t& pos, std::vector<std::vector<size_t>>* nodeStarts = nullptr);
+            // encode a single sub-octree from the octree map levels, return the node size
+            size_t encodeSubOctree(Octree& octree, unsigned char level, const Index& root, EncodedData& data);
+            BestStats computeBestSubOctreeLevel(Octree& octree, unsigned int flags = 0);
+            size_t computeSubOctreeSize(Octree & octree, unsigned char level, unsigned int flags = 0);
+            // Total size of the sub-root headers if the level is used as sub-octree level.
+            // The compact node sizes are estimated from the average payload of payloadSize bytes.
+            size_t computeHeadersSize(const MortonLevel& level, unsigned int flags = 0, size_t payloadSize = 0);
+            bool isOffsetAddressable(const Index& previous, const Index& current);
+            size_t getNodeAddressSize(const Index& previous, const Index& current, unsigned int flags = 0);
+            size_t getNodeHeaderSize(const Index& previous, const Index& current, unsigned int flags = 0, size_t nodeSize = 0);
+            // write the sub-root address and an empty fixed width node size, return the position of the node size
+            size_t addNodeHeader(EncodedData& data, const Index& previous, const Index& current);
+            // write the whole header at pos, which is advanced past it
+            void addNodeHeader(EncodedData& data, size_t& pos, const Index& previous, const Index& current, size_t nodeSize);
+            // write only the sub-root address, relative to the previous one if it is close enough
+            void addNodeAddress(EncodedData& data, size_t& pos, const Index& previous, const Index& current);
             FullAddress getEncodedFullAddress(const Index& index);
             OffsetAddress getEncodedOffsetAddress(const Index& index);
+
+            // scratch buffers kept between encodes
+            std::vector<std::vector<size_t>> childOffsets; // first child of each node, per level
+            std::vector<size_t> nodeSizes; // payload size of each sub-octree
+            std::vector<size_t> rootOffsets; // start of each sub-octree in the encoded data
+            std::vector<size_t> occupancySizes; // occupancy bytes from each level down to maxDepth
+            std::vector<size_t> totalSizes; // encoded size with each level as sub-octree level
+            std::vector<unsigned char> codedOccupancy;
+            std::vector<unsigned short> occupancyProbabilities; // range coder contexts of codedOccupancy
+            std::vector<unsigned char> codedAttributes;
+            std::vector<unsigned char> codedNormals;
     };
 }
@@ -0,0 +1,34 @@
+#include "EncoderSession.h"
+
+using namespace CPC;
+
+EncoderSession::EncoderSession()
+{
+}
+
+EncoderSession::~EncoderSession()
+{
+}
+
+EncodedData& EncoderSession::encode(Octree& octree, unsigned char forceSubOctreeLevel, unsigned int flags)
+{
+    Encoder::encode(octree, forceSubOctreeLevel, flags, data);
+    return data;
+}
+
+EncodedData& EncoderSession::encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags)
+{
+    Encoder::encode(octree, pointCloud, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
+    return data;
+}
+
+EncodedData& EncoderSession::encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits, unsigned char forceSubOctreeLevel, unsigned int flags)
+{
+    Encoder::encodeLeaves(octree, leaves, scalarTolerance, normalBits, forceSubOctreeLevel, flags, data);
+    return data;
+}
+
+EncodedData& EncoderSession::getData()
+{
+    return data;
+}
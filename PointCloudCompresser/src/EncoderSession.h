@@ -0,0 +1,29 @@
+#pragma once
+#include "Encoder.h"
+
+namespace CPC
+{
+    // Encoder owning its output, for repeated encodes and batch jobs.
+    // The geometry output and the encoder scratch buffers, the range coded occupancy and its contexts included, keep their
+    // capacity between calls, once they have grown to the largest encoding a geometry encode does no more allocation.
+    // The attribute and normal streams only reuse their output buffers, the AttributeCoder still allocate its per block
+    // buffers on every call, and the leaf attributes too unless they are given to encodeLeaves.
+    // A session encode one octree at a time.
+    class EncoderSession : public Encoder
+    {
+        public:
+            EncoderSession();
+            virtual ~EncoderSession();
+
+            // the returned data belong to the session and is overwritten by the next encode
+            EncodedData& encode(Octree& octree, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
+            // with the per leaf attributes of the point cloud, see Encoder::encode
+            EncodedData& encode(Octree& octree, const PointCloud& pointCloud, float scalarTolerance, unsigned char normalBits = 10, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
+            // with leaves averaged once, see Encoder::encodeLeaves
+            EncodedData& encodeLeaves(Octree& octree, const PointCloud& leaves, float scalarTolerance, unsigned char normalBits = 10, unsigned char forceSubOctreeLevel = (unsigned char)-1, unsigned int flags = 0);
+            EncodedData& getData();
+
+        protected:
+            EncodedData data;
+    };
+}
@@ -0,0 +1,317 @@
+#include "ExternalEncoder.h"
+#include "BoundingBox.h"
+#include "MortonCode.h"
+#include "RadixSort.h"
+#include <boost/filesystem.hpp>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <memory>
+
+using namespace CPC;
+
+// memory needed per point while sorting a chunk: the read buffer, the position, the code and the radix sort buffer
+const size_t BYTES_PER_CHUNK_POINT = 48;
+const size_t MIN_MERGE_BUFFER_SIZE = 1 << 13; // in number of codes
+const size_t INITIAL_OUTPUT_SIZE = 1 << 20; // when the sub-octree level is forced the output size is unknown and grow as needed
+
+// Buffered reader of one sorted run file
+class RunReader
+{
+    public:
+        RunReader(const std::string& path, size_t bufferSize) : stream(path, std::ios::binary), buffer(bufferSize), position(0), size(0)
+        {
+            fill();
+        }
+
+        bool empty() const { return position == size; }
+        unsigned long long top() const { return buffer[position]; }
+        void pop()
+        {
+            if (++position == size)
+                fill();
+        }
+
+    protected:
+        void fill()
+        {
+            stream.read((char*)buffer.data(), buffer.size() * sizeof(unsigned long long));
+            size = (size_t)stream.gcount() / sizeof(unsigned long long);
+            position = 0;
+        }
+
+        std::ifstream stream;
+        std::vector<unsigned long long> buffer;
+        size_t position;
+        size_t size;
+};
+
+// K-way merge of the runs, each run is sorted in descending order, duplicated codes are only returned once
+class RunMerger
+{
+    public:
+        RunMerger(const std::vector<std::string>& runs, size_t bufferSize) : hasLast(false), last(0)
+        {
+            for (auto& run : runs)
+            {
+                readers.emplace_back(new RunReader(run, bufferSize));
+                if (!readers.back()->empty())
+                    heap.push(std::make_pair(readers.back()->top(), readers.size() - 1));
+            }
+        }
+
+        bool next(unsigned long long& code)
+        {
+            while (!heap.empty())
+            {
+                auto entry = heap.top();
+                heap.pop();
+                auto& reader = readers[entry.second];
+                reader->pop();
+                if (!reader->empty())
+                    heap.push(std::make_pair(reader->top(), entry.second));
+
+                if (hasLast && entry.first == last)
+                    continue;
+                hasLast = true;
+                last = code = entry.first;
+                return true;
+            }
+            return false;
+        }
+
+    protected:
+        std::vector<std::unique_ptr<RunReader>> readers;
+        std::priority_queue<std::pair<unsigned long long, size_t>> heap; // max heap, the largest code first
+        bool hasLast;
+        unsigned long long last;
+};
+
+// Remove the run files once out of scope, so they don't stay on disk when the encoding throw
+class RunFiles
+{
+    public:
+        ~RunFiles()
+        {
+            for (auto& path : paths)
+            {
+                boost::system::error_code error;
+                boost::filesystem::remove(path, error);
+            }
+        }
+
+        std::vector<std::string> paths;
+};
+
+ExternalEncoder::ExternalEncoder(size_t memoryBudget_, const std::string& tempDirectory_) : memoryBudget(memoryBudget_), tempDirectory(tempDirectory_)
+{
+    if (tempDirectory.empty())
+        tempDirectory = boost::filesystem::temp_directory_path().string();
+}
+
+ExternalEncoder::~ExternalEncoder()
+{
+}
+
+size_t ExternalEncoder::getChunkSize() const
+{
+    return std::max(memoryBudget / BYTES_PER_CHUNK_POINT, (size_t)1 << 16);
+}
+
+size_t ExternalEncoder::getMergeBufferSize(size_t numOfRuns) const
+{
+    // split the budget between the run buffers, the rest is left for the output growth
+    size_t bufferSize = memoryBudget / (2 * std::max(numOfRuns, (size_t)1) * sizeof(unsigned long long));
+    return std::max(bufferSize, MIN_MERGE_BUFFER_SIZE);
+}
+
+EncodedData ExternalEncoder::encode(const std::string& plyPath, unsigned int maxDepth, unsigned char forceSubOctreeLevel)
+{
+    EncodedData data;
+
+    PlyChunkReader reader;
+    if (!reader.open(plyPath))
+        return data;
+
+    // first pass: the bounding box, needed before anything can be quantized
+    BoundingBox bbox = computeBoundingBox(reader);
+    if (!bbox.isValid() || !reader.rewind())
+        return data;
+
+    // an empty octree carry the leaf quantization of the scene
+    Octree octree(maxDepth, bbox);
+
+    // second pass: quantize, sort and spill each chunk
+    RunFiles runFiles;
+    auto& runs = runFiles.paths;
+    writeSortedRuns(reader, octree, runs);
+    reader.close();
+
+    data.sceneBoundingBox = bbox;
+    data.maxDepth = maxDepth;
+
+    BestStats best;
+    bool sizeKnown = forceSubOctreeLevel == (unsigned char)-1;
+    if (sizeKnown)
+        best = computeBestSubOctreeLevel(runs, maxDepth);
+    else
+        best = BestStats(0, forceSubOctreeLevel);
+
+    data.subOctreeDepth = best.level;
+    data.resize(sizeKnown ? best.size : INITIAL_OUTPUT_SIZE);
+    encodeRuns(runs, maxDepth, sizeKnown, data);
+    data.shrink();
+    return data;
+}
+
+BoundingBox ExternalEncoder::computeBoundingBox(PlyChunkReader& reader)
+{
+    BoundingBox bbox;
+    std::vector<Vector3f> positions;
+    size_t numOfPoints = 0;
+    while (reader.read(positions, getChunkSize()) > 0)
+    {
+        bbox.expand(BoundingBox::compute(positions.data(), positions.size()));
+        numOfPoints += positions.size();
+    }
+    // the reader stop early at the end of a truncated file
+    if (numOfPoints != reader.getNumOfPoints())
+        throw std::runtime_error("truncated ply file, " + std::to_string(numOfPoints) + " of " + std::to_string(reader.getNumOfPoints()) + " vertices read");
+    return bbox;
+}
+
+void ExternalEncoder::writeSortedRuns(PlyChunkReader& reader, Octree& octree, std::vector<std::string>& runs)
+{
+    std::vector<Vector3f> positions;
+    std::vector<unsigned long long> codes;
+    const unsigned int maxDepth = octree.getMaxDepth();
+
+    while (reader.read(positions, getChunkSize()) > 0)
+    {
+        codes.resize(positions.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, positions.size(), 4096), [&](const tbb::blocked_range<size_t>& range)
+        {
+            octree.computeLeafAddresses(&positions[range.begin()], range.size(), nullptr, &codes[range.begin()]);
+        });
+        RadixSort::sort(codes, 3 * maxDepth);
+        codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+        // the runs are merged in descending order, the same order the depth first encoding visit the leaves
+        std::reverse(codes.begin(), codes.end());
+
+        boost::filesystem::path runPath = boost::filesystem::path(tempDirectory) / boost::filesystem::unique_path("cpc-run-%%%%-%%%%-%%%%.tmp");
+        std::ofstream runFile(runPath.string(), std::ios::binary);
+        if (!runFile.is_open())
+            throw std::runtime_error("failed to create " + runPath.string());
+        runs.push_back(runPath.string());
+        runFile.write((const char*)codes.data(), codes.size() * sizeof(unsigned long long));
+        if (!runFile)
+            throw std::runtime_error("failed to write " + runPath.string());
+    }
+}
+
+BestStats ExternalEncoder::computeBestSubOctreeLevel(const std::vector<std::string>& runs, unsigned int maxDepth)
+{
+    // count the nodes of each level, and the header size if that level was the sub-octree level
+    std::vector<unsigned long long> lastCodes(maxDepth);
+    std::vector<Index> previousIndices(maxDepth, Index(0, 0, 0));
+    std::vector<size_t> numOfNodes(maxDepth, 0);
+    std::vector<size_t> headerSizes(maxDepth, 0);
+
+    RunMerger merger(runs, getMergeBufferSize(runs.size()));
+    unsigned long long code;
+    bool first = true;
+    while (merger.next(code))
+    {
+        // once a level change every level below change too
+        unsigned int level = 0;
+        while (!first && level < maxDepth && (code >> (3 * (maxDepth - level))) == lastCodes[level])
+        {
+            ++level;
+        }
+        for (; level < maxDepth; ++level)
+        {
+            unsigned long long nodeCode = code >> (3 * (maxDepth - level));
+            Index index = MortonCode::decode64(nodeCode);
+            headerSizes[level] += getNodeHeaderSize(previousIndices[level], index);
+            previousIndices[level] = index;
+            lastCodes[level] = nodeCode;
+            ++numOfNodes[level];
+        }
+        first = false;
+    }
+
+    BestStats best;
+    size_t nodesBelow = 0;
+    for (int level = (int)maxDepth - 1; level >= 0; --level)
+    {
+        nodesBelow += numOfNodes[level];
+        best.checkAndUpdate(headerSizes[level] + nodesBelow, (unsigned char)level);
+    }
+    return best;
+}
+
+void ExternalEncoder::encodeRuns(const std::vector<std::string>& runs, unsigned int maxDepth, bool sizeKnown, EncodedData& data)
+{
+    const unsigned int subOctreeLevel = data.subOctreeDepth;
+
+    // the node currently open on each level, and where its children byte is in the output
+    std::vector<unsigned long long> openCodes(maxDepth);
+    std::vector<size_t> bytePositions(maxDepth);
+    bool hasRoot = false;
+    Index previousRoot(0, 0, 0);
+    size_t nodeSizePos = 0;
+    size_t rootStart = 0;
+
+    auto reserve = [&](size_t numOfBytes)
+    {
+        if (!sizeKnown)
+            data.reserve(numOfBytes);
+    };
+
+    RunMerger merger(runs, getMergeBufferSize(runs.size()));
+    unsigned long long code;
+    while (merger.next(code))
+    {
+        // find the first level where this leaf start a new node
+        unsigned int level = subOctreeLevel;
+        while (hasRoot && level < maxDepth && (code >> (3 * (maxDepth - level))) == openCodes[level])
+        {
+            ++level;
+        }
+
+        // new sub-octree, close the previous one and write the new header
+        if (level == subOctreeLevel)
+        {
+            if (hasRoot)
+                data.setNodeSize(nodeSizePos, data.currentSize - rootStart);
+
+            // the node size is only known once the sub-octree is streamed, so the fixed width headers are kept
+            Index root = MortonCode::decode64(code >> (3 * (maxDepth - subOctreeLevel)));
+            reserve(sizeof(FullAddress) + sizeof(size_t));
+            nodeSizePos = addNodeHeader(data, previousRoot, root);
+            rootStart = data.currentSize;
+            previousRoot = root;
+            hasRoot = true;
+        }
+
+        // nodes are written as they are opened (pre-order), their children byte is filled as the children show up.
+        // The leaves come in descending order, so the children are visited in the same order as the in-memory encoder.
+        for (; level < maxDepth; ++level)
+        {
+            openCodes[level] = code >> (3 * (maxDepth - level));
+            if (level > subOctreeLevel)
+                data.encodedData[bytePositions[level - 1]] |= 1 << (openCodes[level] & 7);
+
+            reserve(1);
+            bytePositions[level] = data.currentSize;
+            unsigned char children = 0;
+            data.add(children);
+        }
+        data.encodedData[bytePositions[maxDepth - 1]] |= 1 << (code & 7);
+    }
+
+    if (hasRoot)
+        data.setNodeSize(nodeSizePos, data.currentSize - rootStart);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "Encoder.h"
+#include "PlyChunkReader.h"
+#include <string>
+
+namespace CPC
+{
+    // Out-of-core encoder for point clouds larger than the memory.
+    // The ply file is read in chunks, the leaf Morton codes of each chunk are sorted and spilled into a temporary run file,
+    // the runs are then k-way merged and streamed straight into the encoded data without ever building the Octree.
+    // The memory budget cover the chunks, sort buffers and merge buffers, not the encoded output itself.
+    class ExternalEncoder : public Encoder
+    {
+        public:
+            ExternalEncoder(size_t memoryBudget, const std::string& tempDirectory = "");
+            virtual ~ExternalEncoder();
+
+            EncodedData encode(const std::string& plyPath, unsigned int maxDepth, unsigned char forceSubOctreeLevel = (unsigned char)-1);
+
+        protected:
+            // a truncated file throw, its vertex count is checked against the header
+            BoundingBox computeBoundingBox(PlyChunkReader& reader);
+            // the runs are appended as soon as they are created, so the caller can remove them even if it throw
+            void writeSortedRuns(PlyChunkReader& reader, Octree& octree, std::vector<std::string>& runs);
+            BestStats computeBestSubOctreeLevel(const std::vector<std::string>& runs, unsigned int maxDepth);
+            void encodeRuns(const std::vector<std::string>& runs, unsigned int maxDepth, bool sizeKnown, EncodedData& data);
+            size_t getChunkSize() const;
+            size_t getMergeBufferSize(size_t numOfRuns) const;
+
+            size_t memoryBudget;
+            std::string tempDirectory;
+    };
+}
@@ -0,0 +1,160 @@
+#include "LeafQuantizer.h"
+#include "CpuFeatures.h"
+#include "MortonCode.h"
+#include <cmath>
+#ifdef CPC_X86
+#include <immintrin.h>
+#endif
+
+using namespace CPC;
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CPC_BMI2_PDEP
+#endif
+
+// spread the 21 bits of each axis every 3 bits, x on bit 0
+const unsigned long long PDEP_X_MASK = 0x1249249249249249;
+const unsigned long long PDEP_Y_MASK = PDEP_X_MASK << 1;
+const unsigned long long PDEP_Z_MASK = PDEP_X_MASK << 2;
+
+LeafQuantizer::LeafQuantizer() : min(0, 0, 0), inverseLeafCellSize(0, 0, 0), numOfCells(0)
+{
+}
+
+LeafQuantizer::LeafQuantizer(const BoundingBox& bbox, const Eigen::Vector3f& leafCellSize, unsigned int maxDepth) : min(bbox.min), numOfCells(1 << maxDepth)
+{
+    inverseLeafCellSize = Eigen::Vector3f(1.f / leafCellSize.x(), 1.f / leafCellSize.y(), 1.f / leafCellSize.z());
+}
+
+// A point on the max side of the bounding box (or rounded onto it) belong to the last cell
+static inline unsigned int quantize(float position, float min, float inverseCellSize, int numOfCells)
+{
+    float localPos = position - min;
+    float scaled = localPos * inverseCellSize;
+    int cell = (int)std::floor(scaled);
+    return (unsigned int)(cell == numOfCells ? cell - 1 : cell);
+}
+
+Index LeafQuantizer::computeLeafAddress(const Eigen::Vector3f& point) const
+{
+    return Index(quantize(point.x(), min.x(), inverseLeafCellSize.x(), numOfCells),
+                 quantize(point.y(), min.y(), inverseLeafCellSize.y(), numOfCells),
+                 quantize(point.z(), min.z(), inverseLeafCellSize.z(), numOfCells));
+}
+
+void LeafQuantizer::computeLeafAddresses(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const
+{
+#ifdef CPC_X86
+    static const bool useAVX2 = CpuFeatures::hasAVX2();
+    if (useAVX2)
+    {
+        computeAVX2(points, numOfPoints, indices, codes);
+        return;
+    }
+#endif
+    computeSerial(points, numOfPoints, indices, codes);
+}
+
+void LeafQuantizer::computeSerial(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const
+{
+    for (size_t i = 0; i < numOfPoints; ++i)
+    {
+        Index index = computeLeafAddress(points[i]);
+        if (indices)
+            indices[i] = index;
+        if (codes)
+            codes[i] = MortonCode::encode64(index);
+    }
+}
+
+#ifdef CPC_X86
+#ifdef CPC_BMI2_PDEP
+CPC_TARGET_AVX2_BMI2 static inline unsigned long long encodePdep(unsigned int x, unsigned int y, unsigned int z)
+{
+    return _pdep_u64(x, PDEP_X_MASK) | _pdep_u64(y, PDEP_Y_MASK) | _pdep_u64(z, PDEP_Z_MASK);
+}
+#endif
+
+CPC_TARGET_AVX2 static inline __m256i quantizeAVX2(__m256 position, __m256 min, __m256 inverseCellSize, __m256i numOfCells)
+{
+    // same operations as the scalar quantize, so the result is bit identical
+    __m256 scaled = _mm256_mul_ps(_mm256_sub_ps(position, min), inverseCellSize);
+    __m256i cell = _mm256_cvttps_epi32(_mm256_floor_ps(scaled));
+    __m256i onMax = _mm256_cmpeq_epi32(cell, numOfCells);
+    return _mm256_add_epi32(cell, onMax); // onMax is -1 on the matching lanes
+}
+
+#ifdef CPC_BMI2_PDEP
+// only this function is compiled for BMI2, the fallback must not get its instructions
+CPC_TARGET_AVX2_BMI2 static void computeGroupCodesPdep(const unsigned int* x, const unsigned int* y, const unsigned int* z, unsigned long long* codes)
+{
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        // same rejection of the indices over 21 bits as encode64
+        codes[lane] = (x[lane] | y[lane] | z[lane]) > 0x1FFFFF ? INVALID_MORTON_CODE : encodePdep(x[lane], y[lane], z[lane]);
+    }
+}
+#endif
+
+static void computeGroupCodes(const unsigned int* x, const unsigned int* y, const unsigned int* z, unsigned long long* codes, bool hasBMI2)
+{
+#ifdef CPC_BMI2_PDEP
+    if (hasBMI2)
+    {
+        computeGroupCodesPdep(x, y, z, codes);
+        return;
+    }
+#endif
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        codes[lane] = MortonCode::encode64(Index(x[lane], y[lane], z[lane]));
+    }
+}
+
+CPC_TARGET_AVX2 void LeafQuantizer::computeAVX2(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const
+{
+    static const bool hasBMI2 = CpuFeatures::hasBMI2();
+
+    const __m256 minX = _mm256_set1_ps(min.x()), minY = _mm256_set1_ps(min.y()), minZ = _mm256_set1_ps(min.z());
+    const __m256 inverseX = _mm256_set1_ps(inverseLeafCellSize.x()), inverseY = _mm256_set1_ps(inverseLeafCellSize.y()), inverseZ = _mm256_set1_ps(inverseLeafCellSize.z());
+    const __m256i cells = _mm256_set1_epi32(numOfCells);
+
+    alignas(32) unsigned int x[8], y[8], z[8];
+    size_t i = 0;
+    for (; i + 8 <= numOfPoints; i += 8)
+    {
+        // deinterleave 8 packed xyz points into x, y and z registers
+        const float* group = reinterpret_cast<const float*>(points + i);
+        __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group)), _mm_loadu_ps(group + 12), 1);     // x0 y0 z0 x1 | x4 y4 z4 x5
+        __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group + 4)), _mm_loadu_ps(group + 16), 1); // y1 z1 x2 y2 | y5 z5 x6 y6
+        __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group + 8)), _mm_loadu_ps(group + 20), 1); // z2 x3 y3 z3 | z6 x7 y7 z7
+        __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2)); // x2 y2 x3 y3
+        __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1)); // y0 z0 y1 z1
+        __m256 px = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+        __m256 py = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 pz = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+
+        _mm256_store_si256((__m256i*)x, quantizeAVX2(px, minX, inverseX, cells));
+        _mm256_store_si256((__m256i*)y, quantizeAVX2(py, minY, inverseY, cells));
+        _mm256_store_si256((__m256i*)z, quantizeAVX2(pz, minZ, inverseZ, cells));
+
+        if (indices)
+        {
+            for (int lane = 0; lane < 8; ++lane)
+            {
+                indices[i + lane] = Index(x[lane], y[lane], z[lane]);
+            }
+        }
+        if (codes)
+            computeGroupCodes(x, y, z, codes + i, hasBMI2);
+    }
+
+    // remaining points
+    computeSerial(points + i, numOfPoints - i, indices ? indices + i : nullptr, codes ? codes + i : nullptr);
+}
+#else
+void LeafQuantizer::computeAVX2(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const
+{
+    computeSerial(points, numOfPoints, indices, codes);
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#include "BoundingBox.h"
+#include "Index.h"
+
+namespace CPC
+{
+    // Quantize points into the leaf cells of an octree, and compute the leaf Morton codes.
+    // The batch version use AVX2 and BMI2 when the cpu support them, and give the exact same result as the single point version.
+    class LeafQuantizer
+    {
+        public:
+            LeafQuantizer();
+            LeafQuantizer(const BoundingBox& bbox, const Eigen::Vector3f& leafCellSize, unsigned int maxDepth);
+
+            Index computeLeafAddress(const Eigen::Vector3f& point) const;
+            // indices or codes can be null if they are not needed
+            void computeLeafAddresses(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const;
+
+        protected:
+            void computeSerial(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const;
+            void computeAVX2(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes) const;
+
+            Eigen::Vector3f min;
+            Eigen::Vector3f inverseLeafCellSize; // multiply by the reciprocal instead of dividing by the cell size
+            int numOfCells; // number of leaf cells along each axis
+    };
+}
@@ -0,0 +1,135 @@
+#include "LevelHashTable.h"
+#include "RadixSort.h"
+#include <tbb/parallel_for.h>
+#include <stdexcept>
+
+using namespace CPC;
+
+// Morton code use at most 63 bits, so all bits set is never a valid key
+const unsigned long long EMPTY_KEY = 0xFFFFFFFFFFFFFFFF;
+const size_t EXTRACT_BLOCK_SIZE = 1 << 16;
+
+LevelHashTable::LevelHashTable(size_t maxNumOfNodes) : numOfNodes(0)
+{
+    // keep the load factor under 3/4, linear probing degrade quickly past that
+    log2Capacity = 4;
+    while (((size_t)1 << log2Capacity) < maxNumOfNodes + maxNumOfNodes / 3)
+    {
+        ++log2Capacity;
+    }
+    // extract sort the slots along with the codes as 32 bits values
+    if (log2Capacity > 32)
+        throw std::runtime_error("LevelHashTable capacity over 2^32 slots");
+    size_t capacity = (size_t)1 << log2Capacity;
+    mask = capacity - 1;
+
+    keys.reset(new std::atomic<unsigned long long>[capacity]);
+    children.reset(new std::atomic<unsigned char>[capacity]);
+    tbb::parallel_for((size_t)0, capacity, [&](size_t slot)
+    {
+        keys[slot].store(EMPTY_KEY, std::memory_order_relaxed);
+        children[slot].store(0, std::memory_order_relaxed);
+    });
+}
+
+size_t LevelHashTable::hash(unsigned long long code) const
+{
+    // Fibonacci hashing, nearby Morton codes end up far apart
+    return (size_t)((code * 0x9E3779B97F4A7C15ull) >> (64 - log2Capacity));
+}
+
+bool LevelHashTable::addChild(unsigned long long code, unsigned char childId)
+{
+    unsigned char childBit = 1 << childId;
+    for (size_t slot = hash(code), probe = 0; probe <= mask; slot = (slot + 1) & mask, ++probe)
+    {
+        unsigned long long key = keys[slot].load(std::memory_order_acquire);
+        if (key == EMPTY_KEY)
+        {
+            // try to claim the empty slot, if someone else got it first check whether it is our node
+            if (keys[slot].compare_exchange_strong(key, code, std::memory_order_acq_rel))
+            {
+                children[slot].fetch_or(childBit, std::memory_order_relaxed);
+                numOfNodes.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (key == code)
+        {
+            children[slot].fetch_or(childBit, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    throw std::runtime_error("LevelHashTable is full");
+}
+
+bool LevelHashTable::exist(unsigned long long code) const
+{
+    for (size_t slot = hash(code), probe = 0; probe <= mask; slot = (slot + 1) & mask, ++probe)
+    {
+        unsigned long long key = keys[slot].load(std::memory_order_acquire);
+        if (key == code)
+            return true;
+        if (key == EMPTY_KEY)
+            return false;
+    }
+    return false;
+}
+
+size_t LevelHashTable::size() const
+{
+    return numOfNodes.load();
+}
+
+size_t LevelHashTable::capacity() const
+{
+    return mask + 1;
+}
+
+void LevelHashTable::extract(MortonLevel& level, unsigned int numOfBits) const
+{
+    // compact the used slots, each block write into its own output range
+    const size_t numOfBlocks = (capacity() + EXTRACT_BLOCK_SIZE - 1) / EXTRACT_BLOCK_SIZE;
+    std::vector<size_t> blockOffsets(numOfBlocks + 1, 0);
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t count = 0;
+        size_t end = std::min(capacity(), (block + 1) * EXTRACT_BLOCK_SIZE);
+        for (size_t slot = block * EXTRACT_BLOCK_SIZE; slot < end; ++slot)
+        {
+            count += keys[slot].load(std::memory_order_relaxed) != EMPTY_KEY ? 1 : 0;
+        }
+        blockOffsets[block + 1] = count;
+    });
+    for (size_t block = 0; block < numOfBlocks; ++block)
+    {
+        blockOffsets[block + 1] += blockOffsets[block];
+    }
+
+    std::vector<unsigned long long> codes(blockOffsets[numOfBlocks]);
+    std::vector<unsigned int> slots(codes.size());
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t output = blockOffsets[block];
+        size_t end = std::min(capacity(), (block + 1) * EXTRACT_BLOCK_SIZE);
+        for (size_t slot = block * EXTRACT_BLOCK_SIZE; slot < end; ++slot)
+        {
+            unsigned long long key = keys[slot].load(std::memory_order_relaxed);
+            if (key != EMPTY_KEY)
+            {
+                codes[output] = key;
+                slots[output] = (unsigned int)slot;
+                ++output;
+            }
+        }
+    });
+
+    RadixSort::sort(codes, slots, numOfBits);
+
+    level.codes.swap(codes);
+    level.children.resize(slots.size());
+    tbb::parallel_for((size_t)0, slots.size(), [&](size_t i)
+    {
+        level.children[i] = children[slots[i]].load(std::memory_order_relaxed);
+    });
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include "Octree.h"
+
+namespace CPC
+{
+    // Fixed capacity open addressing hash table of one octree level, keyed by the node Morton code.
+    // Insertion is lock-free, the key is claimed with a compare and swap and the child bit is set with fetch_or,
+    // so every TBB worker can insert concurrently without a mutex.
+    class LevelHashTable
+    {
+        public:
+            // throw if it would need more than 2^32 slots
+            LevelHashTable(size_t maxNumOfNodes);
+
+            // Set the child bit of the node, creating the node if needed.
+            // Return true if this call created the node, in which case the caller is responsible to add it to its parent.
+            bool addChild(unsigned long long code, unsigned char childId);
+            bool exist(unsigned long long code) const;
+            size_t size() const;
+            size_t capacity() const;
+
+            // Copy the nodes into a flat level sorted by Morton code, not thread safe with addChild
+            void extract(MortonLevel& level, unsigned int numOfBits) const;
+
+        protected:
+            size_t hash(unsigned long long code) const;
+
+            std::unique_ptr<std::atomic<unsigned long long>[]> keys;
+            std::unique_ptr<std::atomic<unsigned char>[]> children;
+            std::atomic<size_t> numOfNodes;
+            size_t mask;
+            unsigned int log2Capacity;
+    };
+}
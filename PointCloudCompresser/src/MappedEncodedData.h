@@ -0,0 +1,27 @@
+#pragma once
+#include "Encoder.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace CPC
+{
+    // A .cpc with a SUB_ROOT_INDEX mapped in memory, filled by PointCloudIO::mapCpc. Opening it only read the header and
+    // the section sizes, the payload and the index stay in the mapping, so a query only touch the pages of the sub-octrees it decode.
+    struct MappedEncodedData
+    {
+        MappedEncodedData() : maxDepth(0), subOctreeDepth(0), flags(0), payload(nullptr), payloadSize(0) {};
+        bool isValid() const { return payload != nullptr && payloadSize != 0; }
+        bool hasFlag(EncodedDataFlag flag) const { return (flags & flag) != 0; }
+
+        BoundingBox sceneBoundingBox;
+        unsigned char maxDepth;
+        unsigned char subOctreeDepth;
+        unsigned int flags; // EncodedDataFlag bits
+        const unsigned char* payload; // same bytes as EncodedData::encodedData
+        size_t payloadSize;
+        SubRootIndex subRootIndex; // view of the index footer
+
+        boost::interprocess::file_mapping file;
+        boost::interprocess::mapped_region region;
+    };
+}
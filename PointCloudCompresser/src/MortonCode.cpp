@@ -29,6 +29,9 @@ unsigned int CPC::MortonCode::encode32(const Index & index)
 
 unsigned long long CPC::MortonCode::encode64(const Index & index)
 {
+    // only 21 bits per axis fit, a larger index would alias a node of the octree once cut down
+    if ((index.x() | index.y() | index.z()) > 0x1FFFFF)
+        return INVALID_MORTON_CODE;
     return libmorton::morton3D_64_encode(index.x(), index.y(), index.z());
 }
 
@@ -4,6 +4,9 @@
 
 namespace CPC
 {
+    // given by encode64 to an index over 21 bits on an axis, it is above every valid code so it never match a node
+    const unsigned long long INVALID_MORTON_CODE = ~0ull;
+
     class MortonCode
     {
         public:
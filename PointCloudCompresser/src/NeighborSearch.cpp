@@ -0,0 +1,261 @@
+#include "NeighborSearch.h"
+#include "Decoder.h"
+#include "MortonCode.h"
+#include "RadixSort.h"
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <limits>
+
+using namespace CPC;
+
+// points searched by a thread at once in the batches
+const size_t SEARCH_GRAIN_SIZE = 256;
+
+NeighborSearch::NeighborSearch(Octree& octree) : bbox(octree.getBoundingBox()), maxDepth(octree.getMaxDepth()), cells(maxDepth, bbox),
+    levels(&octree.getMortonLevels()), lazyLevel(maxDepth), data(nullptr), byteBudget(0)
+{
+    leafCellSize = cells.getLeafCellSize();
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
+    for (unsigned char childId = 0; childId < 8; ++childId)
+    {
+        childPositions[childId] = Octree::getChildOffset(childId).cast<float>().cwiseProduct(leafCellSize);
+    }
+}
+
+NeighborSearch::NeighborSearch(EncodedData& data_, size_t byteBudget_) : bbox(data_.sceneBoundingBox), maxDepth(data_.maxDepth), cells(maxDepth, bbox),
+    levels(&decodedLevels), lazyLevel(data_.subOctreeDepth), data(&data_), byteBudget(byteBudget_)
+{
+    leafCellSize = cells.getLeafCellSize();
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
+    for (unsigned char childId = 0; childId < 8; ++childId)
+    {
+        childPositions[childId] = Octree::getChildOffset(childId).cast<float>().cwiseProduct(leafCellSize);
+    }
+    if (!data_.isValid() || maxDepth == 0)
+        return;
+
+    Decoder decoder;
+    if (data_.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        decoder.decodeLevels(data_, decodedLevels);
+        lazyLevel = maxDepth;
+    }
+    else
+    {
+        // the sub-roots in Morton order with their payload
+        std::vector<std::pair<unsigned long long, size_t>> subRoots;
+        for (auto& subNode : decoder.decodeNodeHeaders(data_))
+        {
+            subRoots.push_back(std::make_pair(MortonCode::encode64(subNode.first), subNode.second));
+        }
+        std::sort(subRoots.begin(), subRoots.end());
+
+        decodedLevels.resize(maxDepth);
+        auto& rootLevel = decodedLevels[lazyLevel];
+        rootLevel.resize(subRoots.size()); // their children bits are only known once decoded
+        subRootPositions.resize(subRoots.size());
+        for (size_t i = 0; i < subRoots.size(); ++i)
+        {
+            rootLevel.codes[i] = subRoots[i].first;
+            subRootPositions[i] = subRoots[i].second;
+        }
+    }
+
+    // the nodes above the sub-roots
+    for (int level = (int)data_.subOctreeDepth - 1; level >= 0; --level)
+    {
+        decodedLevels[level].reduceChildren(decodedLevels[level + 1].codes);
+    }
+}
+
+void NeighborSearch::knn(const Eigen::Vector3f& point, size_t k, std::vector<Neighbor>& neighbors)
+{
+    search(point, k, std::numeric_limits<float>::infinity(), threadStates.local(), neighbors);
+}
+
+void NeighborSearch::radiusSearch(const Eigen::Vector3f& point, float radius, std::vector<Neighbor>& neighbors)
+{
+    search(point, std::numeric_limits<size_t>::max(), radius * radius, threadStates.local(), neighbors);
+}
+
+void NeighborSearch::knnBatch(const Eigen::Vector3f* points, size_t numOfPoints, size_t k, std::vector<std::vector<Neighbor>>& neighbors)
+{
+    searchBatch(points, numOfPoints, k, std::numeric_limits<float>::infinity(), neighbors);
+}
+
+void NeighborSearch::radiusSearchBatch(const Eigen::Vector3f* points, size_t numOfPoints, float radius, std::vector<std::vector<Neighbor>>& neighbors)
+{
+    searchBatch(points, numOfPoints, std::numeric_limits<size_t>::max(), radius * radius, neighbors);
+}
+
+SubOctreeCacheStats NeighborSearch::getCacheStats()
+{
+    SubOctreeCacheStats total;
+    for (auto& state : threadStates)
+    {
+        if (!state.cache)
+            continue;
+        auto stats = state.cache->getStats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+        total.bytes += stats.bytes;
+        total.numOfSubOctrees += stats.numOfSubOctrees;
+    }
+    return total;
+}
+
+void NeighborSearch::search(const Eigen::Vector3f& point, size_t k, float maxSquaredDistance, ThreadState& state, std::vector<Neighbor>& neighbors)
+{
+    neighbors.clear();
+    if (k == 0 || levels->empty())
+        return;
+
+    // the neighbors are a max heap, the furthest one is replaced first
+    auto worstDistance = [&]()
+    {
+        return neighbors.size() == k ? neighbors.front().squaredDistance : maxSquaredDistance;
+    };
+    auto addPoint = [&](const Eigen::Vector3f& position)
+    {
+        float squaredDistance = (position - point).squaredNorm();
+        if (neighbors.size() == k ? squaredDistance >= neighbors.front().squaredDistance : squaredDistance > maxSquaredDistance)
+            return;
+        if (neighbors.size() == k)
+        {
+            std::pop_heap(neighbors.begin(), neighbors.end());
+            neighbors.pop_back();
+        }
+        neighbors.push_back(Neighbor(position, squaredDistance));
+        std::push_heap(neighbors.begin(), neighbors.end());
+    };
+
+    // the queue is a heap with the closest cell on top
+    auto isFurther = [](const QueueEntry& a, const QueueEntry& b) { return a.bound > b.bound; };
+    auto& queue = state.queue;
+    queue.clear();
+    queue.push_back(QueueEntry(cellDistance(point, 0, Index(0, 0, 0)), 0, 0));
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), isFurther);
+        QueueEntry entry = queue.back();
+        queue.pop_back();
+        // every cell left is further than the neighbors
+        if (entry.bound > worstDistance())
+            break;
+
+        unsigned char children;
+        if (!findChildren(entry.level, entry.code, state, children))
+            continue;
+        Index index = MortonCode::decode64(entry.code);
+        if (children == 0)
+        {
+            addPoint(cells.computeNodePosition(entry.level, index));
+            continue;
+        }
+
+        // the leaves, the same positions as generatePointCloud
+        if (entry.level + 1u == maxDepth)
+        {
+            Eigen::Vector3f nodePos(bbox.min.x() + leafCellSize.x() * 2 * index.x(), bbox.min.y() + leafCellSize.y() * 2 * index.y(), bbox.min.z() + leafCellSize.z() * 2 * index.z());
+            for (unsigned char childId = 0; childId < 8; ++childId)
+            {
+                if (children & (1 << childId))
+                    addPoint(nodePos + childPositions[childId]);
+            }
+            continue;
+        }
+
+        for (unsigned char childId = 0; childId < 8; ++childId)
+        {
+            if (!(children & (1 << childId)))
+                continue;
+            unsigned long long childCode = (entry.code << 3) | childId;
+            float bound = cellDistance(point, entry.level + 1, MortonCode::decode64(childCode));
+            if (bound <= worstDistance())
+            {
+                queue.push_back(QueueEntry(bound, entry.level + 1, childCode));
+                std::push_heap(queue.begin(), queue.end(), isFurther);
+            }
+        }
+    }
+    std::sort_heap(neighbors.begin(), neighbors.end());
+}
+
+void NeighborSearch::searchBatch(const Eigen::Vector3f* points, size_t numOfPoints, size_t k, float maxSquaredDistance, std::vector<std::vector<Neighbor>>& neighbors)
+{
+    neighbors.resize(numOfPoints);
+    if (numOfPoints == 0)
+        return;
+
+    std::vector<unsigned long long> codes(numOfPoints);
+    std::vector<unsigned int> order(numOfPoints);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfPoints), [&](const tbb::blocked_range<size_t>& range)
+    {
+        quantizer.computeLeafAddresses(points + range.begin(), range.size(), nullptr, &codes[range.begin()]);
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            order[i] = (unsigned int)i;
+        }
+    });
+    RadixSort::sort(codes, order, 3 * maxDepth);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfPoints, SEARCH_GRAIN_SIZE), [&](const tbb::blocked_range<size_t>& range)
+    {
+        auto& state = threadStates.local();
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            search(points[order[i]], k, maxSquaredDistance, state, neighbors[order[i]]);
+        }
+    });
+}
+
+bool NeighborSearch::findChildren(unsigned int level, unsigned long long code, ThreadState& state, unsigned char& children)
+{
+    const std::vector<MortonLevel>* nodeLevels = levels;
+    if (level >= lazyLevel)
+    {
+        nodeLevels = findSubOctree(code >> (3 * (level - lazyLevel)), state);
+        if (!nodeLevels)
+            return false;
+    }
+
+    auto& mortonLevel = (*nodeLevels)[level];
+    auto itr = std::lower_bound(mortonLevel.codes.begin(), mortonLevel.codes.end(), code);
+    if (itr == mortonLevel.codes.end() || *itr != code)
+        return false;
+    children = mortonLevel.children[itr - mortonLevel.codes.begin()];
+    return true;
+}
+
+const std::vector<MortonLevel>* NeighborSearch::findSubOctree(unsigned long long rootCode, ThreadState& state)
+{
+    if (!state.cache)
+        state.cache.reset(new SubOctreeCache(*data, byteBudget));
+    auto cached = state.cache->find(rootCode);
+    if (cached)
+        return cached;
+
+    auto& roots = decodedLevels[lazyLevel].codes;
+    auto itr = std::lower_bound(roots.begin(), roots.end(), rootCode);
+    if (itr == roots.end() || *itr != rootCode)
+        return nullptr;
+
+    state.scratchLevels.resize(maxDepth);
+    for (auto& level : state.scratchLevels)
+    {
+        level.clear();
+    }
+    Decoder::decodeSubOctree(data->encodedData.data(), data->currentSize, (unsigned char)lazyLevel, (unsigned char)maxDepth, subRootPositions[itr - roots.begin()], rootCode, state.scratchLevels);
+    return &state.cache->insert(rootCode, state.scratchLevels);
+}
+
+float NeighborSearch::cellDistance(const Eigen::Vector3f& point, unsigned int level, const Index& index) const
+{
+    // padded by half a leaf cell like the range queries, so the rounding of the leaf positions can't put them out of their cell
+    Eigen::Vector3f cellSize = leafCellSize * (float)(1ull << (maxDepth - level));
+    Eigen::Vector3f min = bbox.min + index.cast<float>().cwiseProduct(cellSize) - leafCellSize * 0.5f;
+    Eigen::Vector3f max = min + cellSize + leafCellSize;
+    return (min - point).cwiseMax(point - max).cwiseMax(0.f).squaredNorm();
+}
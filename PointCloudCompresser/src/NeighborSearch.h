@@ -0,0 +1,86 @@
+#pragma once
+#include "Octree.h"
+#include "Encoder.h"
+#include "SubOctreeCache.h"
+#include <tbb/enumerable_thread_specific.h>
+#include <memory>
+
+namespace CPC
+{
+    struct Neighbor
+    {
+        Neighbor() : squaredDistance(0.f) {}
+        Neighbor(const Eigen::Vector3f& position_, float squaredDistance_) : position(position_), squaredDistance(squaredDistance_) {}
+        bool operator<(const Neighbor& other) const { return squaredDistance < other.squaredDistance; }
+
+        Eigen::Vector3f position; // a leaf point, as generatePointCloud give it
+        float squaredDistance;
+    };
+
+    // Nearest neighbors and radius search over the leaf points of an octree, or of encoded data decoded lazily.
+    // The nodes are visited best first, the closest cell first, and the search stop when the closest cell left is further
+    // than the neighbors found. The searches can run concurrently, each thread has its own cache and scratch memory.
+    class NeighborSearch
+    {
+        public:
+            // the octree must not be modified while it is searched
+            NeighborSearch(Octree& octree);
+            // Search the encoded data without decoding it first, only the nodes above the sub-roots are built. The depth first
+            // sub-octrees are decoded when the search first reach them, into a cache of byteBudget for each thread. The breadth
+            // first layout has no sub-octree payload of its own, it is decoded whole. The data must outlive the search.
+            NeighborSearch(EncodedData& data, size_t byteBudget);
+
+            // the k nearest points sorted by distance, fewer if there are not that many
+            void knn(const Eigen::Vector3f& point, size_t k, std::vector<Neighbor>& neighbors);
+            // all the points within radius sorted by distance
+            void radiusSearch(const Eigen::Vector3f& point, float radius, std::vector<Neighbor>& neighbors);
+            // Search many points in parallel, neighbors[i] is for points[i]. The points are sorted by Morton code first,
+            // so the points of a thread are close together and reach the same sub-octrees.
+            void knnBatch(const Eigen::Vector3f* points, size_t numOfPoints, size_t k, std::vector<std::vector<Neighbor>>& neighbors);
+            void radiusSearchBatch(const Eigen::Vector3f* points, size_t numOfPoints, float radius, std::vector<std::vector<Neighbor>>& neighbors);
+
+            // summed over the cache of every thread, empty when searching an octree
+            SubOctreeCacheStats getCacheStats();
+
+        protected:
+            struct QueueEntry
+            {
+                QueueEntry() : bound(0.f), level(0), code(0) {}
+                QueueEntry(float bound_, unsigned char level_, unsigned long long code_) : bound(bound_), level(level_), code(code_) {}
+
+                float bound; // squared distance to the cell of the node, no point below it is closer
+                unsigned char level;
+                unsigned long long code;
+            };
+
+            struct ThreadState
+            {
+                std::unique_ptr<SubOctreeCache> cache;
+                std::vector<MortonLevel> scratchLevels; // a sub-octree being decoded
+                std::vector<QueueEntry> queue;
+            };
+
+            // at most k neighbors within the squared distance
+            void search(const Eigen::Vector3f& point, size_t k, float maxSquaredDistance, ThreadState& state, std::vector<Neighbor>& neighbors);
+            void searchBatch(const Eigen::Vector3f* points, size_t numOfPoints, size_t k, float maxSquaredDistance, std::vector<std::vector<Neighbor>>& neighbors);
+            bool findChildren(unsigned int level, unsigned long long code, ThreadState& state, unsigned char& children);
+            const std::vector<MortonLevel>* findSubOctree(unsigned long long rootCode, ThreadState& state);
+            float cellDistance(const Eigen::Vector3f& point, unsigned int level, const Index& index) const;
+
+            BoundingBox bbox;
+            unsigned int maxDepth;
+            Octree cells; // empty, only for the cell sizes and the node positions
+            LeafQuantizer quantizer;
+            Eigen::Vector3f leafCellSize;
+            Eigen::Vector3f childPositions[8];
+
+            const std::vector<MortonLevel>* levels; // the nodes above lazyLevel
+            std::vector<MortonLevel> decodedLevels; // the levels of the encoded data, down to its sub-roots for the depth first layout
+            unsigned int lazyLevel; // the sub-octrees from this level are decoded on demand, maxDepth when everything is in levels
+            const EncodedData* data;
+            std::vector<size_t> subRootPositions; // payload position of each sub-root of decodedLevels[lazyLevel]
+            size_t byteBudget;
+
+            tbb::enumerable_thread_specific<ThreadState> threadStates;
+    };
+}
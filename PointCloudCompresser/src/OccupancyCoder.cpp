@@ -0,0 +1,102 @@
+#include "OccupancyCoder.h"
+#include "RangeCoder.h"
+
+using namespace CPC;
+
+const size_t NUM_OF_PARENT_CONTEXTS = 4; // parent with 1, 2, 3 to 4 or more children
+const size_t NUM_OF_SIBLING_CONTEXTS = 3; // no previous sibling, sparse or dense previous sibling
+const size_t NUM_OF_CONTEXTS = NUM_OF_PARENT_CONTEXTS * 8 * NUM_OF_SIBLING_CONTEXTS;
+const size_t PROBABILITIES_PER_CONTEXT = 256; // bit tree of a byte, node 0 unused
+
+size_t OccupancyCoder::getContext(unsigned char parent, unsigned char childId, unsigned char previousSibling)
+{
+    // the full parent byte spread the statistics over too many contexts, only its density is kept
+    size_t numOfChildren = childCount(parent);
+    size_t density = numOfChildren <= 1 ? 0 : (numOfChildren == 2 ? 1 : (numOfChildren <= 4 ? 2 : 3));
+    size_t sibling = previousSibling == 0 ? 0 : (childCount(previousSibling) <= 2 ? 1 : 2);
+    return ((density * 8 + childId) * NUM_OF_SIBLING_CONTEXTS + sibling) * PROBABILITIES_PER_CONTEXT;
+}
+
+void OccupancyCoder::encode(const std::vector<MortonLevel>& levels, unsigned int firstLevel, std::vector<unsigned char>& output, std::vector<unsigned short>& probabilities)
+{
+    RangeEncoder encoder(output);
+    probabilities.resize(NUM_OF_CONTEXTS * PROBABILITIES_PER_CONTEXT);
+
+    for (size_t level = firstLevel; level < levels.size(); ++level)
+    {
+        std::fill(probabilities.begin(), probabilities.end(), INITIAL_PROBABILITY);
+        auto& currentLevel = levels[level];
+
+        // the parents of the sub-roots aren't coded, only their position is known
+        if (level == firstLevel)
+        {
+            for (size_t i = 0; i < currentLevel.size(); ++i)
+            {
+                encoder.encodeByte(&probabilities[getContext(1, currentLevel.codes[i] & 7, 0)], currentLevel.children[i]);
+            }
+            continue;
+        }
+
+        // the children of each parent are contiguous and in increasing child id
+        auto& parentLevel = levels[level - 1];
+        size_t position = 0;
+        for (size_t parent = 0; parent < parentLevel.size(); ++parent)
+        {
+            unsigned char parentChildren = parentLevel.children[parent];
+            unsigned char previousSibling = 0;
+            for (unsigned char childId = 0; childId < 8; ++childId)
+            {
+                if (!(parentChildren & (1 << childId)))
+                    continue;
+                unsigned char children = currentLevel.children[position++];
+                encoder.encodeByte(&probabilities[getContext(parentChildren, childId, previousSibling)], children);
+                previousSibling = children;
+            }
+        }
+    }
+    encoder.flush();
+}
+
+size_t OccupancyCoder::decode(const unsigned char* input, size_t size, std::vector<MortonLevel>& levels, unsigned int firstLevel)
+{
+    RangeDecoder decoder(input, size);
+    std::vector<unsigned short> probabilities(NUM_OF_CONTEXTS * PROBABILITIES_PER_CONTEXT);
+
+    for (size_t level = firstLevel; level < levels.size(); ++level)
+    {
+        std::fill(probabilities.begin(), probabilities.end(), INITIAL_PROBABILITY);
+        auto& currentLevel = levels[level];
+        currentLevel.children.resize(currentLevel.size());
+
+        if (level == firstLevel)
+        {
+            for (size_t i = 0; i < currentLevel.size(); ++i)
+            {
+                currentLevel.children[i] = decoder.decodeByte(&probabilities[getContext(1, currentLevel.codes[i] & 7, 0)]);
+            }
+        }
+        else
+        {
+            auto& parentLevel = levels[level - 1];
+            size_t position = 0;
+            for (size_t parent = 0; parent < parentLevel.size(); ++parent)
+            {
+                unsigned char parentChildren = parentLevel.children[parent];
+                unsigned char previousSibling = 0;
+                for (unsigned char childId = 0; childId < 8; ++childId)
+                {
+                    if (!(parentChildren & (1 << childId)))
+                        continue;
+                    unsigned char children = decoder.decodeByte(&probabilities[getContext(parentChildren, childId, previousSibling)]);
+                    currentLevel.children[position++] = children;
+                    previousSibling = children;
+                }
+            }
+        }
+
+        // the decoded bytes give the codes of the next level
+        if (level + 1 < levels.size())
+            currentLevel.expandChildren(levels[level + 1]);
+    }
+    return decoder.getPosition();
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "Octree.h"
+
+namespace CPC
+{
+    // Entropy code the occupancy bytes of the flat levels with an adaptive range coder.
+    // Each byte is coded in the context of the number of children of its parent, its position in the parent and the occupancy
+    // of its previous sibling. Every level start with fresh statistics, the levels don't share the same distribution.
+    class OccupancyCoder
+    {
+        public:
+            // Code the children bits of the levels from firstLevel down to the last one, appended to output.
+            // probabilities is scratch memory for the contexts, kept by the caller so repeated encodes don't reallocate it.
+            static void encode(const std::vector<MortonLevel>& levels, unsigned int firstLevel, std::vector<unsigned char>& output, std::vector<unsigned short>& probabilities);
+            // levels[firstLevel].codes need to be set, the codes of the levels below are expanded from the decoded bytes.
+            // Return the number of bytes consumed.
+            static size_t decode(const unsigned char* input, size_t size, std::vector<MortonLevel>& levels, unsigned int firstLevel);
+
+        protected:
+            static size_t getContext(unsigned char parent, unsigned char childId, unsigned char previousSibling);
+    };
+}
@@ -0,0 +1,210 @@
+#include "OctahedralQuantizer.h"
+#include "CpuFeatures.h"
+#include <cmath>
+#include <algorithm>
+#ifdef CPC_X86
+#include <immintrin.h>
+#endif
+
+using namespace CPC;
+
+OctahedralQuantizer::OctahedralQuantizer(unsigned int bits_) : bits(std::min(std::max(bits_, 1u), 16u))
+{
+    maxValue = (float)((1 << bits) - 1);
+    inverseScale = 2.f / maxValue;
+}
+
+unsigned int OctahedralQuantizer::getBits() const
+{
+    return bits;
+}
+
+static inline float signOf(float value)
+{
+    return value >= 0.f ? 1.f : -1.f;
+}
+
+// from [-1, 1] to the nearest of the maxValue + 1 steps
+static inline unsigned int quantize(float value, float maxValue)
+{
+    float scaled = std::floor((value * 0.5f + 0.5f) * maxValue + 0.5f);
+    // clamped like _mm256_max_ps and _mm256_min_ps, a NaN become 0
+    scaled = scaled > 0.f ? scaled : 0.f;
+    scaled = scaled < maxValue ? scaled : maxValue;
+    return (unsigned int)scaled;
+}
+
+unsigned int OctahedralQuantizer::encode(const Eigen::Vector3f& normal) const
+{
+    // a null normal end up on the center of the square
+    float sum = std::abs(normal.x()) + std::abs(normal.y()) + std::abs(normal.z());
+    sum = sum == 0.f ? 1.f : sum;
+    float x = normal.x() / sum, y = normal.y() / sum, z = normal.z() / sum;
+    if (z < 0.f)
+    {
+        float foldedX = (1.f - std::abs(y)) * signOf(x);
+        float foldedY = (1.f - std::abs(x)) * signOf(y);
+        x = foldedX;
+        y = foldedY;
+    }
+    return (quantize(x, maxValue) << bits) | quantize(y, maxValue);
+}
+
+Eigen::Vector3f OctahedralQuantizer::decode(unsigned int code) const
+{
+    float x = (float)(code >> bits) * inverseScale - 1.f;
+    float y = (float)(code & ((1u << bits) - 1)) * inverseScale - 1.f;
+    float z = 1.f - std::abs(x) - std::abs(y);
+    // unfold the lower half
+    float t = std::max(-z, 0.f);
+    x = x >= 0.f ? x - t : x + t;
+    y = y >= 0.f ? y - t : y + t;
+    float length = std::sqrt(x * x + y * y + z * z);
+    return Eigen::Vector3f(x / length, y / length, z / length);
+}
+
+void OctahedralQuantizer::encode(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const
+{
+#ifdef CPC_X86
+    static const bool useAVX2 = CpuFeatures::hasAVX2();
+    if (useAVX2)
+    {
+        encodeAVX2(normals, numOfNormals, codes);
+        return;
+    }
+#endif
+    encodeSerial(normals, numOfNormals, codes);
+}
+
+void OctahedralQuantizer::decode(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const
+{
+#ifdef CPC_X86
+    static const bool useAVX2 = CpuFeatures::hasAVX2();
+    if (useAVX2)
+    {
+        decodeAVX2(codes, numOfNormals, normals);
+        return;
+    }
+#endif
+    decodeSerial(codes, numOfNormals, normals);
+}
+
+void OctahedralQuantizer::encodeSerial(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const
+{
+    for (size_t i = 0; i < numOfNormals; ++i)
+    {
+        codes[i] = encode(normals[i]);
+    }
+}
+
+void OctahedralQuantizer::decodeSerial(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const
+{
+    for (size_t i = 0; i < numOfNormals; ++i)
+    {
+        normals[i] = decode(codes[i]);
+    }
+}
+
+#ifdef CPC_X86
+CPC_TARGET_AVX2 static inline __m256 absAVX2(__m256 value)
+{
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.f), value);
+}
+
+CPC_TARGET_AVX2 static inline __m256 signAVX2(__m256 value)
+{
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.f), _mm256_set1_ps(1.f), _mm256_cmp_ps(value, _mm256_setzero_ps(), _CMP_GE_OQ));
+}
+
+CPC_TARGET_AVX2 static inline __m256i quantizeAVX2(__m256 value, __m256 maxValue)
+{
+    // same operations as the scalar quantize, so the result is bit identical
+    const __m256 half = _mm256_set1_ps(0.5f);
+    __m256 scaled = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(value, half), half), maxValue), half));
+    scaled = _mm256_min_ps(_mm256_max_ps(scaled, _mm256_setzero_ps()), maxValue);
+    return _mm256_cvttps_epi32(scaled);
+}
+
+CPC_TARGET_AVX2 void OctahedralQuantizer::encodeAVX2(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const
+{
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 maxValues = _mm256_set1_ps(maxValue);
+
+    size_t i = 0;
+    for (; i + 8 <= numOfNormals; i += 8)
+    {
+        // deinterleave 8 packed xyz normals into x, y and z registers, like LeafQuantizer
+        const float* group = reinterpret_cast<const float*>(normals + i);
+        __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group)), _mm_loadu_ps(group + 12), 1);
+        __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group + 4)), _mm_loadu_ps(group + 16), 1);
+        __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(group + 8)), _mm_loadu_ps(group + 20), 1);
+        __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+        __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+        __m256 x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+        __m256 y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(absAVX2(x), absAVX2(y)), absAVX2(z));
+        sum = _mm256_blendv_ps(sum, one, _mm256_cmp_ps(sum, zero, _CMP_EQ_OQ));
+        x = _mm256_div_ps(x, sum);
+        y = _mm256_div_ps(y, sum);
+        z = _mm256_div_ps(z, sum);
+
+        __m256 lower = _mm256_cmp_ps(z, zero, _CMP_LT_OQ);
+        __m256 foldedX = _mm256_mul_ps(_mm256_sub_ps(one, absAVX2(y)), signAVX2(x));
+        __m256 foldedY = _mm256_mul_ps(_mm256_sub_ps(one, absAVX2(x)), signAVX2(y));
+        x = _mm256_blendv_ps(x, foldedX, lower);
+        y = _mm256_blendv_ps(y, foldedY, lower);
+
+        __m256i u = _mm256_sll_epi32(quantizeAVX2(x, maxValues), _mm_cvtsi32_si128((int)bits));
+        __m256i v = quantizeAVX2(y, maxValues);
+        _mm256_storeu_si256((__m256i*)(codes + i), _mm256_or_si256(u, v));
+    }
+
+    // remaining normals
+    encodeSerial(normals + i, numOfNormals - i, codes + i);
+}
+
+CPC_TARGET_AVX2 void OctahedralQuantizer::decodeAVX2(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const
+{
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 scale = _mm256_set1_ps(inverseScale);
+    const __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+
+    alignas(32) float xs[8], ys[8], zs[8];
+    size_t i = 0;
+    for (; i + 8 <= numOfNormals; i += 8)
+    {
+        __m256i code = _mm256_loadu_si256((const __m256i*)(codes + i));
+        __m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srl_epi32(code, _mm_cvtsi32_si128((int)bits))), scale), one);
+        __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(code, mask)), scale), one);
+        __m256 z = _mm256_sub_ps(_mm256_sub_ps(one, absAVX2(x)), absAVX2(y));
+
+        __m256 t = _mm256_max_ps(_mm256_sub_ps(zero, z), zero);
+        x = _mm256_blendv_ps(_mm256_add_ps(x, t), _mm256_sub_ps(x, t), _mm256_cmp_ps(x, zero, _CMP_GE_OQ));
+        y = _mm256_blendv_ps(_mm256_add_ps(y, t), _mm256_sub_ps(y, t), _mm256_cmp_ps(y, zero, _CMP_GE_OQ));
+
+        __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+        _mm256_store_ps(xs, _mm256_div_ps(x, length));
+        _mm256_store_ps(ys, _mm256_div_ps(y, length));
+        _mm256_store_ps(zs, _mm256_div_ps(z, length));
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            normals[i + lane] = Eigen::Vector3f(xs[lane], ys[lane], zs[lane]);
+        }
+    }
+
+    // remaining normals
+    decodeSerial(codes + i, numOfNormals - i, normals + i);
+}
+#else
+void OctahedralQuantizer::encodeAVX2(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const
+{
+    encodeSerial(normals, numOfNormals, codes);
+}
+
+void OctahedralQuantizer::decodeAVX2(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const
+{
+    decodeSerial(codes, numOfNormals, normals);
+}
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+#include <Eigen/dense>
+
+namespace CPC
+{
+    // Quantize unit normals on the octahedron, the normal is projected on |x| + |y| + |z| = 1 and the lower half is folded
+    // over the upper one, which give a square with bits per side. The code is u << bits | v.
+    // The batch versions use AVX2 when the cpu support it, and give the exact same result as the single normal versions.
+    class OctahedralQuantizer
+    {
+        public:
+            OctahedralQuantizer(unsigned int bits = 10);
+
+            unsigned int getBits() const;
+            unsigned int encode(const Eigen::Vector3f& normal) const;
+            Eigen::Vector3f decode(unsigned int code) const;
+            void encode(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const;
+            void decode(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const;
+
+        protected:
+            void encodeSerial(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const;
+            void decodeSerial(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const;
+            void encodeAVX2(const Eigen::Vector3f* normals, size_t numOfNormals, unsigned int* codes) const;
+            void decodeAVX2(const unsigned int* codes, size_t numOfNormals, Eigen::Vector3f* normals) const;
+
+            unsigned int bits;
+            float maxValue; // largest coordinate on each side of the square, 2^bits - 1
+            float inverseScale; // size of a step in [-1, 1]
+    };
+}
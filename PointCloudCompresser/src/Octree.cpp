@@ -2,84 +2,165 @@
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <iostream>
+#include <algorithm>
+#include "MortonCode.h"
+#include "RadixSort.h"
+#include "LevelHashTable.h"
+#include <memory>
+#include <string>
+#include <climits>
+#include <stdexcept>
 
 using namespace CPC;
 
-CPC::Octree::Octree(unsigned int maxDepth, BoundingBox& bbox_) : levels(maxDepth), levelMutexs(maxDepth), bbox(bbox_)
+const size_t REDUCE_BLOCK_SIZE = 1 << 16; // number of child codes handled by one task when reducing a level
+
+// Reduce a sorted list of child Morton codes into their parent level,
+// each unique (code >> 3) run become one parent node with the child bits of the run OR-ed together.
+// Duplicated codes simply OR the same bit again, so the leaf codes don't need to be unique.
+static void reduceLevel(const std::vector<unsigned long long>& childCodes, MortonLevel& parentLevel)
+{
+    const size_t size = childCodes.size();
+    const size_t numOfBlocks = (size + REDUCE_BLOCK_SIZE - 1) / REDUCE_BLOCK_SIZE;
+    auto isHead = [&](size_t i) { return i == 0 || (childCodes[i] >> 3) != (childCodes[i - 1] >> 3); };
+
+    // count the parent of each block, then exclusive scan them into each block output offset
+    std::vector<size_t> blockOffsets(numOfBlocks + 1, 0);
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t end = std::min(size, (block + 1) * REDUCE_BLOCK_SIZE);
+        size_t count = 0;
+        for (size_t i = block * REDUCE_BLOCK_SIZE; i < end; ++i)
+        {
+            count += isHead(i) ? 1 : 0;
+        }
+        blockOffsets[block + 1] = count;
+    });
+    for (size_t block = 0; block < numOfBlocks; ++block)
+    {
+        blockOffsets[block + 1] += blockOffsets[block];
+    }
+
+    parentLevel.resize(blockOffsets[numOfBlocks]);
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t end = std::min(size, (block + 1) * REDUCE_BLOCK_SIZE);
+        size_t output = blockOffsets[block];
+        for (size_t i = block * REDUCE_BLOCK_SIZE; i < end; ++i)
+        {
+            if (!isHead(i))
+                continue;
+            // the run may continue into the next block, the head owns the whole run
+            unsigned long long parentCode = childCodes[i] >> 3;
+            unsigned char children = 0;
+            for (size_t j = i; j < size && (childCodes[j] >> 3) == parentCode; ++j)
+            {
+                children |= 1 << (childCodes[j] & 7);
+            }
+            parentLevel.codes[output] = parentCode;
+            parentLevel.children[output] = children;
+            ++output;
+        }
+    });
+}
+
+// the Morton codes of the nodes and the fixed transversal stacks can't go deeper, checked before anything is allocated
+static unsigned int checkMaxDepth(unsigned int maxDepth)
+{
+    if (maxDepth > MAX_ENCODED_DEPTH)
+        throw std::runtime_error("octree depth over " + std::to_string(MAX_ENCODED_DEPTH));
+    return maxDepth;
+}
+
+CPC::Octree::Octree(unsigned int maxDepth, BoundingBox& bbox_) : levels(checkMaxDepth(maxDepth)), levelMutexs(maxDepth), levelsValid(true), mortonLevelsValid(false), bbox(bbox_), bottomup(0), topdown(0), numOfPoints(0), phaseTimingsMutex(new tbb::mutex)
 {
     leafCellSize = computeLeafCellSize(maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
 }
 
-Octree::Octree(unsigned int maxDepth, PointCloud& pointCloud) : levels(maxDepth), levelMutexs(maxDepth)
+Octree::Octree(unsigned int maxDepth, PointCloud& pointCloud, OctreeBuildMode buildMode) : levels(checkMaxDepth(maxDepth)), levelMutexs(maxDepth), levelsValid(true), mortonLevelsValid(false),
+                                                                                           bottomup(0), topdown(0), numOfPoints(pointCloud.positions.size()), phaseTimingsMutex(new tbb::mutex)
 {
-    generate(maxDepth, pointCloud);
+    if (buildMode == SORT_REDUCE_BUILD)
+        generateSortReduce(maxDepth, pointCloud);
+    else if (buildMode == HASH_BUILD)
+        generateHash(maxDepth, pointCloud);
+    else
+        generate(maxDepth, pointCloud);
 }
 
+// Child ids set in each possible children bits, in increasing order
+struct ChildIdTable
+{
+    ChildIdTable()
+    {
+        for (unsigned int children = 0; children < 256; ++children)
+        {
+            count[children] = 0;
+            for (unsigned char childId = 0; childId < 8; ++childId)
+            {
+                if (children & (1 << childId))
+                    ids[children][count[children]++] = childId;
+            }
+        }
+    }
+
+    unsigned char count[256];
+    unsigned char ids[256][8];
+};
+static const ChildIdTable childIdTable;
+
 PointCloud Octree::generatePointCloud()
 {
-    auto& currentLevel = levels[levels.size() - 1];
+    auto& currentLevel = getMortonLevels().back();
+
+    // Each node write its leaves into its own slice of the output, so the points come out in Morton order.
+    // The slices start at the exclusive scan of the number of children of each node.
+    std::vector<size_t> pointOffsets;
+    currentLevel.computeChildOffsets(pointOffsets);
+    size_t numOfPoints = currentLevel.size() ? pointOffsets.back() + childCount(currentLevel.children.back()) : 0;
+
     PointCloud pointCloud;
-    pointCloud.resize(currentLevel.size() * 8); // maximum possible number of points, we will resize it back to actual size later
-
-    tbb::atomic<size_t> counter = 0; // keep track of how many actual point there is
-
-    // Hack: We should change the internal representation of each Octree Level as a vector instead of map.
-    std::vector<std::pair< Index, Node>> vectorized(currentLevel.begin(), currentLevel.end());
-    tbb::parallel_for((size_t)0, vectorized.size(), [&](const size_t i)
-    //for(size_t i = 0; i < vectorized.size(); ++i)
-    {
-        auto& itr = vectorized[i];
-        Index index = itr.first;
-        Node node = itr.second;
-        unsigned char child = node.children.load();
-        
-        // leafCellSize * 2 since it is the parent node size.
-        float nodeX = bbox.min.x() + leafCellSize.x() * 2 * index.x();
-        float nodeY = bbox.min.y() + leafCellSize.y() * 2 * index.y();
-        float nodeZ = bbox.min.z() + leafCellSize.z() * 2 * index.z();
-        Vector3f nodePos(nodeX, nodeY, nodeZ);
-        
-        for (unsigned char childId = 0; childId < 8; ++childId)
+    pointCloud.resize(numOfPoints);
+
+    // position of each child relative to its parent node
+    Vector3f childPositions[8];
+    for (unsigned char childId = 0; childId < 8; ++childId)
+    {
+        childPositions[childId] = getChildOffset(childId).cast<float>().cwiseProduct(leafCellSize);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, currentLevel.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
         {
-            // for each child id, check if they exist
-            unsigned char childBit = 1 << childId;
-            unsigned char exist = child & childBit;
-            if (exist)
+            Index index = MortonCode::decode64(currentLevel.codes[i]);
+            unsigned char child = currentLevel.children[i];
+
+            // leafCellSize * 2 since it is the parent node size.
+            float nodeX = bbox.min.x() + leafCellSize.x() * 2 * index.x();
+            float nodeY = bbox.min.y() + leafCellSize.y() * 2 * index.y();
+            float nodeZ = bbox.min.z() + leafCellSize.z() * 2 * index.z();
+            Vector3f nodePos(nodeX, nodeY, nodeZ);
+
+            Vector3f* output = &pointCloud.positions[pointOffsets[i]];
+            for (unsigned char c = 0; c < childIdTable.count[child]; ++c)
             {
-                switch (exist)
-                {
-                    case 1:
-                        nodePos += Vector3f(0,0,0);
-                        break;
-                    case 2:
-                        nodePos += Vector3f(leafCellSize.x(), 0, 0);
-                        break;
-                    case 4:
-                        nodePos += Vector3f(0, leafCellSize.y(), 0);
-                        break;
-                    case 8:
-                        nodePos += Vector3f(leafCellSize.x(), leafCellSize.y(), 0);
-                        break;
-                    case 16:
-                        nodePos += Vector3f(0, 0, leafCellSize.z());
-                        break;
-                    case 32:
-                        nodePos += Vector3f(leafCellSize.x(), 0, leafCellSize.z());
-                        break;
-                    case 64:
-                        nodePos += Vector3f(0, leafCellSize.y(), leafCellSize.z());
-                        break;
-                    case 128:
-                        nodePos += Vector3f(leafCellSize.x(), leafCellSize.y(), leafCellSize.z());
-                        break;
-                }
-                pointCloud.positions[counter++] = nodePos;
+                output[c] = nodePos + childPositions[childIdTable.ids[child][c]];
             }
         }
     });
 
-    pointCloud.resize(counter);
-    pointCloud.shrink_to_fit();
+    // the nodes without children are truncated leaves, each give one point
+    for (unsigned int level = 0; level < getMaxDepth(); ++level)
+    {
+        auto& mortonLevel = mortonLevels[level];
+        for (size_t i = 0; i < mortonLevel.size(); ++i)
+        {
+            if (mortonLevel.children[i] == 0)
+                pointCloud.positions.push_back(computeNodePosition(level, MortonCode::decode64(mortonLevel.codes[i])));
+        }
+    }
 
     return pointCloud;
 }
@@ -96,9 +177,16 @@ Eigen::Vector3f Octree::getLeafCellSize() const
 
 std::vector<std::map<Index, Node>>& Octree::getLevels()
 {
+    syncLevels();
     return levels;
 }
 
+std::vector<MortonLevel>& Octree::getMortonLevels()
+{
+    syncMortonLevels();
+    return mortonLevels;
+}
+
 unsigned int Octree::getMaxDepth() const
 {
     return (unsigned int)levels.size();
@@ -107,9 +195,19 @@ unsigned int Octree::getMaxDepth() const
 size_t Octree::getNumOfAllNodes() const
 {
     size_t numOfNodes = 0;
-    for (auto& level : levels)
+    if (levelsValid)
+    {
+        for (auto& level : levels)
+        {
+            numOfNodes += level.size();
+        }
+    }
+    else
     {
-        numOfNodes += level.size();
+        for (auto& level : mortonLevels)
+        {
+            numOfNodes += level.size();
+        }
     }
 
     return numOfNodes;
@@ -117,14 +215,19 @@ size_t Octree::getNumOfAllNodes() const
 
 Node& CPC::Octree::addNode(const unsigned int level, const Index & index, const unsigned char child)
 {
+    syncLevels();
+    mortonLevelsValid = false;
     levels[level].insert(std::make_pair(index, Node(child)));
     return levels[level][index];
 }
 
 void Octree::generate(unsigned int maxDepth, PointCloud& pointCloud)
 {
+    auto phaseStart = std::chrono::steady_clock::now();
     bbox = computeBoundingBox(pointCloud);
     leafCellSize = computeLeafCellSize(maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
+    addPhaseTiming("bounding box", phaseStart);
 
     tbb::atomic<size_t> bottomUpTransverseCounter = 0;
 
@@ -138,6 +241,7 @@ void Octree::generate(unsigned int maxDepth, PointCloud& pointCloud)
         addLeaf(maxDepth, leafAddress, transversalCounter);
         bottomUpTransverseCounter += transversalCounter;
     });
+    addPhaseTiming("insert", phaseStart);
 
     //std::cout << "BottomUp transversal: " << bottomUpTransverseCounter << std::endl;
     //std::cout << "Normal transversal: " << pointCloud.positions.size() * maxDepth << std::endl;
@@ -145,16 +249,223 @@ void Octree::generate(unsigned int maxDepth, PointCloud& pointCloud)
     topdown = pointCloud.positions.size() * maxDepth;
 }
 
-BoundingBox Octree::computeBoundingBox(PointCloud & pointCloud)
+void Octree::generateSortReduce(unsigned int maxDepth, PointCloud& pointCloud)
 {
-    BoundingBox bbox;
+    auto phaseStart = std::chrono::steady_clock::now();
+    bbox = computeBoundingBox(pointCloud);
+    leafCellSize = computeLeafCellSize(maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
+    addPhaseTiming("bounding box", phaseStart);
 
-    for (auto& point : pointCloud.positions)
+    // compute the leaf Morton code of every point
+    std::vector<unsigned long long> leafCodes(pointCloud.positions.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, pointCloud.positions.size(), 4096), [&](const tbb::blocked_range<size_t>& range)
     {
-        bbox.expand(point);
+        computeLeafAddresses(&pointCloud.positions[range.begin()], range.size(), nullptr, &leafCodes[range.begin()]);
+    });
+    addPhaseTiming("leaf codes", phaseStart);
+
+    // only the 3 bits per level of the leaf codes are used
+    RadixSort::sort(leafCodes, 3 * maxDepth);
+    addPhaseTiming("sort", phaseStart);
+
+    // each parent level is the unique (code >> 3) runs of the level below it
+    mortonLevels.resize(maxDepth);
+    reduceLevel(leafCodes, mortonLevels[maxDepth - 1]);
+    for (int level = (int)maxDepth - 2; level >= 0; --level)
+    {
+        reduceLevel(mortonLevels[level + 1].codes, mortonLevels[level]);
     }
+    addPhaseTiming("reduce", phaseStart);
 
-    return bbox;
+    // the std::map levels are only built if someone ask for them
+    levelsValid = false;
+    mortonLevelsValid = true;
+
+    bottomup = leafCodes.size() + getNumOfAllNodes();
+    topdown = pointCloud.positions.size() * maxDepth;
+}
+
+void Octree::generateHash(unsigned int maxDepth, PointCloud& pointCloud)
+{
+    auto phaseStart = std::chrono::steady_clock::now();
+    bbox = computeBoundingBox(pointCloud);
+    leafCellSize = computeLeafCellSize(maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, leafCellSize, maxDepth);
+    addPhaseTiming("bounding box", phaseStart);
+
+    // Only the leaf parents need a table, the points are unsorted. It is extracted sorted by Morton code and freed, so
+    // the levels above are reduced from it like the sort build. The table can't have more nodes than the level allows.
+    mortonLevels.resize(maxDepth);
+    if (maxDepth == 0)
+        return;
+
+    const unsigned int leafLevel = maxDepth - 1;
+    std::unique_ptr<LevelHashTable> table(new LevelHashTable(leafLevel < 21 ? std::min(numOfPoints, (size_t)1 << (3 * leafLevel)) : numOfPoints));
+    const size_t batchSize = 512;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfPoints, batchSize), [&](const tbb::blocked_range<size_t>& range)
+    {
+        unsigned long long codes[batchSize];
+        for (size_t begin = range.begin(); begin < range.end(); begin += batchSize)
+        {
+            size_t numOfBatchPoints = std::min(batchSize, range.end() - begin);
+            computeLeafAddresses(&pointCloud.positions[begin], numOfBatchPoints, nullptr, codes);
+            for (size_t i = 0; i < numOfBatchPoints; ++i)
+            {
+                table->addChild(codes[i] >> 3, codes[i] & 7);
+            }
+        }
+    });
+    addPhaseTiming("hash insert", phaseStart);
+    table->extract(mortonLevels[leafLevel], 3 * leafLevel);
+    table.reset();
+    addPhaseTiming("extract", phaseStart);
+
+    for (int level = (int)leafLevel - 1; level >= 0; --level)
+    {
+        mortonLevels[level].reduceChildren(mortonLevels[level + 1].codes);
+    }
+    addPhaseTiming("reduce", phaseStart);
+
+    levelsValid = false;
+    mortonLevelsValid = true;
+
+    // every node below the root still add itself to its parent once, the same as moving up only when a node is created
+    bottomup = numOfPoints + getNumOfAllNodes() - mortonLevels[0].size();
+    topdown = numOfPoints * maxDepth;
+}
+
+void Octree::syncLevels()
+{
+    if (levelsValid)
+        return;
+
+    auto phaseStart = std::chrono::steady_clock::now();
+    tbb::parallel_for((size_t)0, mortonLevels.size(), [&](size_t level)
+    {
+        auto& mortonLevel = mortonLevels[level];
+        auto& currentLevel = levels[level];
+        currentLevel.clear();
+        for (size_t i = 0; i < mortonLevel.size(); ++i)
+        {
+            currentLevel.insert(std::make_pair(MortonCode::decode64(mortonLevel.codes[i]), Node(mortonLevel.children[i])));
+        }
+    });
+    levelsValid = true;
+    addPhaseTiming("sync levels", phaseStart);
+}
+
+void Octree::syncMortonLevels()
+{
+    if (mortonLevelsValid)
+        return;
+
+    auto phaseStart = std::chrono::steady_clock::now();
+    mortonLevels.resize(levels.size());
+    tbb::parallel_for((size_t)0, levels.size(), [&](size_t level)
+    {
+        auto& currentLevel = levels[level];
+        std::vector<unsigned long long> codes;
+        std::vector<unsigned int> order;
+        codes.reserve(currentLevel.size());
+        order.reserve(currentLevel.size());
+        std::vector<unsigned char> children;
+        children.reserve(currentLevel.size());
+        for (auto& itr : currentLevel)
+        {
+            order.push_back((unsigned int)codes.size());
+            codes.push_back(MortonCode::encode64(itr.first));
+            children.push_back(itr.second.children.load());
+        }
+
+        // the map is sorted by Index, re-sort the nodes in Morton order
+        RadixSort::sort(codes, order, 3 * (unsigned int)level);
+
+        auto& mortonLevel = mortonLevels[level];
+        mortonLevel.codes.swap(codes);
+        mortonLevel.children.resize(order.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            mortonLevel.children[i] = children[order[i]];
+        }
+    });
+    mortonLevelsValid = true;
+    addPhaseTiming("sync morton levels", phaseStart);
+}
+
+void Octree::addPhaseTiming(const std::string& name, std::chrono::steady_clock::time_point& start)
+{
+    auto end = std::chrono::steady_clock::now();
+    PhaseTiming timing(name, std::chrono::duration<double, std::milli>(end - start).count());
+    start = end;
+
+    tbb::mutex::scoped_lock lock(*phaseTimingsMutex);
+    auto itr = std::find_if(phaseTimings.begin(), phaseTimings.end(), [&](const PhaseTiming& phase) { return phase.name == name; });
+    if (itr != phaseTimings.end())
+        *itr = timing;
+    else
+        phaseTimings.push_back(timing);
+}
+
+OctreeStats Octree::stats() const
+{
+    // a std::map node hold 3 pointers and 2 flags besides the value, and the heap round each allocation to 16 bytes
+    const size_t mapNodeBytes = (3 * sizeof(void*) + 2 + sizeof(Level::value_type) + 15) / 16 * 16;
+
+    OctreeStats stats;
+    stats.maxDepth = getMaxDepth();
+    stats.numOfPoints = numOfPoints;
+    stats.bottomup = bottomup;
+    stats.topdown = topdown;
+    {
+        tbb::mutex::scoped_lock lock(*phaseTimingsMutex);
+        stats.phases = phaseTimings;
+    }
+    stats.levels.resize(getMaxDepth());
+
+    for (unsigned int level = 0; level < getMaxDepth(); ++level)
+    {
+        auto& levelStats = stats.levels[level];
+        if (levelsValid)
+        {
+            // the map always allocate a head node
+            levelStats.mapBytes = (levels[level].size() + 1) * mapNodeBytes;
+            if (!mortonLevelsValid)
+            {
+                for (auto& node : levels[level])
+                {
+                    ++levelStats.branching[childCount(node.second.children)];
+                }
+            }
+        }
+        if (mortonLevelsValid)
+        {
+            auto& mortonLevel = mortonLevels[level];
+            levelStats.flatBytes = mortonLevel.codes.capacity() * sizeof(unsigned long long) + mortonLevel.children.capacity() * sizeof(unsigned char);
+            for (auto children : mortonLevel.children)
+            {
+                ++levelStats.branching[childCount(children)];
+            }
+        }
+
+        for (unsigned int children = 0; children <= 8; ++children)
+        {
+            levelStats.numOfNodes += levelStats.branching[children];
+            levelStats.numOfChildren += levelStats.branching[children] * children;
+        }
+    }
+    stats.numOfLeaves = stats.levels.empty() ? 0 : stats.levels.back().numOfChildren;
+
+    return stats;
+}
+
+BoundingBox Octree::computeBoundingBox(PointCloud & pointCloud)
+{
+    // already reduced while loading the point cloud
+    if (pointCloud.hasBoundingBox)
+        return pointCloud.boundingBox;
+
+    return BoundingBox::compute(pointCloud.positions.data(), pointCloud.positions.size());
 }
 
 Eigen::Vector3f Octree::computeLeafCellSize(const unsigned int maxDepth, const BoundingBox& bbox)
@@ -172,18 +483,12 @@ Eigen::Vector3f Octree::computeLeafCellSize(const unsigned int maxDepth, const B
 
 Index Octree::computeLeafAddress(const Eigen::Vector3f& point)
 {
-    Vector3f localPos = point - bbox.min;
-
-    unsigned int x = (unsigned int)std::floor(localPos.x() / leafCellSize.x());
-    unsigned int y = (unsigned int)std::floor(localPos.y() / leafCellSize.y());
-    unsigned int z = (unsigned int)std::floor(localPos.z() / leafCellSize.z());
-
-    Vector3f maxCheck = point - bbox.max;
-    x = maxCheck.x() == 0 ? x - 1 : x;
-    y = maxCheck.y() == 0 ? y - 1 : y;
-    z = maxCheck.z() == 0 ? z - 1 : z;
+    return quantizer.computeLeafAddress(point);
+}
 
-    return Index(x,y,z);
+void Octree::computeLeafAddresses(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes)
+{
+    quantizer.computeLeafAddresses(points, numOfPoints, indices, codes);
 }
 
 Index Octree::computeParentAddress(const Index& index)
@@ -239,9 +544,16 @@ bool Octree::addLeaf(const unsigned int maxDepth, const Index& index, size_t& tr
 
 bool Octree::nodeExist(const unsigned int level, const Index& index)
 {
-    if ((size_t)level > levels.size())
+    if ((size_t)level >= levels.size())
         return false;
 
+    // built by SORT_REDUCE_BUILD, search the flat level instead
+    if (!levelsValid)
+    {
+        auto& codes = mortonLevels[level].codes;
+        return std::binary_search(codes.begin(), codes.end(), MortonCode::encode64(index));
+    }
+
     // lock before checking the current level
     tbb::mutex::scoped_lock lock(levelMutexs[level]);
     auto& currentLevel = levels[level];
@@ -250,18 +562,97 @@ bool Octree::nodeExist(const unsigned int level, const Index& index)
     return itr != currentLevel.end();
 }
 
+bool Octree::getNodeChildren(const unsigned int level, const Index& index, unsigned char& children)
+{
+    if ((size_t)level >= levels.size())
+        return false;
+
+    if (!levelsValid)
+    {
+        auto& mortonLevel = mortonLevels[level];
+        auto itr = std::lower_bound(mortonLevel.codes.begin(), mortonLevel.codes.end(), MortonCode::encode64(index));
+        if (itr == mortonLevel.codes.end() || *itr != MortonCode::encode64(index))
+            return false;
+        children = mortonLevel.children[itr - mortonLevel.codes.begin()];
+        return true;
+    }
+
+    tbb::mutex::scoped_lock lock(levelMutexs[level]);
+    auto& currentLevel = levels[level];
+    auto itr = currentLevel.find(index);
+    if (itr == currentLevel.end())
+        return false;
+    children = itr->second.children;
+    return true;
+}
+
+bool Octree::findNodeChildren(const unsigned int level, unsigned long long code, unsigned char& children) const
+{
+    if (!levelsValid)
+    {
+        auto& mortonLevel = mortonLevels[level];
+        auto itr = std::lower_bound(mortonLevel.codes.begin(), mortonLevel.codes.end(), code);
+        if (itr == mortonLevel.codes.end() || *itr != code)
+            return false;
+        children = mortonLevel.children[itr - mortonLevel.codes.begin()];
+        return true;
+    }
+
+    // concurrent finds on a std::map are safe as long as nobody insert
+    auto& currentLevel = levels[level];
+    auto itr = currentLevel.find(MortonCode::decode64(code));
+    if (itr == currentLevel.end())
+        return false;
+    children = itr->second.children;
+    return true;
+}
+
+void Octree::nodesExist(const unsigned int level, const unsigned long long* codes, size_t numOfCodes, bool truncatedLeaves, unsigned char* exist)
+{
+    if ((size_t)level >= levels.size())
+    {
+        std::fill(exist, exist + numOfCodes, (unsigned char)0);
+        return;
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOfCodes), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            unsigned char children;
+            exist[i] = findNodeChildren(level, codes[i], children);
+            if (exist[i] || !truncatedLeaves)
+                continue;
+
+            // same as isInsideTruncatedLeaf, the first existing node above tell
+            unsigned long long code = codes[i];
+            for (int parentLevel = (int)level - 1; parentLevel >= 0; --parentLevel)
+            {
+                code >>= 3;
+                if (findNodeChildren(parentLevel, code, children))
+                {
+                    exist[i] = children == 0;
+                    break;
+                }
+            }
+        }
+    });
+}
+
 bool Octree::addNodeRecursive(const unsigned int level, const Index& index, const unsigned int childIndex, size_t& transversalCounter)
 {
     if ((size_t)level >= levels.size())
         return false;
 
+    syncLevels();
+    mortonLevelsValid = false;
+
     auto localLevel = level;
     auto localIndex = index;
     unsigned int localChild = childIndex;
 
     while (!nodeExist(localLevel, localIndex) && localLevel > 0)
     {
-        tbb::mutex::scoped_lock lock(levelMutexs[localLevel]);
         // Add and update the the child status
         addNodeChild(localLevel, localIndex, localChild);
 
@@ -280,6 +671,262 @@ bool Octree::addNodeRecursive(const unsigned int level, const Index& index, cons
     return true;
 }
 
+size_t Octree::insertPoints(const std::vector<Eigen::Vector3f>& points)
+{
+    syncLevels();
+    mortonLevelsValid = false;
+
+    size_t numOfInserted = 0;
+    for (auto& point : points)
+    {
+        if (!bbox.isInside(point))
+            continue;
+        auto leafAddress = computeLeafAddress(point);
+        size_t transversalCounter = 0;
+        addLeaf(getMaxDepth(), leafAddress, transversalCounter);
+        dirtyNodes.insert(computeParentAddress(leafAddress));
+        ++numOfInserted;
+    }
+    return numOfInserted;
+}
+
+size_t Octree::removePoints(const std::vector<Eigen::Vector3f>& points)
+{
+    syncLevels();
+    mortonLevelsValid = false;
+
+    size_t numOfRemoved = 0;
+    for (auto& point : points)
+    {
+        if (!bbox.isInside(point))
+            continue;
+        auto leafAddress = computeLeafAddress(point);
+        if (removeLeaf(leafAddress))
+        {
+            dirtyNodes.insert(computeParentAddress(leafAddress));
+            ++numOfRemoved;
+        }
+    }
+    return numOfRemoved;
+}
+
+bool Octree::removeLeaf(const Index& index)
+{
+    int level = (int)getMaxDepth() - 1;
+    Index parent = computeParentAddress(index);
+    unsigned char child = computeOctreeChildIndex(index);
+
+    auto itr = levels[level].find(parent);
+    if (itr == levels[level].end() || !(itr->second.children & (1 << child)))
+        return false;
+
+    // clear the child bit, and remove the nodes left without any child on the way up
+    while (level >= 0)
+    {
+        auto& currentLevel = levels[level];
+        auto nodeItr = currentLevel.find(parent);
+        nodeItr->second.removeChild(child);
+        if (nodeItr->second.children != 0)
+            break;
+
+        currentLevel.erase(nodeItr);
+        child = computeOctreeChildIndex(parent);
+        parent = computeParentAddress(parent);
+        --level;
+    }
+    return true;
+}
+
+std::set<Index> Octree::getDirtyNodes(const unsigned int level) const
+{
+    std::set<Index> nodes;
+    unsigned int leafParentLevel = (unsigned int)levels.size() - 1;
+    for (auto& dirtyNode : dirtyNodes)
+    {
+        Index index = dirtyNode;
+        for (unsigned int i = leafParentLevel; i > level; --i)
+        {
+            index = Index(index.x() / 2, index.y() / 2, index.z() / 2);
+        }
+        nodes.insert(index);
+    }
+    return nodes;
+}
+
+void Octree::clearDirtyNodes()
+{
+    dirtyNodes.clear();
+}
+
+void Octree::assignMortonLevels(std::vector<MortonLevel>& mortonLevels_, unsigned int firstLevel)
+{
+    mortonLevels.resize(getMaxDepth());
+    for (unsigned int level = firstLevel; level < getMaxDepth(); ++level)
+    {
+        mortonLevels[level].codes.swap(mortonLevels_[level].codes);
+        mortonLevels[level].children.swap(mortonLevels_[level].children);
+    }
+    // the levels above are the unique parents of the level below
+    for (int level = (int)firstLevel - 1; level >= 0; --level)
+    {
+        reduceLevel(mortonLevels[level + 1].codes, mortonLevels[level]);
+    }
+
+    levelsValid = false;
+    mortonLevelsValid = true;
+}
+
+// Box of the leaves below a node, in half leaf units so the center of any node fall on an integer
+struct LeafBox
+{
+    LeafBox() : min(UINT_MAX, UINT_MAX, UINT_MAX), max(0, 0, 0) {}
+    void expand(const Vector3ui& point) { min = min.cwiseMin(point); max = max.cwiseMax(point); }
+    void expand(const LeafBox& box) { min = min.cwiseMin(box.min); max = max.cwiseMax(box.max); }
+
+    Vector3ui min, max;
+};
+
+size_t Octree::truncate(const DepthBudget& budget)
+{
+    auto phaseStart = std::chrono::steady_clock::now();
+    auto& flatLevels = getMortonLevels();
+    const unsigned int maxDepth = getMaxDepth();
+    const unsigned int minLevel = budget.getMinLevel();
+    if (minLevel >= maxDepth)
+        return 0;
+
+    std::vector<std::vector<size_t>> childOffsets(maxDepth);
+    for (unsigned int level = minLevel; level + 1 < maxDepth; ++level)
+    {
+        flatLevels[level].computeChildOffsets(childOffsets[level]);
+    }
+    auto childOffset = [&](unsigned int level, size_t i) { return i < flatLevels[level].size() ? childOffsets[level][i] : flatLevels[level + 1].size(); };
+
+    // Bottom-up, the box of the leaves below each node, and if the node center is within the budget of all of them.
+    // A node already truncated only hold its center.
+    std::vector<std::vector<unsigned char>> withinBudget(maxDepth);
+    std::vector<LeafBox> boxes, childBoxes;
+    for (int level = (int)maxDepth - 1; level >= (int)minLevel; --level)
+    {
+        auto& mortonLevel = flatLevels[level];
+        const unsigned int cellSize = 1u << (maxDepth - level); // in leaves
+        boxes.resize(mortonLevel.size());
+        withinBudget[level].resize(mortonLevel.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, mortonLevel.size()), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+            {
+                Vector3ui cellMin = MortonCode::decode64(mortonLevel.codes[i]) * cellSize;
+                Vector3ui center = cellMin * 2 + Vector3ui::Constant(cellSize - 1);
+                unsigned char children = mortonLevel.children[i];
+
+                LeafBox box;
+                if (children == 0)
+                    box.expand(center);
+                else if (level == (int)maxDepth - 1)
+                {
+                    for (unsigned char c = 0; c < childIdTable.count[children]; ++c)
+                    {
+                        box.expand(Vector3ui((cellMin + getChildOffset(childIdTable.ids[children][c])) * 2));
+                    }
+                }
+                else
+                {
+                    for (size_t child = childOffset(level, i); child < childOffset(level, i + 1); ++child)
+                    {
+                        box.expand(childBoxes[child]);
+                    }
+                }
+                boxes[i] = box;
+
+                // farthest leaf from the center on each axis
+                Eigen::Vector3f distance;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    distance[axis] = (float)std::max(std::abs((long long)box.min[axis] - (long long)center[axis]), std::abs((long long)box.max[axis] - (long long)center[axis]));
+                }
+                float error = distance.cwiseProduct(leafCellSize).norm() / 2;
+                Eigen::Vector3f position = bbox.min + center.cast<float>().cwiseProduct(leafCellSize) / 2;
+                withinBudget[level][i] = error <= budget.getMaxError(position);
+            }
+        });
+        boxes.swap(childBoxes);
+    }
+
+    // Top-down, the first node within budget on each path become a truncated leaf and the nodes below it are dropped
+    std::vector<MortonLevel> truncatedLevels(maxDepth);
+    std::vector<unsigned char> kept(flatLevels[minLevel].size(), 1), childKept;
+    size_t numOfTruncated = 0;
+    for (unsigned int level = minLevel; level < maxDepth; ++level)
+    {
+        auto& mortonLevel = flatLevels[level];
+        auto& truncatedLevel = truncatedLevels[level];
+        if (level + 1 < maxDepth)
+            childKept.assign(flatLevels[level + 1].size(), 0);
+
+        for (size_t i = 0; i < mortonLevel.size(); ++i)
+        {
+            if (!kept[i])
+                continue;
+            unsigned char children = mortonLevel.children[i];
+            bool truncated = children != 0 && withinBudget[level][i];
+            numOfTruncated += truncated ? 1 : 0;
+
+            truncatedLevel.codes.push_back(mortonLevel.codes[i]);
+            truncatedLevel.children.push_back(truncated ? 0 : children);
+            if (!truncated && level + 1 < maxDepth)
+                std::fill(childKept.begin() + childOffset(level, i), childKept.begin() + childOffset(level, i + 1), 1);
+        }
+        kept.swap(childKept);
+    }
+
+    if (numOfTruncated)
+    {
+        for (unsigned int level = 0; level < minLevel; ++level)
+        {
+            truncatedLevels[level].codes.swap(flatLevels[level].codes);
+            truncatedLevels[level].children.swap(flatLevels[level].children);
+        }
+        assignMortonLevels(truncatedLevels, 0);
+    }
+    addPhaseTiming("truncate", phaseStart);
+    return numOfTruncated;
+}
+
+unsigned int Octree::getFirstTruncatedLevel()
+{
+    auto& flatLevels = getMortonLevels();
+    for (unsigned int level = 0; level < getMaxDepth(); ++level)
+    {
+        auto& children = flatLevels[level].children;
+        if (std::find(children.begin(), children.end(), (unsigned char)0) != children.end())
+            return level;
+    }
+    return getMaxDepth();
+}
+
+bool Octree::isInsideTruncatedLeaf(const unsigned int level, const Index& index)
+{
+    // the first existing node above is either a truncated leaf or a regular node
+    Index parent = index;
+    for (int parentLevel = (int)level - 1; parentLevel >= 0; --parentLevel)
+    {
+        parent = computeParentAddress(parent);
+        unsigned char children;
+        if (getNodeChildren(parentLevel, parent, children))
+            return children == 0;
+    }
+    return false;
+}
+
+Eigen::Vector3f Octree::computeNodePosition(const unsigned int level, const Index& index) const
+{
+    // a single leaf cell give its min corner, the same position as the leaves
+    const float cellSize = (float)(1u << (getMaxDepth() - level));
+    Eigen::Vector3f center = index.cast<float>() * cellSize + Eigen::Vector3f::Constant((cellSize - 1) / 2);
+    return bbox.min + center.cwiseProduct(leafCellSize);
+}
+
 Vector3ui CPC::Octree::getChildOffset(unsigned char childId)
 {
     // apply the child offset to 2 x Parent index
@@ -317,6 +964,8 @@ Vector3ui CPC::Octree::getChildOffset(unsigned char childId)
 
 void Octree::addNodeChild(const unsigned int level, const Index& parentIndex, const unsigned int childIndex)
 {
+    // the map insert need to be guarded, other thread may be inserting into the same level
+    tbb::mutex::scoped_lock lock(levelMutexs[level]);
     auto& currentLevel = levels[level];
     currentLevel[parentIndex].addChild(childIndex);
 }
@@ -333,3 +982,79 @@ void CPC::Node::removeChild(unsigned char index)
     unsigned char childBit = ~(1 << index);
     children.fetch_and(childBit);
 }
+
+void MortonLevel::resize(size_t size)
+{
+    codes.resize(size);
+    children.resize(size);
+}
+
+void MortonLevel::clear()
+{
+    codes.clear();
+    children.clear();
+}
+
+void MortonLevel::computeChildOffsets(std::vector<size_t>& offsets) const
+{
+    offsets.resize(size());
+    const size_t numOfBlocks = (size() + REDUCE_BLOCK_SIZE - 1) / REDUCE_BLOCK_SIZE;
+
+    // Count the children of each block, scan the block counts, then scan inside each block from its offset.
+    // The block counts are kept in the first offset of each block, so a reused offsets vector isn't reallocated.
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t end = std::min(size(), (block + 1) * REDUCE_BLOCK_SIZE);
+        size_t count = 0;
+        for (size_t i = block * REDUCE_BLOCK_SIZE; i < end; ++i)
+        {
+            count += childCount(children[i]);
+        }
+        offsets[block * REDUCE_BLOCK_SIZE] = count;
+    });
+    size_t blockOffset = 0;
+    for (size_t block = 0; block < numOfBlocks; ++block)
+    {
+        size_t count = offsets[block * REDUCE_BLOCK_SIZE];
+        offsets[block * REDUCE_BLOCK_SIZE] = blockOffset;
+        blockOffset += count;
+    }
+
+    tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+    {
+        size_t end = std::min(size(), (block + 1) * REDUCE_BLOCK_SIZE);
+        size_t offset = offsets[block * REDUCE_BLOCK_SIZE];
+        for (size_t i = block * REDUCE_BLOCK_SIZE; i < end; ++i)
+        {
+            offsets[i] = offset;
+            offset += childCount(children[i]);
+        }
+    });
+}
+
+void MortonLevel::expandChildren(MortonLevel& childLevel) const
+{
+    std::vector<size_t> offsets;
+    computeChildOffsets(offsets);
+    size_t numOfChildren = size() ? offsets.back() + childCount(children.back()) : 0;
+
+    // each node write its children codes into its own slice, they come out sorted since the child id are the low bits
+    childLevel.resize(numOfChildren);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            unsigned char nodeChildren = children[i];
+            unsigned long long* output = &childLevel.codes[offsets[i]];
+            for (unsigned char c = 0; c < childIdTable.count[nodeChildren]; ++c)
+            {
+                output[c] = (codes[i] << 3) | childIdTable.ids[nodeChildren][c];
+            }
+        }
+    });
+}
+
+void MortonLevel::reduceChildren(const std::vector<unsigned long long>& childCodes)
+{
+    reduceLevel(childCodes, *this);
+}
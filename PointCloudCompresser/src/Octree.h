@@ -3,11 +3,17 @@
 #include <tbb/mutex.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <atomic>
+#include <chrono>
+#include <memory>
 
 #include "PointCloud.h"
 #include "BoundingBox.h"
 #include "Index.h"
+#include "LeafQuantizer.h"
+#include "OctreeStats.h"
+#include "DepthBudget.h"
 
 namespace CPC
 {
@@ -24,16 +30,53 @@ namespace CPC
 
     typedef std::map<Index, Node> Level;
 
+    const unsigned int MAX_ENCODED_DEPTH = 21; // the nodes are 64 bits Morton codes, 3 bits per level
+
+    // number of children set in a node children bits
+    inline unsigned char childCount(unsigned char children)
+    {
+        children = children - ((children >> 1) & 0x55);
+        children = (children & 0x33) + ((children >> 2) & 0x33);
+        return (children + (children >> 4)) & 0x0F;
+    }
+
+    // Flat version of a level, the Morton code of each node sorted in ascending order with its children bits.
+    // The children of the nodes are stored contiguously in the next level, in the same order as their parent.
+    struct MortonLevel
+    {
+        size_t size() const { return codes.size(); }
+        void resize(size_t size);
+        void clear();
+        // position of each node first child in the next level, the exclusive scan of the children count
+        void computeChildOffsets(std::vector<size_t>& offsets) const;
+        // fill the codes of the next level from the children bits, its children bits are left to the caller
+        void expandChildren(MortonLevel& childLevel) const;
+        // fill the level with the unique parents of the sorted codes of the next level, and their children bits
+        void reduceChildren(const std::vector<unsigned long long>& childCodes);
+
+        std::vector<unsigned long long> codes;
+        std::vector<unsigned char> children;
+    };
+
+    enum OctreeBuildMode
+    {
+        MAP_BUILD = 0,      // insert each point into the std::map of every level
+        SORT_REDUCE_BUILD,  // radix sort the leaf Morton codes and reduce them level by level into MortonLevel
+        HASH_BUILD          // insert the points into a lock-free hash table of the leaf parents, then reduce the levels above like the sort build
+    };
+
     class Octree
     {
         public:
+            // both throw if maxDepth is over MAX_ENCODED_DEPTH
             Octree(unsigned int maxDepth, BoundingBox& bbox);
-            Octree(unsigned int maxDepth, PointCloud& pointCloud);
-            PointCloud generatePointCloud(); // convert the octree back to point cloud 
+            Octree(unsigned int maxDepth, PointCloud& pointCloud, OctreeBuildMode buildMode = MAP_BUILD);
+            PointCloud generatePointCloud(); // convert the octree back to point cloud, the truncated leaves come after the full depth ones
             
             BoundingBox getBoundingBox() const;
             Eigen::Vector3f getLeafCellSize() const;
             std::vector<Level>& getLevels();
+            std::vector<MortonLevel>& getMortonLevels();
             unsigned int getMaxDepth() const;
             size_t getNumOfAllNodes() const;
             Node& addNode(const unsigned int level, const Index& index, const unsigned char child);
@@ -41,15 +84,45 @@ namespace CPC
             static Vector3ui getChildOffset(unsigned char childId);
 
             Index computeLeafAddress(const Eigen::Vector3f& point);
+            // batch version of computeLeafAddress, also compute the leaf Morton codes. indices or codes can be null.
+            void computeLeafAddresses(const Eigen::Vector3f* points, size_t numOfPoints, Index* indices, unsigned long long* codes);
             Index computeParentAddress(const unsigned int currentLevel, const unsigned int parentLevel, const Index& index);
             Index computeParentAddress(const Index& index);
             bool nodeExist(const unsigned int level, const Index& index);
+            // nodeExist of many nodes of the level at once, in parallel and without the level locks, so the octree must not be
+            // modified meanwhile. With truncatedLeaves a node covered by a truncated leaf above it exist too. exist[i] is for codes[i].
+            void nodesExist(const unsigned int level, const unsigned long long* codes, size_t numOfCodes, bool truncatedLeaves, unsigned char* exist);
 
-            size_t bottomup;
-            size_t topdown;
+            // Incremental update, only the points inside the bounding box are applied, return how many were.
+            // Removing a point clear its whole leaf cell, the octree only know which cells are occupied.
+            size_t insertPoints(const std::vector<Eigen::Vector3f>& points);
+            size_t removePoints(const std::vector<Eigen::Vector3f>& points);
+            // nodes of the level containing a change since the last clearDirtyNodes
+            std::set<Index> getDirtyNodes(const unsigned int level) const;
+            void clearDirtyNodes();
+
+            // Take the flat levels from firstLevel down to maxDepth, the levels above are rebuilt from them
+            void assignMortonLevels(std::vector<MortonLevel>& mortonLevels, unsigned int firstLevel);
+
+            // Adaptive depth, stop subdividing the nodes whose leaves are all within the budget of the point replacing them.
+            // A truncated node stay as a leaf above maxDepth, without any children bits. Return the number of truncated nodes.
+            size_t truncate(const DepthBudget& budget);
+            // first level holding a truncated leaf, maxDepth if there is none
+            unsigned int getFirstTruncatedLevel();
+            // check if the node of the level is covered by a truncated leaf above it
+            bool isInsideTruncatedLeaf(const unsigned int level, const Index& index);
+            // the point replacing a truncated node, the center of its leaf cells
+            Eigen::Vector3f computeNodePosition(const unsigned int level, const Index& index) const;
+
+            // memory, shape and build timings of the octree
+            OctreeStats stats() const;
 
         protected:
             void generate(unsigned int maxDepth, PointCloud& pointCloud);
+            void generateSortReduce(unsigned int maxDepth, PointCloud& pointCloud);
+            void generateHash(unsigned int maxDepth, PointCloud& pointCloud);
+            void syncLevels();
+            void syncMortonLevels();
             BoundingBox computeBoundingBox(PointCloud& pointCloud);
             Eigen::Vector3f computeLeafCellSize(const unsigned int maxDepth, const BoundingBox& bbox);
             
@@ -59,12 +132,32 @@ namespace CPC
             
             
             void addNodeChild(const unsigned int level, const Index& parentIndex, const unsigned int childIndex);
+            bool removeLeaf(const Index& index);
+            // children bits of the node, false if it doesn't exist
+            bool getNodeChildren(const unsigned int level, const Index& index, unsigned char& children);
+            // same without locking, for the parallel read only queries
+            bool findNodeChildren(const unsigned int level, unsigned long long code, unsigned char& children) const;
+            // Record the time since start under name, and restart it for the next phase. A phase run again, like the syncs
+            // after each update, replace its previous timing so they don't pile up. Safe to call from concurrent readers.
+            void addPhaseTiming(const std::string& name, std::chrono::steady_clock::time_point& start);
 
             // a vector to store each level
             // each level is a map of node
             std::vector<Level> levels;
             std::vector<tbb::mutex> levelMutexs;
+            // flat copy of the levels, either built directly by SORT_REDUCE_BUILD or converted from the maps when first needed
+            std::vector<MortonLevel> mortonLevels;
+            bool levelsValid;
+            bool mortonLevelsValid;
             BoundingBox bbox;
             Eigen::Vector3f leafCellSize;
+            LeafQuantizer quantizer;
+            std::set<Index> dirtyNodes; // parents of the leaves changed by insertPoints/removePoints
+
+            size_t bottomup;
+            size_t topdown;
+            size_t numOfPoints;
+            std::vector<PhaseTiming> phaseTimings;
+            std::unique_ptr<tbb::mutex> phaseTimingsMutex; // behind a pointer so the octree stay movable
     };
 }
\ No newline at end of file
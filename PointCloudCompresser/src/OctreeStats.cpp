@@ -0,0 +1,78 @@
+#include "OctreeStats.h"
+#include <sstream>
+#include <fstream>
+#include <iostream>
+
+using namespace CPC;
+
+size_t OctreeStats::numOfNodes() const
+{
+    size_t numOfNodes = 0;
+    for (auto& level : levels)
+    {
+        numOfNodes += level.numOfNodes;
+    }
+    return numOfNodes;
+}
+
+size_t OctreeStats::totalBytes() const
+{
+    size_t bytes = 0;
+    for (auto& level : levels)
+    {
+        bytes += level.mapBytes + level.flatBytes;
+    }
+    return bytes;
+}
+
+std::string OctreeStats::toJson() const
+{
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"maxDepth\": " << maxDepth << ",\n";
+    json << "  \"numOfPoints\": " << numOfPoints << ",\n";
+    json << "  \"numOfNodes\": " << numOfNodes() << ",\n";
+    json << "  \"numOfLeaves\": " << numOfLeaves << ",\n";
+    json << "  \"totalBytes\": " << totalBytes() << ",\n";
+    json << "  \"bottomup\": " << bottomup << ",\n";
+    json << "  \"topdown\": " << topdown << ",\n";
+
+    json << "  \"levels\": [";
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        auto& level = levels[i];
+        json << (i ? "," : "") << "\n    { \"level\": " << i
+             << ", \"numOfNodes\": " << level.numOfNodes
+             << ", \"mapBytes\": " << level.mapBytes
+             << ", \"flatBytes\": " << level.flatBytes
+             << ", \"fillFactor\": " << level.fillFactor()
+             << ", \"branching\": [";
+        for (int children = 0; children <= 8; ++children)
+        {
+            json << (children ? ", " : "") << level.branching[children];
+        }
+        json << "] }";
+    }
+    json << "\n  ],\n";
+
+    json << "  \"phases\": [";
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+        json << (i ? "," : "") << "\n    { \"name\": \"" << phases[i].name << "\", \"milliseconds\": " << phases[i].milliseconds << " }";
+    }
+    json << "\n  ]\n";
+    json << "}\n";
+    return json.str();
+}
+
+bool OctreeStats::saveJson(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    file << toJson();
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <string>
+
+namespace CPC
+{
+    struct LevelStats
+    {
+        LevelStats() : numOfNodes(0), numOfChildren(0), mapBytes(0), flatBytes(0), branching() {}
+        float fillFactor() const { return numOfNodes ? (float)numOfChildren / numOfNodes : 0.f; } // average children per node
+
+        size_t numOfNodes;
+        size_t numOfChildren;
+        size_t mapBytes;  // estimated heap use of the std::map level, 0 if it isn't built
+        size_t flatBytes; // heap use of the MortonLevel, 0 if it isn't built
+        size_t branching[9]; // number of nodes with 0 to 8 children
+    };
+
+    struct PhaseTiming
+    {
+        PhaseTiming(const std::string& name_, double milliseconds_) : name(name_), milliseconds(milliseconds_) {}
+
+        std::string name;
+        double milliseconds;
+    };
+
+    // Memory and shape of an octree, returned by Octree::stats
+    struct OctreeStats
+    {
+        OctreeStats() : maxDepth(0), numOfPoints(0), numOfLeaves(0), bottomup(0), topdown(0) {}
+        size_t numOfNodes() const;
+        size_t totalBytes() const;
+
+        std::string toJson() const;
+        bool saveJson(const std::string& path) const;
+
+        unsigned int maxDepth;
+        size_t numOfPoints;
+        size_t numOfLeaves;
+        size_t bottomup; // number of nodes visited when building bottom-up
+        size_t topdown;  // number of nodes a top-down build would visit
+        std::vector<LevelStats> levels;
+        std::vector<PhaseTiming> phases; // build phases in the order they first ran, with the last timing of each
+    };
+}
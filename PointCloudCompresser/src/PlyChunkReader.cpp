@@ -0,0 +1,276 @@
+#include "PlyChunkReader.h"
+#include <sstream>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+using namespace CPC;
+
+PlyChunkReader::PlyChunkReader() : isBinary(false), isBigEndian(false), vertexStride(0), numOfPoints(0), numOfPointsRead(0), xIndex(-1), yIndex(-1), zIndex(-1)
+{
+}
+
+PlyChunkReader::~PlyChunkReader()
+{
+    close();
+}
+
+bool PlyChunkReader::open(const std::string& path)
+{
+    close();
+    stream.open(path, std::ios::binary);
+    if (!stream.is_open())
+    {
+        std::cerr << "failed to open " << path << std::endl;
+        return false;
+    }
+    return parseHeader();
+}
+
+void PlyChunkReader::close()
+{
+    if (stream.is_open())
+        stream.close();
+    vertexProperties.clear();
+    numOfPoints = numOfPointsRead = 0;
+}
+
+bool PlyChunkReader::rewind()
+{
+    stream.clear();
+    stream.seekg(vertexStart);
+    numOfPointsRead = 0;
+    return stream.good();
+}
+
+size_t PlyChunkReader::getNumOfPoints() const
+{
+    return numOfPoints;
+}
+
+size_t PlyChunkReader::getTypeSize(const std::string& type)
+{
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+    if (type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" || type == "float32") return 4;
+    if (type == "double" || type == "float64") return 8;
+    return 0;
+}
+
+bool PlyChunkReader::parseHeader()
+{
+    std::string line;
+    std::getline(stream, line);
+    if (line.compare(0, 3, "ply") != 0)
+    {
+        std::cerr << "not a ply file" << std::endl;
+        return false;
+    }
+
+    // elements before the vertex element need to be skipped, only fixed size ones are supported
+    size_t bytesBeforeVertex = 0;
+    size_t linesBeforeVertex = 0;
+    std::string currentElement;
+    size_t currentCount = 0;
+    size_t currentStride = 0;
+    bool vertexFound = false;
+    bool vertexDone = false;
+    while (std::getline(stream, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        std::istringstream ls(line);
+        std::string keyword;
+        ls >> keyword;
+        if (keyword == "format")
+        {
+            std::string format;
+            ls >> format;
+            isBinary = format != "ascii";
+            isBigEndian = format == "binary_big_endian";
+        }
+        else if (keyword == "element")
+        {
+            // close the previous element
+            if (!vertexFound && !currentElement.empty())
+            {
+                bytesBeforeVertex += currentCount * currentStride;
+                linesBeforeVertex += currentCount;
+            }
+            if (vertexFound)
+                vertexDone = true;
+            ls >> currentElement >> currentCount;
+            currentStride = 0;
+            if (currentElement == "vertex" && !vertexDone)
+            {
+                vertexFound = true;
+                numOfPoints = currentCount;
+            }
+        }
+        else if (keyword == "property")
+        {
+            Property property;
+            std::string type;
+            ls >> type;
+            property.isList = type == "list";
+            if (property.isList)
+            {
+                std::string countType;
+                ls >> countType >> property.type;
+            }
+            else
+            {
+                property.type = type;
+            }
+            ls >> property.name;
+            property.size = getTypeSize(property.type);
+
+            if (vertexFound && !vertexDone)
+            {
+                if (property.isList)
+                {
+                    std::cerr << "list property in the vertex element is not supported" << std::endl;
+                    return false;
+                }
+                vertexProperties.push_back(property);
+            }
+            else if (!vertexFound && property.isList)
+            {
+                std::cerr << "list property before the vertex element is not supported" << std::endl;
+                return false;
+            }
+            currentStride += property.size;
+        }
+        else if (keyword == "end_header")
+        {
+            break;
+        }
+    }
+
+    if (!vertexFound)
+    {
+        std::cerr << "no vertex element found" << std::endl;
+        return false;
+    }
+
+    vertexStride = 0;
+    for (size_t i = 0; i < vertexProperties.size(); ++i)
+    {
+        if (vertexProperties[i].name == "x") xIndex = (int)i;
+        if (vertexProperties[i].name == "y") yIndex = (int)i;
+        if (vertexProperties[i].name == "z") zIndex = (int)i;
+        vertexStride += vertexProperties[i].size;
+    }
+    if (xIndex < 0 || yIndex < 0 || zIndex < 0)
+    {
+        std::cerr << "vertex element need x, y and z properties" << std::endl;
+        return false;
+    }
+
+    // skip the elements stored before the vertices
+    if (isBinary)
+    {
+        stream.seekg(bytesBeforeVertex, std::ios::cur);
+    }
+    else
+    {
+        for (size_t i = 0; i < linesBeforeVertex; ++i)
+        {
+            std::getline(stream, line);
+        }
+    }
+    vertexStart = stream.tellg();
+    numOfPointsRead = 0;
+    return stream.good();
+}
+
+float PlyChunkReader::readBinaryValue(const unsigned char* data, const Property& property) const
+{
+    unsigned char bytes[8];
+    std::memcpy(bytes, data, property.size);
+    if (isBigEndian)
+        std::reverse(bytes, bytes + property.size);
+
+    const std::string& type = property.type;
+    if (type == "float" || type == "float32") { float v; std::memcpy(&v, bytes, 4); return v; }
+    if (type == "double" || type == "float64") { double v; std::memcpy(&v, bytes, 8); return (float)v; }
+    if (type == "int" || type == "int32") { int v; std::memcpy(&v, bytes, 4); return (float)v; }
+    if (type == "uint" || type == "uint32") { unsigned int v; std::memcpy(&v, bytes, 4); return (float)v; }
+    if (type == "short" || type == "int16") { short v; std::memcpy(&v, bytes, 2); return (float)v; }
+    if (type == "ushort" || type == "uint16") { unsigned short v; std::memcpy(&v, bytes, 2); return (float)v; }
+    if (type == "char" || type == "int8") { return (float)(signed char)bytes[0]; }
+    return (float)bytes[0];
+}
+
+size_t PlyChunkReader::read(std::vector<Vector3f>& positions, size_t maxNumOfPoints)
+{
+    size_t numToRead = std::min(maxNumOfPoints, numOfPoints - numOfPointsRead);
+    positions.resize(numToRead);
+    if (numToRead == 0)
+        return 0;
+
+    if (isBinary)
+    {
+        buffer.resize(numToRead * vertexStride);
+        stream.read((char*)buffer.data(), buffer.size());
+        if ((size_t)stream.gcount() != buffer.size())
+        {
+            std::cerr << "unexpected end of ply file" << std::endl;
+            positions.clear();
+            return 0;
+        }
+
+        // offset of each coordinate inside a vertex
+        size_t offsets[3] = { 0, 0, 0 };
+        int indices[3] = { xIndex, yIndex, zIndex };
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int i = 0; i < indices[axis]; ++i)
+            {
+                offsets[axis] += vertexProperties[i].size;
+            }
+        }
+
+        bool packedFloats = !isBigEndian && vertexProperties[xIndex].type.compare(0, 5, "float") == 0 && vertexProperties[xIndex].size == 4 &&
+                            offsets[1] == offsets[0] + 4 && offsets[2] == offsets[0] + 8 &&
+                            vertexProperties[yIndex].size == 4 && vertexProperties[zIndex].size == 4;
+        for (size_t i = 0; i < numToRead; ++i)
+        {
+            const unsigned char* vertex = &buffer[i * vertexStride];
+            if (packedFloats)
+            {
+                std::memcpy(positions[i].data(), vertex + offsets[0], sizeof(Vector3f));
+            }
+            else
+            {
+                positions[i] = Vector3f(readBinaryValue(vertex + offsets[0], vertexProperties[xIndex]),
+                                        readBinaryValue(vertex + offsets[1], vertexProperties[yIndex]),
+                                        readBinaryValue(vertex + offsets[2], vertexProperties[zIndex]));
+            }
+        }
+    }
+    else
+    {
+        std::string line;
+        std::vector<float> values(vertexProperties.size());
+        for (size_t i = 0; i < numToRead; ++i)
+        {
+            if (!std::getline(stream, line))
+            {
+                std::cerr << "unexpected end of ply file" << std::endl;
+                positions.resize(i);
+                numOfPointsRead += i;
+                return i;
+            }
+            std::istringstream ls(line);
+            for (auto& value : values)
+            {
+                ls >> value;
+            }
+            positions[i] = Vector3f(values[xIndex], values[yIndex], values[zIndex]);
+        }
+    }
+
+    numOfPointsRead += numToRead;
+    return numToRead;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include "PointCloud.h"
+
+namespace CPC
+{
+    // Read the vertex positions of a ply file a chunk at a time, so the whole point cloud never need to fit in memory.
+    // Only the x, y, z properties are read, every other vertex property is skipped.
+    class PlyChunkReader
+    {
+        public:
+            PlyChunkReader();
+            ~PlyChunkReader();
+
+            bool open(const std::string& path);
+            void close();
+            // go back to the first vertex
+            bool rewind();
+            // read up to maxNumOfPoints positions into positions, return the number read, 0 once every vertex is read
+            size_t read(std::vector<Vector3f>& positions, size_t maxNumOfPoints);
+
+            size_t getNumOfPoints() const;
+
+        protected:
+            struct Property
+            {
+                std::string name;
+                std::string type;
+                size_t size;
+                bool isList;
+            };
+
+            bool parseHeader();
+            static size_t getTypeSize(const std::string& type);
+            float readBinaryValue(const unsigned char* data, const Property& property) const;
+
+            std::ifstream stream;
+            bool isBinary;
+            bool isBigEndian;
+            std::vector<Property> vertexProperties;
+            size_t vertexStride; // size of one binary vertex
+            size_t numOfPoints;
+            size_t numOfPointsRead;
+            std::streampos vertexStart;
+            int xIndex, yIndex, zIndex;
+            std::vector<unsigned char> buffer;
+    };
+}
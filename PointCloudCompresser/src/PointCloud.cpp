@@ -1,11 +1,12 @@
 #include "PointCloud.h"
 
-CPC::PointCloud::PointCloud(bool hasNormal_, bool hasColor_, bool hasScalar_) : hasNormal(hasNormal_), hasColor(hasColor_), hasScalar(hasScalar_)
+CPC::PointCloud::PointCloud(bool hasNormal_, bool hasColor_, bool hasScalar_) : hasNormal(hasNormal_), hasColor(hasColor_), hasScalar(hasScalar_), hasBoundingBox(false)
 {
 }
 
 void CPC::PointCloud::resize(size_t size)
 {
+    hasBoundingBox = false;
     positions.resize(size);
     if (hasNormal)
         normals.resize(size);
@@ -1,10 +1,11 @@
 #pragma once
 #include <vector>
 #include <Eigen/dense>
+#include "BoundingBox.h"
 
 namespace CPC
 {
-    typedef Eigen::Matrix<unsigned char, 1, 1> Vector3u;
+    typedef Eigen::Matrix<unsigned char, 3, 1> Vector3u;
     typedef Eigen::Vector3f Vector3f;
     typedef Eigen::Matrix<unsigned int, 3, 1> Vector3ui;
 
@@ -23,5 +24,9 @@ namespace CPC
             std::vector<Vector3f> normals;
             std::vector<Vector3u> colors;
             std::vector<float>    scalars;
+
+            // bounding box of the positions, only valid when hasBoundingBox is set (e.g. computed while loading)
+            bool hasBoundingBox;
+            BoundingBox boundingBox;
     };
 }
\ No newline at end of file
@@ -6,12 +6,17 @@
 #include <Boost/filesystem/path.hpp>
 #include <sstream>
 #include "Huffman.h"
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
 
 #define TINYPLY_IMPLEMENTATION
 
 using namespace CPC;
 using namespace tinyply;
 
+// set on the sub octree depth byte when a uint32 of EncodedDataFlag follow it, sub octree depth never reach 128
+const unsigned char EXTENDED_HEADER_BIT = 0x80;
+
 class manual_timer
 {
     std::chrono::high_resolution_clock::time_point t0;
@@ -30,7 +35,7 @@ CPC::PointCloudIO::~PointCloudIO()
 {
 }
 
-PointCloud CPC::PointCloudIO::loadPly(const std::string & path)
+PointCloud CPC::PointCloudIO::loadPly(const std::string & path, bool computeBoundingBox)
 {
     try
     {
@@ -77,6 +82,9 @@ PointCloud CPC::PointCloudIO::loadPly(const std::string & path)
         read_timer.start();
         file.read(ss);
         read_timer.stop();
+        // tinyply doesn't check the reads, a body shorter than the vertex count of the header only fail the stream
+        if (ss.fail())
+            throw std::runtime_error("truncated ply body, fewer than " + std::to_string(vertices ? vertices->count : 0) + " vertices in " + path);
 
         std::cout << "Reading took " << read_timer.get() / 1000.f << " seconds." << std::endl;
         if (vertices) std::cout << "\tRead " << vertices->count << " total vertices " << std::endl;
@@ -89,20 +97,53 @@ PointCloud CPC::PointCloudIO::loadPly(const std::string & path)
 
         // type casting to your own native types - Option A
         {
-            const size_t numBytes = vertices->buffer.size_bytes();
-            std::memcpy(ptCloud.positions.data(), vertices->buffer.get(), numBytes);
-            /*
-            if (normals)
+            if (computeBoundingBox)
+            {
+                // copy the positions block by block and reduce the bounding box of the block while it is still in cache
+                const Vector3f* source = reinterpret_cast<const Vector3f*>(vertices->buffer.get());
+                ptCloud.boundingBox = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, ptCloud.positions.size(), 1 << 16), BoundingBox(),
+                    [&](const tbb::blocked_range<size_t>& range, BoundingBox box)
+                    {
+                        std::memcpy(&ptCloud.positions[range.begin()], source + range.begin(), range.size() * sizeof(Vector3f));
+                        box.expand(BoundingBox::computeSerial(&ptCloud.positions[range.begin()], range.size()));
+                        return box;
+                    },
+                    [](BoundingBox a, const BoundingBox& b)
+                    {
+                        a.expand(b);
+                        return a;
+                    });
+                ptCloud.hasBoundingBox = true;
+            }
+            else
+            {
+                const size_t numBytes = vertices->buffer.size_bytes();
+                std::memcpy(ptCloud.positions.data(), vertices->buffer.get(), numBytes);
+            }
+            if (normals && normals->t == Type::FLOAT32)
             {
                 const size_t numBytes = normals->buffer.size_bytes();
                 std::memcpy(ptCloud.normals.data(), normals->buffer.get(), numBytes);
             }
-            
-            if (colors)
+            else if (normals)
+            {
+                std::cerr << "Only float normals are supported, the normals are ignored." << std::endl;
+                ptCloud.hasNormal = false;
+                ptCloud.normals.clear();
+            }
+
+            // only the 8 bits colors are kept, Vector3u is 3 packed bytes
+            if (colors && colors->t == Type::UINT8)
             {
                 const size_t numBytes = colors->buffer.size_bytes();
                 std::memcpy(ptCloud.colors.data(), colors->buffer.get(), numBytes);
-            }*/
+            }
+            else if (colors)
+            {
+                std::cerr << "Only 8 bits colors are supported, the colors are ignored." << std::endl;
+                ptCloud.hasColor = false;
+                ptCloud.colors.clear();
+            }
 
             if (scalars)
             {
@@ -143,8 +184,17 @@ bool CPC::PointCloudIO::savePly(const std::string & path, PointCloud & pointClou
         plyFile.add_properties_to_element("vertex", { "scalar_C2C_absolute_distances" },
             Type::FLOAT32, pointCloud.scalars.size(), reinterpret_cast<uint8_t*>(pointCloud.scalars.data()), Type::INVALID, 0);
     }
-    //cube_file.add_properties_to_element("vertex", { "nx", "ny", "nz" },
-    //    Type::FLOAT32, cube.normals.size(), reinterpret_cast<uint8_t*>(cube.normals.data()), Type::INVALID, 0);
+
+    if (pointCloud.hasColor)
+    {
+        plyFile.add_properties_to_element("vertex", { "red", "green", "blue" },
+            Type::UINT8, pointCloud.colors.size(), reinterpret_cast<uint8_t*>(pointCloud.colors.data()), Type::INVALID, 0);
+    }
+    if (pointCloud.hasNormal)
+    {
+        plyFile.add_properties_to_element("vertex", { "nx", "ny", "nz" },
+            Type::FLOAT32, pointCloud.normals.size(), reinterpret_cast<uint8_t*>(pointCloud.normals.data()), Type::INVALID, 0);
+    }
 
     //cube_file.add_properties_to_element("vertex", { "u", "v" },
         //Type::FLOAT32, cube.texcoords.size(), reinterpret_cast<uint8_t*>(cube.texcoords.data()), Type::INVALID, 0);
@@ -165,6 +215,17 @@ bool CPC::PointCloudIO::savePly(const std::string & path, PointCloud & pointClou
 
 EncodedData CPC::PointCloudIO::loadCpc(const std::string & inputPath)
 {
+    EncodedData data;
+
+    // the range coded data is written as is, only the other files go through 7z
+    if (boost::filesystem::exists(inputPath) && !isZipFile(inputPath))
+    {
+        std::ifstream inFile(inputPath, std::ifstream::binary);
+        if (inFile.is_open())
+            readEncodedData(inFile, data);
+        return data;
+    }
+
     // Decompress the huffman encoding first
     // create the decompressed point cloud file
     
@@ -175,12 +236,59 @@ EncodedData CPC::PointCloudIO::loadCpc(const std::string & inputPath)
     //huffman.decompress(inputPath, decompressedFilePath.string());
     bool success = zipDecompress(inputPath, decompressedFilePath.string());
 
-    EncodedData data;
-
     std::ifstream inFile(decompressedFilePath.string(), std::ifstream::binary);
     if (!inFile.is_open())
         return data;
-    
+
+    readEncodedData(inFile, data);
+    inFile.close();
+
+    // delete the decompressed point cloud file
+    //boost::filesystem::remove(decompressedFilePath);
+
+    return data;
+}
+
+bool CPC::PointCloudIO::saveCpc(const std::string & outputPath, EncodedData & encodedData)
+{
+    if (!encodedData.isValid())
+        return false;
+
+    // the range coded occupancy wouldn't shrink any further and the indexed data need to stay mappable,
+    // write it directly without temp file
+    if (encodedData.hasFlag(RANGE_CODED_OCCUPANCY) || encodedData.hasFlag(SUB_ROOT_INDEX))
+    {
+        std::ofstream outFile(outputPath, std::fstream::binary);
+        if (!outFile.is_open())
+            return false;
+        writeEncodedData(outFile, encodedData);
+        return outFile.good();
+    }
+
+    // create the decompressed point cloud file
+    boost::filesystem::path decompressedFilePath(outputPath);
+    decompressedFilePath = decompressedFilePath.replace_extension(".dpc");
+    std::ofstream outFile(decompressedFilePath.string(), std::fstream::binary);
+    if (!outFile.is_open())
+        return false;
+
+    writeEncodedData(outFile, encodedData);
+    outFile.close();
+
+    // Compress using the huffman encoding
+    std::cout << "Compressing " << outputPath << std::endl;
+    //Huffman::Huffman huffman;
+    //bool success = huffman.compress(decompressedFilePath.string(), outputPath);
+    bool success = zipCompress(decompressedFilePath.string(), outputPath);
+
+    // delete the decompressed point cloud file
+    //boost::filesystem::remove(decompressedFilePath);
+
+    return success;
+}
+
+void CPC::PointCloudIO::readEncodedData(std::ifstream& inFile, EncodedData& data)
+{
     // read in the scene bounding box
     readBinary(inFile, data.sceneBoundingBox.min.x());
     readBinary(inFile, data.sceneBoundingBox.min.y());
@@ -190,8 +298,19 @@ EncodedData CPC::PointCloudIO::loadCpc(const std::string & inputPath)
     readBinary(inFile, data.sceneBoundingBox.max.z());
     // read in the max depth
     readBinary(inFile, data.maxDepth);
-    // read in the sub octree depth
+    // read in the sub octree depth, its high bit tell if the extended header flags follow
     readBinary(inFile, data.subOctreeDepth);
+    if (data.subOctreeDepth & EXTENDED_HEADER_BIT)
+    {
+        data.subOctreeDepth &= ~EXTENDED_HEADER_BIT;
+        readBinary(inFile, data.flags);
+    }
+    // a depth the decoders can't hold, the data is left invalid
+    if (data.maxDepth > MAX_ENCODED_DEPTH || data.subOctreeDepth > data.maxDepth)
+    {
+        data = EncodedData();
+        return;
+    }
     // read in the size of the encoded data
     size_t dataSize;
     readBinary(inFile, dataSize);
@@ -200,27 +319,35 @@ EncodedData CPC::PointCloudIO::loadCpc(const std::string & inputPath)
     data.resize(dataSize);
     // read in the whole chunk of encoded data
     inFile.read((char*)data.encodedData.data(), dataSize * sizeof(unsigned char));
+    data.currentSize = dataSize;
 
-    inFile.close();
-
-    // delete the decompressed point cloud file
-    //boost::filesystem::remove(decompressedFilePath);
-
-    return data;
+    // the attribute streams follow the occupancy
+    if (data.hasFlag(SCALAR_ATTRIBUTE) || data.hasFlag(COLOR_ATTRIBUTE))
+    {
+        size_t attributeSize;
+        readBinary(inFile, attributeSize);
+        data.attributeData.resize(attributeSize);
+        inFile.read((char*)data.attributeData.data(), attributeSize);
+    }
+    if (data.hasFlag(NORMAL_ATTRIBUTE))
+    {
+        size_t normalSize;
+        readBinary(inFile, normalSize);
+        data.normalData.resize(normalSize);
+        inFile.read((char*)data.normalData.data(), normalSize);
+    }
+    // and the sub-root index last
+    if (data.hasFlag(SUB_ROOT_INDEX))
+    {
+        size_t numOfRoots;
+        readBinary(inFile, numOfRoots);
+        data.subRootIndex.resize(numOfRoots);
+        inFile.read((char*)data.subRootIndex.data(), numOfRoots * sizeof(SubRootEntry));
+    }
 }
 
-bool CPC::PointCloudIO::saveCpc(const std::string & outputPath, EncodedData & encodedData)
+void CPC::PointCloudIO::writeEncodedData(std::ofstream& outFile, EncodedData& encodedData)
 {
-    if (!encodedData.isValid())
-        return false;
-
-    // create the decompressed point cloud file
-    boost::filesystem::path decompressedFilePath(outputPath);
-    decompressedFilePath = decompressedFilePath.replace_extension(".dpc");
-    std::ofstream outFile(decompressedFilePath.string(), std::fstream::binary);
-    if (!outFile.is_open())
-        return false;
-
     // write the scene bounding box
     // Big Endian 
     writeBinary(outFile, encodedData.sceneBoundingBox.min.x());
@@ -231,25 +358,113 @@ bool CPC::PointCloudIO::saveCpc(const std::string & outputPath, EncodedData & en
     writeBinary(outFile, encodedData.sceneBoundingBox.max.z());
     // write the max depth
     writeBinary(outFile, encodedData.maxDepth);
-    // write the sub octree depth
-    writeBinary(outFile, encodedData.subOctreeDepth);
+    // write the sub octree depth, only the data using optional features need the extended header
+    if (encodedData.flags)
+    {
+        writeBinary(outFile, (unsigned char)(encodedData.subOctreeDepth | EXTENDED_HEADER_BIT));
+        writeBinary(outFile, encodedData.flags);
+    }
+    else
+    {
+        writeBinary(outFile, encodedData.subOctreeDepth);
+    }
     // write the size of the encoded data
     writeBinary(outFile, encodedData.encodedData.size());
     // Write the encoded data
     outFile.write((char*)encodedData.encodedData.data(), encodedData.encodedData.size() * sizeof(unsigned char));
+    // write the attribute streams
+    if (encodedData.hasFlag(SCALAR_ATTRIBUTE) || encodedData.hasFlag(COLOR_ATTRIBUTE))
+    {
+        writeBinary(outFile, encodedData.attributeData.size());
+        outFile.write((char*)encodedData.attributeData.data(), encodedData.attributeData.size());
+    }
+    if (encodedData.hasFlag(NORMAL_ATTRIBUTE))
+    {
+        writeBinary(outFile, encodedData.normalData.size());
+        outFile.write((char*)encodedData.normalData.data(), encodedData.normalData.size());
+    }
+    // write the sub-root index, the count then the fixed size entries sorted by Morton code
+    if (encodedData.hasFlag(SUB_ROOT_INDEX))
+    {
+        writeBinary(outFile, encodedData.subRootIndex.size());
+        outFile.write((char*)encodedData.subRootIndex.data(), encodedData.subRootIndex.size() * sizeof(SubRootEntry));
+    }
+}
 
-    outFile.close();
+bool CPC::PointCloudIO::mapCpc(const std::string& path, MappedEncodedData& data)
+{
+    if (!boost::filesystem::exists(path) || isZipFile(path))
+        return false;
 
-    // Compress using the huffman encoding
-    std::cout << "Compressing " << outputPath << std::endl;
-    //Huffman::Huffman huffman;
-    //bool success = huffman.compress(decompressedFilePath.string(), outputPath);
-    bool success = zipCompress(decompressedFilePath.string(), outputPath);
+    try
+    {
+        data.file = boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+        data.region = boost::interprocess::mapped_region(data.file, boost::interprocess::read_only);
+    }
+    catch (const boost::interprocess::interprocess_exception& e)
+    {
+        std::cerr << "Caught mapping exception: " << e.what() << std::endl;
+        return false;
+    }
 
-    // delete the decompressed point cloud file
-    //boost::filesystem::remove(decompressedFilePath);
+    // Same layout as readEncodedData, every section is skipped by its size so only the header pages are read
+    const unsigned char* begin = (const unsigned char*)data.region.get_address();
+    const size_t fileSize = data.region.get_size();
+    size_t pos = 0;
+    auto read = [&](void* value, size_t size)
+    {
+        if (pos + size > fileSize)
+            return false;
+        memcpy(value, begin + pos, size);
+        pos += size;
+        return true;
+    };
+    auto skipSection = [&](size_t& sectionSize, size_t entrySize)
+    {
+        if (!read(&sectionSize, sizeof(sectionSize)) || sectionSize > (fileSize - pos) / entrySize)
+            return false;
+        pos += sectionSize * entrySize;
+        return true;
+    };
+
+    data.payload = nullptr;
+    data.flags = 0;
+    auto& box = data.sceneBoundingBox;
+    if (!read(box.min.data(), 3 * sizeof(float)) || !read(box.max.data(), 3 * sizeof(float)) ||
+        !read(&data.maxDepth, sizeof(data.maxDepth)) || !read(&data.subOctreeDepth, sizeof(data.subOctreeDepth)))
+        return false;
+    if (data.subOctreeDepth & EXTENDED_HEADER_BIT)
+    {
+        data.subOctreeDepth &= ~EXTENDED_HEADER_BIT;
+        if (!read(&data.flags, sizeof(data.flags)))
+            return false;
+    }
+    if (!data.hasFlag(SUB_ROOT_INDEX) || data.maxDepth > MAX_ENCODED_DEPTH || data.subOctreeDepth > data.maxDepth)
+        return false;
 
-    return success;
+    size_t sectionSize;
+    if (!skipSection(data.payloadSize, 1))
+        return false;
+    const size_t payloadStart = pos - data.payloadSize;
+    if ((data.hasFlag(SCALAR_ATTRIBUTE) || data.hasFlag(COLOR_ATTRIBUTE)) && !skipSection(sectionSize, 1))
+        return false;
+    if (data.hasFlag(NORMAL_ATTRIBUTE) && !skipSection(sectionSize, 1))
+        return false;
+    if (!skipSection(sectionSize, sizeof(SubRootEntry)))
+        return false;
+
+    data.payload = begin + payloadStart;
+    data.subRootIndex = SubRootIndex(begin + pos - sectionSize * sizeof(SubRootEntry), sectionSize);
+    return true;
+}
+
+bool CPC::PointCloudIO::isZipFile(const std::string& path)
+{
+    const unsigned char signature[6] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+    unsigned char header[6] = {};
+    std::ifstream inFile(path, std::ifstream::binary);
+    inFile.read((char*)header, sizeof(header));
+    return memcmp(header, signature, sizeof(signature)) == 0;
 }
 
 bool CPC::PointCloudIO::zipCompress(const std::string & input, const std::string & output)
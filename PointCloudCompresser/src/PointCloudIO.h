@@ -2,6 +2,7 @@
 #include "tinyply/tinyply.h"
 #include "PointCloud.h"
 #include "Encoder.h"
+#include "MappedEncodedData.h"
 
 namespace CPC
 {
@@ -11,16 +12,26 @@ namespace CPC
             PointCloudIO();
             ~PointCloudIO();
 
-            PointCloud loadPly(const std::string& path);
+            // computeBoundingBox fuse the bounding box reduction into the copy of the positions
+            PointCloud loadPly(const std::string& path, bool computeBoundingBox = true);
             bool savePly(const std::string& path, PointCloud& pointCloud);
 
+            // the data is invalid if the file can't be read or its depth is over MAX_ENCODED_DEPTH
             EncodedData loadCpc(const std::string& path);
             bool saveCpc(const std::string& path, EncodedData& encodedData);
+            // Map a .cpc saved with a SUB_ROOT_INDEX, in constant time whatever its size.
+            // Return false if the file isn't indexed or is zipped, loadCpc is then needed, or if its depth is over MAX_ENCODED_DEPTH.
+            bool mapCpc(const std::string& path, MappedEncodedData& data);
 
             bool zipCompress(const std::string& input, const std::string& output);
             bool zipDecompress(const std::string& input, const std::string& output);
 
         protected:
+            void readEncodedData(std::ifstream& inFile, EncodedData& data);
+            void writeEncodedData(std::ofstream& outFile, EncodedData& encodedData);
+            // check the 7z signature, the range coded .cpc are not zipped
+            bool isZipFile(const std::string& path);
+
             template<class T>
             void writeBinary(std::ofstream& fstream, T val)
             {
@@ -0,0 +1,67 @@
+#include "QueryVolume.h"
+
+using namespace CPC;
+
+BoxVolume::BoxVolume(const BoundingBox& box_) : box(box_)
+{
+}
+
+CellOverlap BoxVolume::classify(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const
+{
+    if ((max.array() < box.min.array()).any() || (min.array() > box.max.array()).any())
+        return CELL_OUTSIDE;
+    if ((min.array() >= box.min.array()).all() && (max.array() <= box.max.array()).all())
+        return CELL_INSIDE;
+    return CELL_INTERSECTING;
+}
+
+bool BoxVolume::contains(const Eigen::Vector3f& point) const
+{
+    return box.isInside(point);
+}
+
+FrustumVolume::FrustumVolume(const std::vector<Eigen::Vector4f>& planes_) : planes(planes_)
+{
+}
+
+FrustumVolume FrustumVolume::fromViewProjection(const Eigen::Matrix4f& viewProjection)
+{
+    // Gribb and Hartmann, -w <= x, y, z <= w give the sum and difference of the last row with the others
+    std::vector<Eigen::Vector4f> planes;
+    for (int row = 0; row < 3; ++row)
+    {
+        planes.push_back((viewProjection.row(3) + viewProjection.row(row)).transpose());
+        planes.push_back((viewProjection.row(3) - viewProjection.row(row)).transpose());
+    }
+    return FrustumVolume(planes);
+}
+
+CellOverlap FrustumVolume::classify(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const
+{
+    CellOverlap overlap = CELL_INSIDE;
+    for (auto& plane : planes)
+    {
+        // the corners of the cell the furthest along the normal and the furthest against it
+        Eigen::Vector3f positive, negative;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            positive[axis] = plane[axis] >= 0.f ? max[axis] : min[axis];
+            negative[axis] = plane[axis] >= 0.f ? min[axis] : max[axis];
+        }
+        if (plane.head<3>().dot(positive) + plane[3] < 0.f)
+            return CELL_OUTSIDE;
+        if (plane.head<3>().dot(negative) + plane[3] < 0.f)
+            overlap = CELL_INTERSECTING;
+    }
+    return overlap;
+}
+
+bool FrustumVolume::contains(const Eigen::Vector3f& point) const
+{
+    for (auto& plane : planes)
+    {
+        if (plane.head<3>().dot(point) + plane[3] < 0.f)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "BoundingBox.h"
+#include <vector>
+
+namespace CPC
+{
+    // how an octree cell stand against a query volume
+    enum CellOverlap
+    {
+        CELL_OUTSIDE = 0,
+        CELL_INTERSECTING,
+        CELL_INSIDE
+    };
+
+    // Volume of a range query. classify may answer CELL_INTERSECTING for a cell actually outside, the points are then
+    // tested one by one, but never CELL_OUTSIDE or CELL_INSIDE unless the whole cell is.
+    class QueryVolume
+    {
+        public:
+            virtual ~QueryVolume() {}
+            virtual CellOverlap classify(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const = 0;
+            virtual bool contains(const Eigen::Vector3f& point) const = 0;
+    };
+
+    class BoxVolume : public QueryVolume
+    {
+        public:
+            BoxVolume(const BoundingBox& box);
+
+            CellOverlap classify(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const override;
+            bool contains(const Eigen::Vector3f& point) const override;
+
+        protected:
+            BoundingBox box;
+    };
+
+    // Convex volume bounded by planes (a, b, c, d), the inside of a plane being a * x + b * y + c * z + d >= 0.
+    // A view frustum is its 6 planes, which fromViewProjection extract from the matrix.
+    class FrustumVolume : public QueryVolume
+    {
+        public:
+            FrustumVolume(const std::vector<Eigen::Vector4f>& planes);
+            // the planes of a column vector view projection matrix, with clip space z from -w to w
+            static FrustumVolume fromViewProjection(const Eigen::Matrix4f& viewProjection);
+
+            CellOverlap classify(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const override;
+            bool contains(const Eigen::Vector3f& point) const override;
+
+        protected:
+            std::vector<Eigen::Vector4f> planes;
+    };
+}
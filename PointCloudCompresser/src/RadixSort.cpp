@@ -0,0 +1,112 @@
+#include "RadixSort.h"
+#include <tbb/parallel_for.h>
+#include <algorithm>
+
+using namespace CPC;
+
+const unsigned int RADIX_BITS = 8;
+const size_t RADIX_SIZE = (size_t)1 << RADIX_BITS;
+const size_t RADIX_MASK = RADIX_SIZE - 1;
+const size_t BLOCK_SIZE = 1 << 16; // number of keys handled by one task in each pass
+
+void RadixSort::sort(std::vector<unsigned long long>& keys, unsigned int numOfBits)
+{
+    sortImpl(keys, nullptr, numOfBits);
+}
+
+void RadixSort::sort(std::vector<unsigned long long>& keys, std::vector<unsigned int>& values, unsigned int numOfBits)
+{
+    sortImpl(keys, &values, numOfBits);
+}
+
+void RadixSort::sortImpl(std::vector<unsigned long long>& keys, std::vector<unsigned int>* values, unsigned int numOfBits)
+{
+    const size_t size = keys.size();
+    // small input, not worth the histogram overhead
+    if (size < BLOCK_SIZE)
+    {
+        if (values)
+        {
+            std::vector<std::pair<unsigned long long, unsigned int>> pairs(size);
+            for (size_t i = 0; i < size; ++i)
+                pairs[i] = std::make_pair(keys[i], (*values)[i]);
+            std::stable_sort(pairs.begin(), pairs.end(), [](const std::pair<unsigned long long, unsigned int>& a, const std::pair<unsigned long long, unsigned int>& b) { return a.first < b.first; });
+            for (size_t i = 0; i < size; ++i)
+            {
+                keys[i] = pairs[i].first;
+                (*values)[i] = pairs[i].second;
+            }
+        }
+        else
+        {
+            std::sort(keys.begin(), keys.end());
+        }
+        return;
+    }
+
+    const size_t numOfBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<unsigned long long> keysBuffer(size);
+    std::vector<unsigned int> valuesBuffer(values ? size : 0);
+    // one histogram per block, later turned into the scatter offset of each block
+    std::vector<size_t> histograms(numOfBlocks * RADIX_SIZE);
+
+    unsigned long long* src = keys.data();
+    unsigned long long* dst = keysBuffer.data();
+    unsigned int* srcValues = values ? values->data() : nullptr;
+    unsigned int* dstValues = values ? valuesBuffer.data() : nullptr;
+
+    unsigned int numOfPasses = (std::min(numOfBits, 64u) + RADIX_BITS - 1) / RADIX_BITS;
+    for (unsigned int pass = 0; pass < numOfPasses; ++pass)
+    {
+        const unsigned int shift = pass * RADIX_BITS;
+
+        // count the digit of each block
+        tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+        {
+            size_t* histogram = &histograms[block * RADIX_SIZE];
+            std::fill(histogram, histogram + RADIX_SIZE, 0);
+            size_t end = std::min(size, (block + 1) * BLOCK_SIZE);
+            for (size_t i = block * BLOCK_SIZE; i < end; ++i)
+            {
+                ++histogram[(src[i] >> shift) & RADIX_MASK];
+            }
+        });
+
+        // exclusive scan, digit major then block, so each block write into its own slice of every digit
+        size_t offset = 0;
+        for (size_t digit = 0; digit < RADIX_SIZE; ++digit)
+        {
+            for (size_t block = 0; block < numOfBlocks; ++block)
+            {
+                size_t count = histograms[block * RADIX_SIZE + digit];
+                histograms[block * RADIX_SIZE + digit] = offset;
+                offset += count;
+            }
+        }
+
+        // scatter, stable within each block
+        tbb::parallel_for((size_t)0, numOfBlocks, [&](size_t block)
+        {
+            size_t* histogram = &histograms[block * RADIX_SIZE];
+            size_t end = std::min(size, (block + 1) * BLOCK_SIZE);
+            for (size_t i = block * BLOCK_SIZE; i < end; ++i)
+            {
+                size_t target = histogram[(src[i] >> shift) & RADIX_MASK]++;
+                dst[target] = src[i];
+                if (srcValues)
+                    dstValues[target] = srcValues[i];
+            }
+        });
+
+        std::swap(src, dst);
+        std::swap(srcValues, dstValues);
+    }
+
+    // odd number of passes leave the result in the buffer
+    if (src != keys.data())
+    {
+        keys.swap(keysBuffer);
+        if (values)
+            values->swap(valuesBuffer);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <vector>
+
+namespace CPC
+{
+    class RadixSort
+    {
+        public:
+            // Parallel LSD radix sort of 64 bits keys, only the lowest numOfBits bits are sorted on
+            static void sort(std::vector<unsigned long long>& keys, unsigned int numOfBits = 64);
+            // Sort the keys and carry the values along, values[i] stay paired with keys[i]
+            static void sort(std::vector<unsigned long long>& keys, std::vector<unsigned int>& values, unsigned int numOfBits = 64);
+
+        protected:
+            static void sortImpl(std::vector<unsigned long long>& keys, std::vector<unsigned int>* values, unsigned int numOfBits);
+    };
+}
@@ -0,0 +1,125 @@
+#include "RangeCoder.h"
+
+using namespace CPC;
+
+const unsigned int TOP_VALUE = 1 << 24; // renormalize once the range fall under it
+const unsigned int MOVE_BITS = 5;
+
+RangeEncoder::RangeEncoder(std::vector<unsigned char>& output_) : output(output_), low(0), range(0xFFFFFFFF), cache(0), cacheSize(1)
+{
+}
+
+void RangeEncoder::encodeBit(unsigned short& probability, unsigned int bit)
+{
+    unsigned int bound = (range >> PROBABILITY_BITS) * probability;
+    if (bit == 0)
+    {
+        range = bound;
+        probability += ((1 << PROBABILITY_BITS) - probability) >> MOVE_BITS;
+    }
+    else
+    {
+        low += bound;
+        range -= bound;
+        probability -= probability >> MOVE_BITS;
+    }
+
+    while (range < TOP_VALUE)
+    {
+        range <<= 8;
+        shiftLow();
+    }
+}
+
+void RangeEncoder::encodeByte(unsigned short* probabilities, unsigned char byte)
+{
+    unsigned int node = 1;
+    for (int i = 7; i >= 0; --i)
+    {
+        unsigned int bit = (byte >> i) & 1;
+        encodeBit(probabilities[node], bit);
+        node = (node << 1) | bit;
+    }
+}
+
+void RangeEncoder::flush()
+{
+    for (int i = 0; i < 5; ++i)
+    {
+        shiftLow();
+    }
+}
+
+void RangeEncoder::shiftLow()
+{
+    // a byte can only be written once we know no carry will propagate into it
+    if ((unsigned int)low < 0xFF000000 || (low >> 32) != 0)
+    {
+        unsigned char carry = (unsigned char)(low >> 32);
+        unsigned char byte = cache;
+        do
+        {
+            output.push_back(byte + carry);
+            byte = 0xFF;
+        } while (--cacheSize != 0);
+        cache = (unsigned char)(low >> 24);
+    }
+    ++cacheSize;
+    low = (low & 0x00FFFFFF) << 8;
+}
+
+RangeDecoder::RangeDecoder(const unsigned char* input_, size_t size_) : input(input_), size(size_), position(0), code(0), range(0xFFFFFFFF)
+{
+    // the first byte is always the empty cache of the encoder
+    for (int i = 0; i < 5; ++i)
+    {
+        code = (code << 8) | next();
+    }
+}
+
+unsigned int RangeDecoder::decodeBit(unsigned short& probability)
+{
+    unsigned int bound = (range >> PROBABILITY_BITS) * probability;
+    unsigned int bit;
+    if (code < bound)
+    {
+        range = bound;
+        probability += ((1 << PROBABILITY_BITS) - probability) >> MOVE_BITS;
+        bit = 0;
+    }
+    else
+    {
+        code -= bound;
+        range -= bound;
+        probability -= probability >> MOVE_BITS;
+        bit = 1;
+    }
+
+    while (range < TOP_VALUE)
+    {
+        range <<= 8;
+        code = (code << 8) | next();
+    }
+    return bit;
+}
+
+unsigned char RangeDecoder::decodeByte(unsigned short* probabilities)
+{
+    unsigned int node = 1;
+    for (int i = 0; i < 8; ++i)
+    {
+        node = (node << 1) | decodeBit(probabilities[node]);
+    }
+    return (unsigned char)node;
+}
+
+size_t RangeDecoder::getPosition() const
+{
+    return position;
+}
+
+unsigned char RangeDecoder::next()
+{
+    // reading past the end only happen on corrupted data, feed zeros instead of overrunning
+    return position < size ? input[position++] : (++position, 0);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+namespace CPC
+{
+    // Adaptive binary range coder, the probabilities are 11 bits and adapt by 1/32 of the error after each bit
+    const unsigned int PROBABILITY_BITS = 11;
+    const unsigned short INITIAL_PROBABILITY = 1 << (PROBABILITY_BITS - 1);
+
+    class RangeEncoder
+    {
+        public:
+            RangeEncoder(std::vector<unsigned char>& output);
+
+            void encodeBit(unsigned short& probability, unsigned int bit);
+            // encode the 8 bits from the most significant one, probabilities hold the 255 nodes of the bit tree (index 1 to 255)
+            void encodeByte(unsigned short* probabilities, unsigned char byte);
+            // write the remaining bytes, must be called once at the end
+            void flush();
+
+        protected:
+            void shiftLow();
+
+            std::vector<unsigned char>& output;
+            unsigned long long low;
+            unsigned int range;
+            unsigned char cache;
+            size_t cacheSize;
+    };
+
+    class RangeDecoder
+    {
+        public:
+            RangeDecoder(const unsigned char* input, size_t size);
+
+            unsigned int decodeBit(unsigned short& probability);
+            unsigned char decodeByte(unsigned short* probabilities);
+            // number of bytes consumed so far
+            size_t getPosition() const;
+
+        protected:
+            unsigned char next();
+
+            const unsigned char* input;
+            size_t size;
+            size_t position;
+            unsigned int code;
+            unsigned int range;
+    };
+}
@@ -0,0 +1,120 @@
+#include "SubOctreeCache.h"
+
+using namespace CPC;
+
+// rough cost of a list node and its hash map entry
+const size_t ENTRY_OVERHEAD = 64;
+
+SubOctreeCache::SubOctreeCache(const EncodedData& data, size_t byteBudget_) : byteBudget(byteBudget_), wholeBytes(0)
+{
+    // same cells as the octree the data was encoded from
+    BoundingBox bbox = data.sceneBoundingBox;
+    Octree emptyOctree(data.maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, emptyOctree.getLeafCellSize(), data.maxDepth);
+}
+
+const std::vector<MortonLevel>* SubOctreeCache::find(unsigned long long code)
+{
+    auto itr = lookup.find(code);
+    if (itr == lookup.end())
+    {
+        ++stats.misses;
+        return nullptr;
+    }
+
+    ++stats.hits;
+    entries.splice(entries.begin(), entries, itr->second);
+    return &itr->second->levels;
+}
+
+const std::vector<MortonLevel>& SubOctreeCache::insert(unsigned long long code, const std::vector<MortonLevel>& levels)
+{
+    auto itr = lookup.find(code);
+    if (itr != lookup.end())
+    {
+        stats.bytes -= itr->second->bytes;
+        entries.erase(itr->second);
+        lookup.erase(itr);
+        --stats.numOfSubOctrees;
+    }
+
+    // the copy is exactly sized, the decoder scratch levels keep their capacity for the next sub-octree
+    entries.push_front(Entry{ code, levels, computeBytes(levels) });
+    lookup[code] = entries.begin();
+    stats.bytes += entries.front().bytes;
+    ++stats.numOfSubOctrees;
+
+    evict();
+    return entries.front().levels;
+}
+
+const std::vector<MortonLevel>* SubOctreeCache::findWholeLevels() const
+{
+    return wholeBytes ? &wholeLevels : nullptr;
+}
+
+const std::vector<MortonLevel>& SubOctreeCache::insertWholeLevels(std::vector<MortonLevel>&& levels)
+{
+    stats.bytes -= wholeBytes;
+    wholeLevels = std::move(levels);
+    wholeBytes = computeBytes(wholeLevels);
+    stats.bytes += wholeBytes;
+
+    evict();
+    return wholeLevels;
+}
+
+void SubOctreeCache::clear()
+{
+    entries.clear();
+    lookup.clear();
+    wholeLevels = std::vector<MortonLevel>();
+    wholeBytes = 0;
+    stats.bytes = 0;
+    stats.numOfSubOctrees = 0;
+}
+
+size_t SubOctreeCache::getByteBudget() const
+{
+    return byteBudget;
+}
+
+void SubOctreeCache::setByteBudget(size_t byteBudget_)
+{
+    byteBudget = byteBudget_;
+    evict();
+}
+
+SubOctreeCacheStats SubOctreeCache::getStats() const
+{
+    return stats;
+}
+
+size_t SubOctreeCache::computeBytes(const std::vector<MortonLevel>& levels)
+{
+    size_t bytes = ENTRY_OVERHEAD + levels.size() * sizeof(MortonLevel);
+    for (auto& level : levels)
+    {
+        bytes += level.size() * (sizeof(unsigned long long) + sizeof(unsigned char));
+    }
+    return bytes;
+}
+
+const LeafQuantizer& SubOctreeCache::getQuantizer() const
+{
+    return quantizer;
+}
+
+void SubOctreeCache::evict()
+{
+    // the least recently used at the back, the most recent one and the whole levels always stay
+    while (stats.bytes > byteBudget && entries.size() > 1)
+    {
+        auto& entry = entries.back();
+        stats.bytes -= entry.bytes;
+        lookup.erase(entry.code);
+        entries.pop_back();
+        --stats.numOfSubOctrees;
+        ++stats.evictions;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "Encoder.h"
+#include <list>
+#include <unordered_map>
+
+namespace CPC
+{
+    struct SubOctreeCacheStats
+    {
+        SubOctreeCacheStats() : hits(0), misses(0), evictions(0), bytes(0), numOfSubOctrees(0) {}
+
+        size_t hits;
+        size_t misses; // including the lookups of points outside every sub-root
+        size_t evictions;
+        size_t bytes; // memory held by the cached levels
+        size_t numOfSubOctrees;
+    };
+
+    // Decoded sub-octrees of one encoded data kept within a byte budget, keyed by the Morton code of their sub-root.
+    // When an insertion goes over the budget the least recently used sub-octrees are evicted, so the hot regions stay
+    // decoded while the memory stay bounded. Not thread safe.
+    class SubOctreeCache
+    {
+        public:
+            SubOctreeCache(const EncodedData& data, size_t byteBudget);
+
+            // levels of the sub-octree, nullptr on a miss. A hit make it the most recently used.
+            const std::vector<MortonLevel>* find(unsigned long long code);
+            // copy the levels of a decoded sub-octree, then evict down to the budget. The new one is never evicted,
+            // so a sub-octree larger than the whole budget is still kept until the next insertion.
+            const std::vector<MortonLevel>& insert(unsigned long long code, const std::vector<MortonLevel>& levels);
+            // All the levels of breadth first data, which has no payload per sub-root so its sub-octrees are cut from them.
+            // Decoded once, they count in the bytes against the budget but are never evicted, only dropped by clear.
+            const std::vector<MortonLevel>* findWholeLevels() const;
+            const std::vector<MortonLevel>& insertWholeLevels(std::vector<MortonLevel>&& levels);
+            void clear();
+
+            size_t getByteBudget() const;
+            void setByteBudget(size_t byteBudget);
+            SubOctreeCacheStats getStats() const;
+            // leaf cells of the encoded data, to find the sub-octree of a point
+            const LeafQuantizer& getQuantizer() const;
+            // memory held by decoded levels of that exact size
+            static size_t computeBytes(const std::vector<MortonLevel>& levels);
+
+        protected:
+            struct Entry
+            {
+                unsigned long long code;
+                std::vector<MortonLevel> levels;
+                size_t bytes;
+            };
+            void evict();
+
+            std::list<Entry> entries; // the most recently used first
+            std::unordered_map<unsigned long long, std::list<Entry>::iterator> lookup;
+            std::vector<MortonLevel> wholeLevels;
+            size_t wholeBytes; // 0 when wholeLevels is not decoded
+            size_t byteBudget;
+            SubOctreeCacheStats stats;
+            LeafQuantizer quantizer;
+    };
+}
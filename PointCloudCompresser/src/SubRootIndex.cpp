@@ -0,0 +1,67 @@
+#include "SubRootIndex.h"
+#include <cstring>
+
+using namespace CPC;
+
+SubRootIndex::SubRootIndex() : entries(nullptr), numOfEntries(0)
+{
+}
+
+SubRootIndex::SubRootIndex(const std::vector<SubRootEntry>& entries_) : entries((const unsigned char*)entries_.data()), numOfEntries(entries_.size())
+{
+}
+
+SubRootIndex::SubRootIndex(const unsigned char* entries_, size_t numOfEntries_) : entries(entries_), numOfEntries(numOfEntries_)
+{
+}
+
+size_t SubRootIndex::size() const
+{
+    return numOfEntries;
+}
+
+bool SubRootIndex::empty() const
+{
+    return numOfEntries == 0;
+}
+
+unsigned long long SubRootIndex::getCode(size_t entry) const
+{
+    unsigned long long code;
+    memcpy(&code, entries + entry * sizeof(SubRootEntry) + offsetof(SubRootEntry, code), sizeof(code));
+    return code;
+}
+
+unsigned long long SubRootIndex::getPosition(size_t entry) const
+{
+    unsigned long long position;
+    memcpy(&position, entries + entry * sizeof(SubRootEntry) + offsetof(SubRootEntry, position), sizeof(position));
+    return position;
+}
+
+size_t SubRootIndex::lowerBound(unsigned long long code) const
+{
+    size_t first = 0, count = numOfEntries;
+    while (count > 0)
+    {
+        size_t half = count / 2;
+        if (getCode(first + half) < code)
+        {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else
+        {
+            count = half;
+        }
+    }
+    return first;
+}
+
+size_t SubRootIndex::find(unsigned long long code) const
+{
+    size_t entry = lowerBound(code);
+    if (entry == numOfEntries || getCode(entry) != code)
+        return NOT_INDEXED;
+    return (size_t)getPosition(entry);
+}
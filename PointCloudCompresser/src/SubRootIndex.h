@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+namespace CPC
+{
+    // Morton code of a sub-root on the sub-octree level and position of its payload in the encoded data, right after its header
+    struct SubRootEntry
+    {
+        unsigned long long code;
+        unsigned long long position;
+    };
+
+    const size_t NOT_INDEXED = (size_t)-1;
+
+    // Read only view of the sub-root entries sorted by Morton code, either from EncodedData or in place from a memory mapped .cpc.
+    // The entries are read with memcpy, so they don't need to be aligned in the file.
+    class SubRootIndex
+    {
+        public:
+            SubRootIndex();
+            SubRootIndex(const std::vector<SubRootEntry>& entries);
+            SubRootIndex(const unsigned char* entries, size_t numOfEntries);
+
+            size_t size() const;
+            bool empty() const;
+            unsigned long long getCode(size_t entry) const;
+            unsigned long long getPosition(size_t entry) const;
+            // first entry with a code not less than code, size() if there is none
+            size_t lowerBound(unsigned long long code) const;
+            // payload position of the sub-root, NOT_INDEXED if it doesn't exist
+            size_t find(unsigned long long code) const;
+
+        protected:
+            const unsigned char* entries;
+            size_t numOfEntries;
+    };
+}
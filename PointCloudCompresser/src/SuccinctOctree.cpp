@@ -0,0 +1,287 @@
+#include "SuccinctOctree.h"
+#include "Decoder.h"
+#include "MortonCode.h"
+#include "RadixSort.h"
+#include <stack>
+#include <numeric>
+#include <algorithm>
+
+using namespace CPC;
+
+const size_t RANK_BLOCK_SIZE = 64; // nodes per rank directory entry, 64 bits for every 64 nodes
+
+// number of bits set in a 64 bits word
+static inline unsigned long long wordCount(unsigned long long word)
+{
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+}
+
+SuccinctOctree::SuccinctOctree() : maxDepth(0)
+{
+    build(std::vector<MortonLevel>());
+}
+
+SuccinctOctree::SuccinctOctree(Octree& octree) : maxDepth(octree.getMaxDepth()), bbox(octree.getBoundingBox()),
+                                                 quantizer(octree.getBoundingBox(), octree.getLeafCellSize(), octree.getMaxDepth())
+{
+    build(octree.getMortonLevels());
+}
+
+SuccinctOctree::SuccinctOctree(EncodedData& data) : maxDepth(data.maxDepth), bbox(data.sceneBoundingBox)
+{
+    // an empty octree give the leaf cell size without building anything
+    Octree emptyOctree(maxDepth, bbox);
+    quantizer = LeafQuantizer(bbox, emptyOctree.getLeafCellSize(), maxDepth);
+
+    std::vector<MortonLevel> levels(maxDepth);
+    const unsigned char subOctreeLevel = data.subOctreeDepth;
+
+    Decoder decoder;
+    if (data.hasFlag(BREADTH_FIRST_LAYOUT))
+    {
+        // the level streams are already in Morton order
+        decoder.decodeLevels(data, levels);
+    }
+    else
+    {
+        // Walk each sub-octree in the encoded order, the nodes of each level are sorted afterward
+        Index rootIndex(0, 0, 0);
+        std::stack<std::pair<unsigned char, unsigned long long>> stack;
+        for (size_t i = 0; i < data.encodedData.size(); )
+        {
+            size_t pos = i;
+            size_t nodeSize;
+            decoder.decodeNodeHeader(pos, rootIndex, data, nodeSize);
+            i = pos + nodeSize;
+
+            stack.push(std::make_pair(subOctreeLevel, MortonCode::encode64(rootIndex)));
+            while (!stack.empty())
+            {
+                auto node = stack.top();
+                stack.pop();
+
+                unsigned char child = data.readNext(pos);
+                levels[node.first].codes.push_back(node.second);
+                levels[node.first].children.push_back(child);
+
+                // same order as the encoder, the last child is encoded first
+                if (node.first + 1u < maxDepth)
+                {
+                    for (unsigned char childId = 0; childId < 8; ++childId)
+                    {
+                        if (child & (1 << childId))
+                            stack.push(std::make_pair((unsigned char)(node.first + 1), (node.second << 3) | childId));
+                    }
+                }
+            }
+        }
+
+        for (unsigned int level = subOctreeLevel; level < maxDepth; ++level)
+        {
+            auto& mortonLevel = levels[level];
+            if (mortonLevel.size() <= 1)
+                continue;
+
+            std::vector<unsigned int> order(mortonLevel.size());
+            std::iota(order.begin(), order.end(), 0);
+            RadixSort::sort(mortonLevel.codes, order, 3 * level);
+
+            std::vector<unsigned char> sortedChildren(order.size());
+            for (size_t n = 0; n < order.size(); ++n)
+            {
+                sortedChildren[n] = mortonLevel.children[order[n]];
+            }
+            mortonLevel.children.swap(sortedChildren);
+        }
+    }
+
+    // the levels above the sub-octrees are truncated from the encoding, rebuild them from the sub-roots
+    for (int level = (int)subOctreeLevel - 1; level >= 0; --level)
+    {
+        auto& childLevel = levels[level + 1];
+        auto& parentLevel = levels[level];
+        for (auto code : childLevel.codes)
+        {
+            unsigned long long parentCode = code >> 3;
+            if (parentLevel.codes.empty() || parentLevel.codes.back() != parentCode)
+            {
+                parentLevel.codes.push_back(parentCode);
+                parentLevel.children.push_back(0);
+            }
+            parentLevel.children.back() |= 1 << (code & 7);
+        }
+    }
+
+    build(levels);
+}
+
+void SuccinctOctree::build(const std::vector<MortonLevel>& levels)
+{
+    levelStarts.clear();
+    size_t numOfNodes = 0;
+    for (auto& level : levels)
+    {
+        levelStarts.push_back(numOfNodes);
+        numOfNodes += level.size();
+    }
+    levelStarts.push_back(numOfNodes);
+
+    children.clear();
+    children.reserve(numOfNodes);
+    for (auto& level : levels)
+    {
+        children.insert(children.end(), level.children.begin(), level.children.end());
+    }
+
+    // one entry per block, plus one for the end so rank work on every node position
+    blockRanks.resize(numOfNodes / RANK_BLOCK_SIZE + 1);
+    unsigned long long currentRank = 0;
+    for (size_t node = 0; node < numOfNodes; ++node)
+    {
+        if (node % RANK_BLOCK_SIZE == 0)
+            blockRanks[node / RANK_BLOCK_SIZE] = currentRank;
+        currentRank += childCount(children[node]);
+    }
+    if (numOfNodes % RANK_BLOCK_SIZE == 0)
+        blockRanks.back() = currentRank;
+}
+
+BoundingBox SuccinctOctree::getBoundingBox() const
+{
+    return bbox;
+}
+
+unsigned int SuccinctOctree::getMaxDepth() const
+{
+    return maxDepth;
+}
+
+size_t SuccinctOctree::getNumOfNodes() const
+{
+    return children.size();
+}
+
+size_t SuccinctOctree::getNumOfLeaves() const
+{
+    // every children bit is a node, except the root which has no parent bit
+    return children.empty() ? 0 : rank(children.size()) - (children.size() - 1);
+}
+
+size_t SuccinctOctree::getMemoryUsage() const
+{
+    return children.capacity() * sizeof(unsigned char) + blockRanks.capacity() * sizeof(unsigned long long) + levelStarts.capacity() * sizeof(size_t);
+}
+
+size_t SuccinctOctree::getRoot() const
+{
+    return children.empty() ? NOT_FOUND : 0;
+}
+
+unsigned char SuccinctOctree::getChildren(size_t node) const
+{
+    return isLeaf(node) ? 0 : children[node];
+}
+
+size_t SuccinctOctree::getChild(size_t node, unsigned char childId) const
+{
+    if (isLeaf(node))
+        return NOT_FOUND;
+
+    unsigned char nodeChildren = children[node];
+    if (!(nodeChildren & (1 << childId)))
+        return NOT_FOUND;
+
+    // the children of all the previous nodes come first, then the smaller siblings
+    return 1 + rank(node) + childCount(nodeChildren & ((1 << childId) - 1));
+}
+
+size_t SuccinctOctree::getParent(size_t node) const
+{
+    if (node == 0 || node == NOT_FOUND)
+        return NOT_FOUND;
+    return select(node - 1);
+}
+
+bool SuccinctOctree::isLeaf(size_t node) const
+{
+    return node >= children.size();
+}
+
+size_t SuccinctOctree::getNode(unsigned int level, const Index& index) const
+{
+    if (children.empty() || level > maxDepth)
+        return NOT_FOUND;
+    if ((index.x() >> level) != 0 || (index.y() >> level) != 0 || (index.z() >> level) != 0)
+        return NOT_FOUND;
+
+    // follow the index bits from the root, one child per level
+    size_t node = getRoot();
+    for (unsigned int depth = 0; depth < level && node != NOT_FOUND; ++depth)
+    {
+        unsigned int shift = level - 1 - depth;
+        unsigned char childId = ((index.x() >> shift) & 1) | (((index.y() >> shift) & 1) << 1) | (((index.z() >> shift) & 1) << 2);
+        node = getChild(node, childId);
+    }
+    return node;
+}
+
+bool SuccinctOctree::nodeExist(unsigned int level, const Index& index) const
+{
+    return getNode(level, index) != NOT_FOUND;
+}
+
+bool SuccinctOctree::pointExist(const Eigen::Vector3f& point) const
+{
+    if (!bbox.isInside(point) || children.empty())
+        return false;
+
+    // same walk as getNode, a node without children above the leaves is a truncated leaf covering the whole cell
+    Index leaf = quantizer.computeLeafAddress(point);
+    size_t node = getRoot();
+    for (unsigned int depth = 0; depth < maxDepth && node != NOT_FOUND; ++depth)
+    {
+        if (children[node] == 0)
+            return true;
+        unsigned int shift = maxDepth - 1 - depth;
+        unsigned char childId = ((leaf.x() >> shift) & 1) | (((leaf.y() >> shift) & 1) << 1) | (((leaf.z() >> shift) & 1) << 2);
+        node = getChild(node, childId);
+    }
+    return node != NOT_FOUND;
+}
+
+size_t SuccinctOctree::rank(size_t node) const
+{
+    size_t position = node - node % RANK_BLOCK_SIZE;
+    size_t count = blockRanks[node / RANK_BLOCK_SIZE];
+
+    // count 8 nodes at a time, then the remaining ones
+    for (; position + 8 <= node; position += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, &children[position], sizeof(word));
+        count += wordCount(word);
+    }
+    for (; position < node; ++position)
+    {
+        count += childCount(children[position]);
+    }
+    return count;
+}
+
+size_t SuccinctOctree::select(size_t childRank) const
+{
+    // last block starting at or before the rank, then scan it
+    auto block = std::upper_bound(blockRanks.begin(), blockRanks.end(), (unsigned long long)childRank) - blockRanks.begin() - 1;
+    size_t node = block * RANK_BLOCK_SIZE;
+    size_t count = blockRanks[block];
+    for (; node < children.size(); ++node)
+    {
+        count += childCount(children[node]);
+        if (childRank < count)
+            return node;
+    }
+    return NOT_FOUND;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "Encoder.h"
+
+namespace CPC
+{
+    // Read-only pointerless octree, the children bits of every node stored level by level in Morton order.
+    // The children of a node are found by counting the children bits before it (rank), and its parent by finding
+    // the node holding its bit (select). It take 8 bits per node plus 1 bit per node for the rank directory.
+    // Nodes are numbered in that order starting with the root at 0, the leaves are numbered after the last level
+    // but have no children bits.
+    class SuccinctOctree
+    {
+        public:
+            static const size_t NOT_FOUND = (size_t)-1;
+
+            SuccinctOctree();
+            SuccinctOctree(Octree& octree);
+            // build directly from the encoded sub-octrees, without going through the std::map levels
+            SuccinctOctree(EncodedData& data);
+
+            BoundingBox getBoundingBox() const;
+            unsigned int getMaxDepth() const;
+            size_t getNumOfNodes() const;
+            size_t getNumOfLeaves() const;
+            size_t getMemoryUsage() const;
+
+            size_t getRoot() const;
+            unsigned char getChildren(size_t node) const;
+            size_t getChild(size_t node, unsigned char childId) const;
+            size_t getParent(size_t node) const;
+            bool isLeaf(size_t node) const;
+
+            // find the node of the index on the level, level maxDepth look for a leaf
+            size_t getNode(unsigned int level, const Index& index) const;
+            bool nodeExist(unsigned int level, const Index& index) const;
+            // check if the leaf cell containing the point is occupied, or covered by a truncated leaf
+            bool pointExist(const Eigen::Vector3f& point) const;
+
+        protected:
+            void build(const std::vector<MortonLevel>& levels);
+            size_t rank(size_t node) const; // number of children bits set in the nodes before node
+            size_t select(size_t childRank) const; // node holding the childRank-th children bit set
+
+            std::vector<unsigned char> children;
+            std::vector<unsigned long long> blockRanks; // rank at the start of each block of RANK_BLOCK_SIZE nodes
+            std::vector<size_t> levelStarts; // first node of each level, the last entry is the first leaf
+            unsigned int maxDepth;
+            BoundingBox bbox;
+            LeafQuantizer quantizer;
+    };
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <vector>
 #include <random>
+#include <cmath>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
@@ -9,12 +10,17 @@
 #include "Octree.h"
 #include "PointCloudIO.h"
 #include "Encoder.h"
+#include "EncoderSession.h"
 #include "Decoder.h"
+#include "ExternalEncoder.h"
+#include "SuccinctOctree.h"
+#include "AttributeCoder.h"
 
 using namespace CPC;
 
 int pointcount = 0;
 int memoryUseLevel[16];
+int succinctMemoryUseLevel[16];
 int intersectiontimingLevel[16];
 int classicTiming = 0;
 int octreeTime = 0;
@@ -35,10 +41,19 @@ static void show_usage(std::string name)
         << "\t-h,--help\t\tShow help message\n"
         << "\t-i,--input\tSpecify the input path, REQUIRED"
         << "\t-o,--output\tSpecify the output path, OPTIONAL will automatically detect the file extension and use the input file name"
+        << "\t-b,--build\tSpecify the octree build mode (map, sort or hash), OPTIONAL default to map"
+        << "\t-m,--memory\tSpecify a memory budget in MB, OPTIONAL the ply is then encoded out-of-core within that budget"
+        << "\t-s,--stats\tSpecify a path to write the octree stats as JSON, OPTIONAL"
+        << "\t-l,--layout\tSpecify the occupancy layout (depth or breadth), OPTIONAL default to depth"
+        << "\t-c,--coder\tSpecify the entropy coder (7z or range), OPTIONAL default to 7z"
+        << "\t-e,--error\tSpecify an error budget in scene units, OPTIONAL the octree then stop subdividing where the budget is met"
+        << "\t-a,--attributes\tEncode the scalars, colors and normals of the ply along the geometry, OPTIONAL"
+        << "\t-t,--tolerance\tSpecify the scalar tolerance, OPTIONAL default to 0.001, 0 leave the scalars out"
+        << "\t-n,--normalBits\tSpecify the bits per octahedral normal coordinate, OPTIONAL default to 10, 0 leave the normals out"
         << std::endl;
 }
 
-int handleArgument(int argc, char* argv[], std::string& input, std::string& output, int& depth, int& forceDepth)
+int handleArgument(int argc, char* argv[], std::string& input, std::string& output, int& depth, int& forceDepth, OctreeBuildMode& buildMode, size_t& memoryBudget, std::string& statsPath, unsigned int& flags, float& maxError, bool& withAttributes, float& scalarTolerance, int& normalBits)
 {
     if (argc < 2) {
         show_usage(argv[0]);
@@ -72,6 +87,10 @@ int handleArgument(int argc, char* argv[], std::string& input, std::string& outp
         else if ((arg == "-d") || (arg == "--depth")) {
             if (i + 1 < argc) {
                 depth = std::stoi(argv[++i]);
+                if (depth < 1 || depth > (int)MAX_ENCODED_DEPTH) {
+                    std::cerr << "--depth must be between 1 and " << MAX_ENCODED_DEPTH << "." << std::endl;
+                    return 1;
+                }
             }
             else {
                 std::cerr << "--depth option requires one argument." << std::endl;
@@ -87,6 +106,89 @@ int handleArgument(int argc, char* argv[], std::string& input, std::string& outp
                 return 1;
             }
         }
+        else if ((arg == "-b") || (arg == "--build")) {
+            if (i + 1 < argc) {
+                std::string mode = argv[++i];
+                buildMode = boost::iequals(mode, "sort") ? SORT_REDUCE_BUILD : (boost::iequals(mode, "hash") ? HASH_BUILD : MAP_BUILD);
+            }
+            else {
+                std::cerr << "--build option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-m") || (arg == "--memory")) {
+            if (i + 1 < argc) {
+                memoryBudget = (size_t)std::stoull(argv[++i]) * 1024 * 1024;
+            }
+            else {
+                std::cerr << "--memory option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-s") || (arg == "--stats")) {
+            if (i + 1 < argc) {
+                statsPath = argv[++i];
+            }
+            else {
+                std::cerr << "--stats option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-l") || (arg == "--layout")) {
+            if (i + 1 < argc) {
+                std::string layout = argv[++i];
+                if (boost::iequals(layout, "breadth"))
+                    flags |= BREADTH_FIRST_LAYOUT;
+            }
+            else {
+                std::cerr << "--layout option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-c") || (arg == "--coder")) {
+            if (i + 1 < argc) {
+                std::string coder = argv[++i];
+                if (boost::iequals(coder, "range"))
+                    flags |= RANGE_CODED_OCCUPANCY;
+            }
+            else {
+                std::cerr << "--coder option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-x") || (arg == "--index")) {
+            flags |= SUB_ROOT_INDEX;
+        }
+        else if ((arg == "-e") || (arg == "--error")) {
+            if (i + 1 < argc) {
+                maxError = std::stof(argv[++i]);
+            }
+            else {
+                std::cerr << "--error option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-a") || (arg == "--attributes")) {
+            withAttributes = true;
+        }
+        else if ((arg == "-t") || (arg == "--tolerance")) {
+            if (i + 1 < argc) {
+                scalarTolerance = std::stof(argv[++i]);
+            }
+            else {
+                std::cerr << "--tolerance option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-n") || (arg == "--normalBits")) {
+            if (i + 1 < argc) {
+                normalBits = std::stoi(argv[++i]);
+            }
+            else {
+                std::cerr << "--normalBits option requires one argument." << std::endl;
+                return 1;
+            }
+        }
     }
     return 0;
 }
@@ -127,41 +229,35 @@ void testIntersection(EncodedData& data, PointCloud& pointCloud, int level)
 
 
     auto startTime = std::clock();
-    for(size_t i = 0; i < pointCloud.positions.size() * 0.05f; ++i)
+    // the same queries as one intersect per point, answered together
+    size_t numOfQueries = (size_t)std::ceil(pointCloud.positions.size() * 0.05f);
+    std::vector<intersectionState> states;
+    hitCounter = (int)decoder.intersectBatch(pointCloud.positions.data(), numOfQueries, data, octree, subNodePos, states);
+    for (auto state : states)
     {
-        auto& point = pointCloud.positions[i];
-        intersectionState state;
-        if (decoder.intersect(point, data, octree, subNodePos, state))
-        {
-            ++hitCounter;
-        }
-        /*
         switch (state)
         {
             case ALREADY_EXIST: ++alreadyExist; break;
             case SUBNODE_NOT_FOUND: ++subnodeNotFound; break;
             case DECODE_NOT_FOUND: ++decodeNotFound; break;
             case DECODE_FOUND: ++decodeFound; break;
-        }*/
+        }
     }
 //    std::cout << (std::clock() - startTime) / (CLOCKS_PER_SEC / 1000) << std::endl;
     intersectiontimingLevel[level] = (std::clock() - startTime) / CLOCKS_PER_SEC;
 
     // compute the memory usage of the octree
-    size_t memoryUsed = 0;
-    const size_t perNodeMem = sizeof(Index) + sizeof(Node);
-    for (auto& level : octree.getLevels())
-    {
-        memoryUsed += level.size() * perNodeMem;
-    }
+    size_t memoryUsed = octree.stats().totalBytes();
     memoryUseLevel[level] = memoryUsed;
+    // the same queries on the read-only succinct octree only need the children bits
+    succinctMemoryUseLevel[level] = SuccinctOctree(data).getMemoryUsage();
 
     //std::cout << "memory used:" << memoryUsed << std::endl;
-    /*std::cout << "Intersection found: " << hitCounter << std::endl;
+    std::cout << "Intersection found: " << hitCounter << std::endl;
     std::cout << "ALREADY_EXIST: " << alreadyExist << std::endl;
     std::cout << "SUBNODE_NOT_FOUND: " << subnodeNotFound << std::endl;
     std::cout << "DECODE_NOT_FOUND: " << decodeNotFound << std::endl;
-    std::cout << "DECODE_FOUND: " << decodeFound << std::endl;*/
+    std::cout << "DECODE_FOUND: " << decodeFound << std::endl;
 }
 
 void testZPF(size_t pointcount)
@@ -182,12 +278,19 @@ void testOctomap(std::string path)
 
 int main(int argc, char* argv[])
 {
-    std::string input, output;
+    std::string input, output, statsPath;
     int depth = 16;
     int forceDepth = -1;
+    OctreeBuildMode buildMode = MAP_BUILD;
+    size_t memoryBudget = 0;
+    unsigned int flags = 0;
+    float maxError = 0.f;
+    bool withAttributes = false;
+    float scalarTolerance = 0.001f;
+    int normalBits = 10;
 
     int failed = -1;
-    failed = handleArgument(argc, argv, input, output, depth, forceDepth);
+    failed = handleArgument(argc, argv, input, output, depth, forceDepth, buildMode, memoryBudget, statsPath, flags, maxError, withAttributes, scalarTolerance, normalBits);
     if (failed)
     {
         return failed;
@@ -196,8 +299,29 @@ int main(int argc, char* argv[])
     // load the point cloud 
     boost::filesystem::path inputPath(input);
 
+    // if input is ply and a memory budget is given, encode it out-of-core
+    if (boost::iequals(inputPath.extension().c_str(), ".ply") && memoryBudget > 0)
+    {
+        if (output.empty())
+            output = inputPath.parent_path().append(inputPath.stem().concat(".cpc").string()).string();
+
+        std::cout << "Encoding out-of-core: " << inputPath.string() << std::endl;
+        if (flags & (BREADTH_FIRST_LAYOUT | RANGE_CODED_OCCUPANCY))
+            std::cerr << "The breadth first layout and range coder need the whole octree in memory, using the depth first layout." << std::endl;
+        if (maxError > 0.f)
+            std::cerr << "The error budget need the whole octree in memory, encoding at full depth." << std::endl;
+        auto startTime = std::clock();
+        ExternalEncoder encoder(memoryBudget);
+        auto encodedData = encoder.encode(inputPath.string(), depth, forceDepth < 0 ? (unsigned char)-1 : (unsigned char)forceDepth);
+        std::cout << "Encoding Timing " << (std::clock() - startTime) / (CLOCKS_PER_SEC / 1000) << std::endl;
+
+        std::cout << "Compressing and saving to " << output << std::endl;
+        PointCloudIO io;
+        io.saveCpc(output, encodedData);
+        return 0;
+    }
     // if input is ply, do encoding
-    if (boost::iequals(inputPath.extension().c_str(), ".ply"))
+    else if (boost::iequals(inputPath.extension().c_str(), ".ply"))
     {
         if (output.empty())
             output = inputPath.parent_path().append(inputPath.stem().concat(".cpc").string()).string();
@@ -225,10 +349,15 @@ int main(int argc, char* argv[])
         auto startTime = std::clock();
         // Generate Octree
         std::cout << "Generating Bottom-Up Octree..." << std::endl;
-        Octree octree(depth, pointCloud);
+        Octree octree(depth, pointCloud, buildMode);
+        if (maxError > 0.f)
+            std::cout << "Truncated " << octree.truncate(DepthBudget(maxError)) << " nodes within the error budget" << std::endl;
         octreeTime = (std::clock() - startTime) / CLOCKS_PER_SEC;
-        bottomup = octree.bottomup;
-        topdown = octree.topdown;
+        auto octreeStats = octree.stats();
+        bottomup = octreeStats.bottomup;
+        topdown = octreeStats.topdown;
+        if (!statsPath.empty())
+            octreeStats.saveJson(statsPath);
 
         std::vector<CPC::BoundingBox> boxes(16);
         std::vector<int> flag(pointCloud.positions.size());
@@ -261,14 +390,20 @@ int main(int argc, char* argv[])
         //std::cout << "Bounding box Timing " << (std::clock() - bbTime) / (CLOCKS_PER_SEC / 1000) << std::endl;
         classicTiming = (std::clock() - bbTime) / CLOCKS_PER_SEC;
         
+        // the attributes of the leaves don't depend on the level, they are averaged once
+        PointCloud leaves(pointCloud.hasNormal && normalBits > 0, pointCloud.hasColor, pointCloud.hasScalar && scalarTolerance > 0.f);
+        if (withAttributes)
+            AttributeCoder::computeLeafAttributes(octree, pointCloud, leaves);
+
+        // every level is encoded into the same buffers
+        EncoderSession encoder;
         for (int i = 0; i < 16; ++i)
         {
             //int i = 12;
             // Encode
             //std::cout << "Encoding Octree..." << std::endl;
             auto encodeStart = std::clock();
-            Encoder encoder;
-            auto encodedData = encoder.encode(octree, i);
+            auto& encodedData = withAttributes ? encoder.encodeLeaves(octree, leaves, scalarTolerance, (unsigned char)normalBits, i, flags) : encoder.encode(octree, i, flags);
             auto duration = std::clock() - startTime;
             encodeTime[i] = (std::clock() - encodeStart) / CLOCKS_PER_SEC;
             //std::cout << "Generation of Octree and Encoding Octree Timing " << octreeTime - startTime / (CLOCKS_PER_SEC / 1000) << " : " << std::clock() - octreeTime / (CLOCKS_PER_SEC / 1000) << std::endl;
@@ -298,14 +433,13 @@ int main(int argc, char* argv[])
 
         auto startTime = std::clock();
         // decoded into octree
-        std::cout << "Decoding into Octree" << std::endl;
+        std::cout << "Decoding into point cloud" << std::endl;
         Decoder decoder;
-        auto octree = decoder.decode(encodedData);
+        auto pointCloud = decoder.decodePointCloud(encodedData);
         std::cout << "Decoding Timing " << std::clock() - startTime / (CLOCKS_PER_SEC / 1000) << std::endl;
 
         // write ply
         std::cout << "Writing decoded point cloud: " << output << std::endl;
-        auto& pointCloud = octree.generatePointCloud();
         std::cout << "Num of Points: " << pointCloud.positions.size() << std::endl;
         io.savePly(output, pointCloud);
     }
@@ -321,6 +455,8 @@ int main(int argc, char* argv[])
     std::cout << topdown << std::endl;
     for(int i = 0; i < 16; ++i)
         std::cout << memoryUseLevel[i] << std::endl;
+    for (int i = 0; i < 16; ++i)
+        std::cout << succinctMemoryUseLevel[i] << std::endl;
     for (int i = 0; i < 16; ++i)
         std::cout << intersectiontimingLevel[i] << std::endl;
     for (int i = 0; i < 16; ++i)